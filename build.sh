@@ -1,6 +1,10 @@
 #!/bin/sh
 CFLAGS="-g -Wall -Werror -I /usr/local/include"
 CC="gcc"
-LDLIBS="-lX11 -ldl -lGL -lavformat -lavcodec -lavutil -lswscale"
+LDLIBS="-lX11 -ldl -lGL -lpthread -lm -lavformat -lavcodec -lavutil -lswscale -lswresample -lasound"
 
 $CC $CFLAGS -o linux/bin/ffmpeg_player linux/ffmpeg_player.c $LDLIBS
+$CC $CFLAGS -O2 -o linux/bin/spsc_ring_bench linux/spsc_ring_bench.c -lpthread
+$CC $CFLAGS -O2 -o linux/bin/audio_ring_stress linux/audio_ring_stress.c -lpthread
+$CC $CFLAGS -O2 -o linux/bin/render_bench linux/render_bench.c -lEGL -ldl -lm
+$CC $CFLAGS -O2 -o linux/bin/demux_bench linux/demux_bench.c -lavformat -lavcodec -lavutil -lpthread
@@ -0,0 +1,644 @@
+// NOTE: Audio decoding and the master clock. Two threads:
+//
+// - the decode thread takes packets from the audio queue, decodes them,
+//   converts to the sink's format with swresample and writes the PCM into
+//   an AudioRing, backing off while it is full
+// - the output thread is the device callback. Every period it takes what
+//   the ring has, time stretches it to the playback speed and writes it to
+//   the sink, or fades to silence if there isn't enough. It shares no lock
+//   with the decoder or the demuxer, so a stalled decoder costs an
+//   underrun, never a late device write
+//
+// Output is placed by sample position (media time * sink rate). Gaps
+// between frame timestamps are filled with silence and overlaps trimmed,
+// so position and timestamps never drift apart by more than a sample.
+// After a seek everything before the target is trimmed to the sample.
+//
+// The clock is the position of the sample being heard: what the output
+// thread has written minus what the sink still holds, mapped back to media
+// positions at the speed they were stretched to, extrapolated from the
+// time of the last write. The output thread publishes it with a sequence
+// lock, so the renderer reading it never holds the output thread up.
+
+#include <libswresample/swresample.h>
+
+// NOTE: Timestamp jumps larger than this are discontinuities, not drift
+#define AUDIO_PLAYER_MAX_GAP_SECONDS 1
+// NOTE: How far the clock may be extrapolated past the last write before it
+// counts as stalled
+#define AUDIO_PLAYER_STALL_NS        200000000
+#define AUDIO_PLAYER_QUEUE_DEPTH     256
+#define AUDIO_PLAYER_SILENCE_SAMPLES 1024
+#define AUDIO_PLAYER_PERIOD_MS       10
+// NOTE: How far time stretch windows may move to line up, it finds
+// periods down to 200 Hz
+#define AUDIO_PLAYER_SEARCH_MS       5
+#define AUDIO_PLAYER_DEFAULT_BUFFER_MS 200
+// NOTE: Runs of audio and silence the output thread remembers, enough to
+// cover the sink's buffer even when underruns chop it up
+#define AUDIO_PLAYER_SEGMENTS        16
+
+// NOTE: Output thread. From device_frame on the sink plays media_frame on
+// at speed media frames per device frame, or silence if media_frame is
+// AV_NOPTS_VALUE
+typedef struct {
+    int64_t device_frame;
+    int64_t media_frame;
+    double  speed;
+} AudioSegment;
+
+typedef struct {
+    AVCodecContext     * av_codec_ctx;
+    AVRational           time_base;
+    AudioSink            sink;
+    PacketQueue          queue;
+    AudioRing            ring;
+    pthread_t            decode_thread;
+    pthread_t            output_thread;
+    atomic_bool          abort;
+    // NOTE: Set by the render thread, taken up by the next period
+    _Atomic double       speed;
+
+    // NOTE: Decode thread only
+    struct SwrContext  * swr_ctx;
+    int                  swr_format;
+    int                  swr_rate;
+    AVChannelLayout      swr_layout;
+    // NOTE: The converter could not be made for swr_format/rate/layout,
+    // their frames are dropped without trying again
+    bool                 swr_failed;
+    int16_t            * buffer;
+    int                  buffer_samples;
+    int16_t            * silence;
+    // NOTE: Sample position of the next sample written, AV_NOPTS_VALUE
+    // until the first frame after a start or seek
+    int64_t              next_sample;
+    // NOTE: Samples before this are trimmed, AV_NOPTS_VALUE if none
+    int64_t              target_sample;
+    // NOTE: next_sample doesn't follow what is in the ring
+    bool                 anchor_needed;
+
+    // NOTE: Output thread only
+    TimeStretch          stretch;
+    int16_t            * period;
+    int                  period_samples;
+    int64_t              device_written;
+    AudioSegment         segments[AUDIO_PLAYER_SEGMENTS];
+    int                  segment_count;
+    int                  serial;
+    bool                 primed;
+
+    // NOTE: Written by the output thread, read by the render thread. The
+    // sequence is odd while an update is in progress
+    atomic_uint          clock_sequence;
+    atomic_bool          clock_valid;
+    atomic_int           clock_serial;
+    atomic_int_fast64_t  clock_heard;
+    atomic_int_fast64_t  clock_limit;
+    _Atomic double       clock_speed;
+    atomic_uint_fast64_t clock_time_ns;
+
+    // NOTE: Decode thread only, read once it has stopped
+    uint64_t             frames;
+    uint64_t             samples_written;
+    uint64_t             silence_samples;
+    uint64_t             overlap_samples;
+    uint64_t             trimmed_samples;
+    uint64_t             resyncs;
+
+    // NOTE: Output thread only, read once it has stopped
+    uint64_t             periods;
+    uint64_t             stretched_periods;
+    uint64_t             latency_sum_ns;
+    uint64_t             latency_max_ns;
+    uint64_t             write_max_ns;
+} AudioPlayer;
+
+// NOTE: Takes an opened codec and an opened sink. The ring between the two
+// threads holds buffer_ms of audio
+bool
+audio_player_init( AudioPlayer * player, AVCodecContext * av_codec_ctx, AVRational time_base,
+                   AudioSink * sink, int buffer_ms ) {
+    memset( player, 0, sizeof( *player ) );
+    player->av_codec_ctx = av_codec_ctx;
+    player->time_base = time_base;
+    player->sink = *sink;
+    player->swr_format = -1;
+    player->next_sample = AV_NOPTS_VALUE;
+    player->target_sample = AV_NOPTS_VALUE;
+    player->anchor_needed = true;
+    atomic_init( &player->abort, false );
+    atomic_init( &player->speed, 1.0 );
+    atomic_init( &player->clock_sequence, 0 );
+    atomic_init( &player->clock_valid, false );
+    atomic_init( &player->clock_serial, 0 );
+    atomic_init( &player->clock_heard, 0 );
+    atomic_init( &player->clock_limit, 0 );
+    atomic_init( &player->clock_speed, 1.0 );
+    atomic_init( &player->clock_time_ns, 0 );
+
+    int frame_bytes = sink->channels * sizeof( int16_t );
+    player->period_samples = sink->rate * AUDIO_PLAYER_PERIOD_MS / 1000;
+    player->period = ( int16_t * )av_malloc_array( player->period_samples, frame_bytes );
+    player->silence = ( int16_t * )av_calloc( AUDIO_PLAYER_SILENCE_SAMPLES, frame_bytes );
+    bool queued = packet_queue_init( &player->queue, AUDIO_PLAYER_QUEUE_DEPTH );
+    if( queued && player->period && player->silence &&
+        time_stretch_init( &player->stretch, sink->channels, player->period_samples,
+                           sink->rate * AUDIO_PLAYER_SEARCH_MS / 1000 ) &&
+        audio_ring_init( &player->ring, sink->rate, frame_bytes, buffer_ms ) ) {
+        return true;
+    }
+
+    // NOTE: Each of these takes what is only partly set up. The sink is
+    // still the caller's
+    packet_queue_destroy( &player->queue );
+    audio_ring_destroy( &player->ring );
+    time_stretch_destroy( &player->stretch );
+    av_freep( &player->silence );
+    av_freep( &player->period );
+    return false;
+}
+
+// NOTE: Output thread only
+static void
+audio_player_publish_clock( AudioPlayer * player, bool valid, int64_t heard, int64_t limit,
+                            double speed, uint64_t time_ns ) {
+    unsigned int sequence = atomic_load_explicit( &player->clock_sequence, memory_order_relaxed );
+    atomic_store_explicit( &player->clock_sequence, sequence + 1, memory_order_relaxed );
+    atomic_thread_fence( memory_order_release );
+    atomic_store_explicit( &player->clock_valid, valid, memory_order_relaxed );
+    atomic_store_explicit( &player->clock_serial, player->serial, memory_order_relaxed );
+    atomic_store_explicit( &player->clock_heard, heard, memory_order_relaxed );
+    atomic_store_explicit( &player->clock_limit, limit, memory_order_relaxed );
+    atomic_store_explicit( &player->clock_speed, speed, memory_order_relaxed );
+    atomic_store_explicit( &player->clock_time_ns, time_ns, memory_order_relaxed );
+    atomic_store_explicit( &player->clock_sequence, sequence + 2, memory_order_release );
+}
+
+// NOTE: Media time heard at time_ns, which may be a little in the future.
+// False while nothing of the seek with the given serial is playing yet and
+// while the sink plays silence after an underrun, then video keeps its own
+// clock
+bool
+audio_player_clock( AudioPlayer * player, uint64_t time_ns, int serial, double * media_time ) {
+    unsigned int before, after;
+    bool valid;
+    int clock_serial;
+    int64_t heard, limit;
+    double speed;
+    uint64_t update_ns;
+    do {
+        before = atomic_load_explicit( &player->clock_sequence, memory_order_acquire );
+        valid = atomic_load_explicit( &player->clock_valid, memory_order_relaxed );
+        clock_serial = atomic_load_explicit( &player->clock_serial, memory_order_relaxed );
+        heard = atomic_load_explicit( &player->clock_heard, memory_order_relaxed );
+        limit = atomic_load_explicit( &player->clock_limit, memory_order_relaxed );
+        speed = atomic_load_explicit( &player->clock_speed, memory_order_relaxed );
+        update_ns = atomic_load_explicit( &player->clock_time_ns, memory_order_relaxed );
+        atomic_thread_fence( memory_order_acquire );
+        after = atomic_load_explicit( &player->clock_sequence, memory_order_relaxed );
+    } while( before != after || ( before & 1 ) );
+    if( !valid || clock_serial != serial ) return false;
+
+    int rate = player->sink.rate;
+    int64_t elapsed_ns = ( int64_t )time_ns - ( int64_t )update_ns;
+    double position = heard + elapsed_ns / 1000000000.0 * rate * speed;
+    if( position > limit || elapsed_ns > AUDIO_PLAYER_STALL_NS ) return false;
+
+    *media_time = position / rate;
+    return true;
+}
+
+// NOTE: Output thread. Remembers what the next device frames play. Hops
+// stretched at one speed are a frame apart at most from where the segment
+// they continue puts them, so they don't need a segment each
+static void
+audio_player_add_segment( AudioPlayer * player, int64_t media_frame, double speed ) {
+    if( player->segment_count > 0 ) {
+        AudioSegment * last = &player->segments[player->segment_count - 1];
+        int64_t length = player->device_written - last->device_frame;
+        bool continues = media_frame == AV_NOPTS_VALUE ? last->media_frame == AV_NOPTS_VALUE :
+                         last->media_frame != AV_NOPTS_VALUE && last->speed == speed &&
+                         llabs( last->media_frame + llround( length * speed ) - media_frame ) <= 1;
+        if( continues ) return;
+    }
+
+    if( player->segment_count == AUDIO_PLAYER_SEGMENTS ) {
+        memmove( player->segments, player->segments + 1,
+                 ( AUDIO_PLAYER_SEGMENTS - 1 ) * sizeof( AudioSegment ) );
+        --player->segment_count;
+    }
+    player->segments[player->segment_count].device_frame = player->device_written;
+    player->segments[player->segment_count].media_frame = media_frame;
+    player->segments[player->segment_count].speed = speed;
+    ++player->segment_count;
+}
+
+// NOTE: Output thread, right after a write. Finds the segment the sink is
+// playing now
+static void
+audio_player_update_clock( AudioPlayer * player ) {
+    int64_t heard_device = player->device_written - audio_sink_delay( &player->sink );
+    uint64_t now = get_nanoseconds();
+
+    for( int i = player->segment_count - 1; i >= 0; --i ) {
+        AudioSegment * segment = &player->segments[i];
+        if( segment->device_frame > heard_device ) continue;
+
+        if( segment->media_frame == AV_NOPTS_VALUE ) break;
+        int64_t end = i + 1 < player->segment_count ? player->segments[i + 1].device_frame :
+                                                      player->device_written;
+        double speed = segment->speed;
+        audio_player_publish_clock( player, true,
+                                    segment->media_frame +
+                                    llround( ( heard_device - segment->device_frame ) * speed ),
+                                    segment->media_frame +
+                                    llround( ( end - segment->device_frame ) * speed ),
+                                    speed, now );
+        return;
+    }
+    audio_player_publish_clock( player, false, 0, 0, 1.0, now );
+}
+
+void *
+audio_output_thread_main( void * arg ) {
+    AudioPlayer * player = ( AudioPlayer * )arg;
+    AudioRing * ring = &player->ring;
+    TimeStretch * stretch = &player->stretch;
+    size_t frame_bytes = player->sink.channels * sizeof( int16_t );
+    uint64_t period_ns = AUDIO_PLAYER_PERIOD_MS * 1000000ULL;
+
+    while( !atomic_load_explicit( &player->abort, memory_order_acquire ) ) {
+        int serial;
+        if( audio_ring_take_flush( ring, &serial ) ) {
+            audio_sink_flush( &player->sink );
+            player->serial = serial;
+            player->segment_count = 0;
+            player->primed = false;
+            time_stretch_reset( stretch );
+            audio_player_publish_clock( player, false, 0, 0, 1.0, get_nanoseconds() );
+        }
+
+        // NOTE: Start the device once there is enough for a hop, and stop
+        // feeding it at the end of the stream rather than playing silence
+        // forever. The last few ms that don't fill a window are dropped
+        size_t wanted = ( size_t )time_stretch_wanted( stretch ) * frame_bytes;
+        if( !player->primed ) {
+            if( audio_ring_fill( ring ) < wanted ) {
+                presentation_wait_until( get_nanoseconds() + period_ns );
+                continue;
+            }
+            player->primed = true;
+        }
+
+        if( wanted > 0 ) {
+            int64_t first_frame = 0;
+            size_t got = audio_ring_read( ring, time_stretch_tail( stretch ), wanted, &first_frame );
+            time_stretch_append( stretch, ( int )( got / frame_bytes ), first_frame );
+        }
+
+        double speed = atomic_load_explicit( &player->speed, memory_order_relaxed );
+        int64_t media_frame;
+        if( time_stretch_process( stretch, speed, player->period, &media_frame ) ) {
+            audio_player_add_segment( player, media_frame, speed );
+            if( speed != 1.0 ) ++player->stretched_periods;
+        } else {
+            time_stretch_fade_out( stretch, player->period );
+            audio_player_add_segment( player, AV_NOPTS_VALUE, 1.0 );
+            if( audio_ring_ended( ring ) && audio_ring_fill( ring ) == 0 ) player->primed = false;
+        }
+        player->device_written += player->period_samples;
+
+        uint64_t latency = audio_ring_latency_ns( ring );
+        player->latency_sum_ns += latency;
+        if( latency > player->latency_max_ns ) player->latency_max_ns = latency;
+        ++player->periods;
+
+        uint64_t write_start = get_nanoseconds();
+        if( !audio_sink_write( &player->sink, player->period, player->period_samples ) ) {
+            presentation_wait_until( get_nanoseconds() + period_ns );
+        }
+        uint64_t write_time = get_nanoseconds() - write_start;
+        if( write_time > player->write_max_ns ) player->write_max_ns = write_time;
+        audio_player_update_clock( player );
+    }
+    return NULL;
+}
+
+// NOTE: Decode thread. Waits until the ring is empty, then the samples
+// written next start at next_sample
+static bool
+audio_player_set_anchor( AudioPlayer * player ) {
+    while( !audio_ring_empty( &player->ring ) ) {
+        if( atomic_load_explicit( &player->abort, memory_order_acquire ) ) return false;
+        presentation_wait_until( get_nanoseconds() + 1000000 );
+    }
+    audio_ring_set_anchor( &player->ring, player->next_sample );
+    player->anchor_needed = false;
+    return true;
+}
+
+// NOTE: Decode thread. Blocks until the ring took everything
+static bool
+audio_player_write( AudioPlayer * player, const int16_t * samples, int count ) {
+    const uint8_t * bytes = ( const uint8_t * )samples;
+    size_t remaining = ( size_t )count * player->sink.channels * sizeof( int16_t );
+    while( true ) {
+        size_t written = audio_ring_write( &player->ring, bytes, remaining );
+        bytes += written;
+        remaining -= written;
+        if( remaining == 0 ) return true;
+
+        if( atomic_load_explicit( &player->abort, memory_order_acquire ) ) return false;
+        presentation_wait_until( get_nanoseconds() + AUDIO_PLAYER_PERIOD_MS * 500000ULL );
+    }
+}
+
+// NOTE: Writes count samples at next_sample, or silence if samples is NULL.
+// Whatever lies before the seek target is skipped
+static bool
+audio_player_output( AudioPlayer * player, const int16_t * samples, int64_t count ) {
+    int channels = player->sink.channels;
+    if( player->target_sample != AV_NOPTS_VALUE ) {
+        int64_t skip = player->target_sample - player->next_sample;
+        if( skip > count ) skip = count;
+        if( skip > 0 ) {
+            player->next_sample += skip;
+            player->trimmed_samples += skip;
+            count -= skip;
+            if( samples ) samples += skip * channels;
+        }
+        if( count == 0 ) return true;
+        player->target_sample = AV_NOPTS_VALUE;
+    }
+
+    if( player->anchor_needed && !audio_player_set_anchor( player ) ) return false;
+
+    while( count > 0 ) {
+        int chunk = count > AUDIO_PLAYER_SILENCE_SAMPLES ? AUDIO_PLAYER_SILENCE_SAMPLES : ( int )count;
+        if( !audio_player_write( player, samples ? samples : player->silence, chunk ) ) {
+            return false;
+        }
+        player->next_sample += chunk;
+        player->samples_written += chunk;
+        count -= chunk;
+        if( samples ) samples += chunk * channels;
+    }
+    return true;
+}
+
+// NOTE: Rebuilds the converter when the decoder's output changes. When
+// that fails the error is printed once and frames are dropped until the
+// output changes again
+static bool
+audio_player_setup_swr( AudioPlayer * player, const AVFrame * frame ) {
+    if( ( player->swr_ctx || player->swr_failed ) && frame->format == player->swr_format &&
+        frame->sample_rate == player->swr_rate &&
+        av_channel_layout_compare( &frame->ch_layout, &player->swr_layout ) == 0 ) {
+        return !player->swr_failed;
+    }
+
+    player->swr_format = frame->format;
+    player->swr_rate = frame->sample_rate;
+    av_channel_layout_uninit( &player->swr_layout );
+    av_channel_layout_copy( &player->swr_layout, &frame->ch_layout );
+
+    AVChannelLayout out_layout;
+    av_channel_layout_default( &out_layout, player->sink.channels );
+    swr_free( &player->swr_ctx );
+    int ret = swr_alloc_set_opts2( &player->swr_ctx, &out_layout, AV_SAMPLE_FMT_S16,
+                                   player->sink.rate, &frame->ch_layout, frame->format,
+                                   frame->sample_rate, 0, NULL );
+    av_channel_layout_uninit( &out_layout );
+    if( ret < 0 || swr_init( player->swr_ctx ) < 0 ) {
+        fprintf( stderr, "Could not convert audio from %s %d Hz\n",
+                 av_get_sample_fmt_name( frame->format ), frame->sample_rate );
+        swr_free( &player->swr_ctx );
+        player->swr_failed = true;
+        return false;
+    }
+    player->swr_failed = false;
+    return true;
+}
+
+static bool
+audio_player_play_frame( AudioPlayer * player, AVFrame * frame ) {
+    if( !audio_player_setup_swr( player, frame ) ) return true;
+
+    int wanted = swr_get_out_samples( player->swr_ctx, frame->nb_samples );
+    if( wanted > player->buffer_samples ) {
+        av_freep( &player->buffer );
+        player->buffer = ( int16_t * )av_malloc_array( wanted, player->sink.channels * sizeof( int16_t ) );
+        player->buffer_samples = player->buffer ? wanted : 0;
+        if( !player->buffer ) return false;
+    }
+
+    uint8_t * out[1] = { ( uint8_t * )player->buffer };
+    int converted = swr_convert( player->swr_ctx, out, wanted,
+                                 ( const uint8_t * * )frame->extended_data, frame->nb_samples );
+    if( converted <= 0 ) return true;
+    ++player->frames;
+
+    // NOTE: Position of the first converted sample. What swresample still
+    // holds back came in before the end of this frame
+    int rate = player->sink.rate;
+    int64_t start = AV_NOPTS_VALUE;
+    if( frame->best_effort_timestamp != AV_NOPTS_VALUE ) {
+        int64_t frame_end = av_rescale_q( frame->best_effort_timestamp, player->time_base,
+                                          ( AVRational ){ 1, rate } ) +
+                            av_rescale( frame->nb_samples, rate, frame->sample_rate );
+        start = frame_end - swr_get_delay( player->swr_ctx, rate ) - converted;
+    }
+
+    const int16_t * samples = player->buffer;
+    int64_t count = converted;
+    if( start != AV_NOPTS_VALUE ) {
+        int64_t gap = player->next_sample != AV_NOPTS_VALUE ? start - player->next_sample : 0;
+        if( player->next_sample == AV_NOPTS_VALUE ||
+            llabs( gap ) > ( int64_t )rate * AUDIO_PLAYER_MAX_GAP_SECONDS ) {
+            if( player->next_sample != AV_NOPTS_VALUE ) ++player->resyncs;
+            player->next_sample = start;
+            player->anchor_needed = true;
+        } else if( gap > 0 ) {
+            player->silence_samples += gap;
+            if( !audio_player_output( player, NULL, gap ) ) return false;
+        } else if( gap < 0 ) {
+            int64_t overlap = -gap < count ? -gap : count;
+            player->overlap_samples += overlap;
+            samples += overlap * player->sink.channels;
+            count -= overlap;
+        }
+    } else if( player->next_sample == AV_NOPTS_VALUE ) {
+        player->next_sample = 0;
+    }
+
+    return audio_player_output( player, samples, count );
+}
+
+// NOTE: Like the video decoder it keeps running after the end of the
+// stream and only stops when the queue is aborted
+void *
+audio_decode_thread_main( void * arg ) {
+    AudioPlayer * player = ( AudioPlayer * )arg;
+    AVCodecContext * av_codec_ctx = player->av_codec_ctx;
+    AVPacket * packet = av_packet_alloc();
+    AVFrame * frame = av_frame_alloc();
+
+    bool failed = false;
+    while( !failed ) {
+        PacketQueueFlush flush_info;
+        int ret = packet_queue_get( &player->queue, packet, &flush_info );
+        if( ret == QUEUE_ABORT ) break;
+
+        if( ret == QUEUE_FLUSH ) {
+            avcodec_flush_buffers( av_codec_ctx );
+            swr_free( &player->swr_ctx );
+            audio_ring_flush( &player->ring, flush_info.serial );
+            player->next_sample = AV_NOPTS_VALUE;
+            player->anchor_needed = true;
+            player->target_sample = flush_info.target_pts == AV_NOPTS_VALUE ? AV_NOPTS_VALUE :
+                av_rescale_q( flush_info.target_pts, player->time_base,
+                              ( AVRational ){ 1, player->sink.rate } );
+            continue;
+        }
+
+        bool draining = ( ret == QUEUE_EOF );
+        if( avcodec_send_packet( av_codec_ctx, draining ? NULL : packet ) >= 0 ) {
+            while( avcodec_receive_frame( av_codec_ctx, frame ) >= 0 ) {
+                failed = !audio_player_play_frame( player, frame );
+                av_frame_unref( frame );
+                if( failed ) break;
+            }
+        }
+        av_packet_unref( packet );
+        if( draining ) {
+            avcodec_flush_buffers( av_codec_ctx );
+            audio_ring_set_end( &player->ring );
+        }
+    }
+
+    av_frame_free( &frame );
+    av_packet_free( &packet );
+    return NULL;
+}
+
+// NOTE: Render thread. The output thread stretches from its next period on
+// and the clock follows once that period is heard
+void
+audio_player_set_speed( AudioPlayer * player, double speed ) {
+    atomic_store_explicit( &player->speed, speed, memory_order_relaxed );
+}
+
+bool
+audio_player_start( AudioPlayer * player ) {
+    if( pthread_create( &player->output_thread, NULL, audio_output_thread_main, player ) != 0 ) {
+        return false;
+    }
+    if( pthread_create( &player->decode_thread, NULL, audio_decode_thread_main, player ) != 0 ) {
+        atomic_store_explicit( &player->abort, true, memory_order_release );
+        pthread_join( player->output_thread, NULL );
+        return false;
+    }
+    return true;
+}
+
+// NOTE: After pipeline_stop, which aborts the queue so the demuxer can't
+// block on it
+void
+audio_player_stop( AudioPlayer * player ) {
+    atomic_store_explicit( &player->abort, true, memory_order_release );
+    packet_queue_abort( &player->queue );
+    pthread_join( player->decode_thread, NULL );
+    pthread_join( player->output_thread, NULL );
+    packet_queue_destroy( &player->queue );
+    audio_ring_destroy( &player->ring );
+    time_stretch_destroy( &player->stretch );
+    audio_sink_close( &player->sink );
+    swr_free( &player->swr_ctx );
+    av_channel_layout_uninit( &player->swr_layout );
+    av_freep( &player->buffer );
+    av_freep( &player->silence );
+    av_freep( &player->period );
+}
+
+void
+audio_player_print_stats( AudioPlayer * player ) {
+    fprintf( stdout, "Audio (%s, %d Hz, %d channels): %llu frames, %.3f s written, "
+                     "%llu sink underruns\n",
+             audio_sink_names[player->sink.type], player->sink.rate, player->sink.channels,
+             ( unsigned long long )player->frames,
+             ( double )player->samples_written / player->sink.rate,
+             ( unsigned long long )player->sink.underruns );
+    fprintf( stdout, "Audio ring: %llu periods, %llu underruns, %llu overruns, "
+                     "latency mean %.1f ms, max %.1f ms, longest device write %.1f ms\n",
+             ( unsigned long long )player->periods,
+             ( unsigned long long )atomic_load( &player->ring.underruns ),
+             ( unsigned long long )atomic_load( &player->ring.overruns ),
+             player->periods ? player->latency_sum_ns / 1000000.0 / player->periods : 0.0,
+             player->latency_max_ns / 1000000.0,
+             player->write_max_ns / 1000000.0 );
+    fprintf( stdout, "Audio timing: %llu samples of silence in gaps, %llu overlapping samples "
+                     "trimmed, %llu trimmed after seeks, %llu resyncs, %llu periods time "
+                     "stretched\n",
+             ( unsigned long long )player->silence_samples,
+             ( unsigned long long )player->overlap_samples,
+             ( unsigned long long )player->trimmed_samples,
+             ( unsigned long long )player->resyncs,
+             ( unsigned long long )player->stretched_periods );
+}
+
+// NOTE: Audio clock minus the PTS of each frame as it is shown. Positive
+// means video is late. Printed every AV_OFFSET_REPORT_NS when enabled
+#define AV_OFFSET_REPORT_NS 5000000000ULL
+
+typedef struct {
+    bool     report;
+    uint64_t count;
+    double   sum;
+    double   max;
+    uint64_t window_start_ns;
+    uint64_t window_count;
+    double   window_sum;
+    double   window_max;
+} AvOffsetStats;
+
+void
+av_offset_stats_init( AvOffsetStats * stats, bool report ) {
+    memset( stats, 0, sizeof( *stats ) );
+    stats->report = report;
+}
+
+// NOTE: Also reports how much audio sits in the ring, the part of the
+// output latency the clock has to see through
+void
+av_offset_stats_add( AvOffsetStats * stats, AudioPlayer * player, uint64_t now,
+                     double media_time, double offset ) {
+    ++stats->count;
+    stats->sum += offset;
+    if( fabs( offset ) > stats->max ) stats->max = fabs( offset );
+
+    if( !stats->window_count ) stats->window_start_ns = now;
+    ++stats->window_count;
+    stats->window_sum += offset;
+    if( fabs( offset ) > stats->window_max ) stats->window_max = fabs( offset );
+    if( now - stats->window_start_ns >= AV_OFFSET_REPORT_NS ) {
+        if( stats->report ) {
+            fprintf( stdout, "A/V offset at %.1f s: mean %+.2f ms, max %.2f ms, "
+                             "ring latency %.1f ms\n", media_time,
+                     stats->window_sum / stats->window_count * 1000.0,
+                     stats->window_max * 1000.0,
+                     audio_ring_latency_ns( &player->ring ) / 1000000.0 );
+        }
+        stats->window_count = 0;
+        stats->window_sum = 0;
+        stats->window_max = 0;
+    }
+}
+
+void
+av_offset_stats_print( AvOffsetStats * stats ) {
+    fprintf( stdout, "A/V offset: %llu frames, mean %+.2f ms, max %.2f ms\n",
+             ( unsigned long long )stats->count,
+             stats->count ? stats->sum / stats->count * 1000.0 : 0.0,
+             stats->max * 1000.0 );
+}
@@ -0,0 +1,209 @@
+// NOTE: Single-producer/single-consumer byte ring for PCM between the audio
+// decoder and the audio output thread. Same layout as SpscRing: head is
+// only written by the consumer, tail only by the producer, indices grow
+// monotonically and the buffer is a power of two. Every call finishes in a
+// bounded number of steps whatever the other side is doing, so the output
+// thread can never be held up by a stalled decoder. When there isn't
+// enough data it gets what there is and the caller plays silence.
+//
+// The producer can't move head, so a flush (seek) only records where the
+// stale data ends and the consumer drops it on its next read. Sample
+// positions travel as an anchor, the position of the first frame written
+// after the anchor was set, which the producer may only change while the
+// ring is empty.
+
+#define AUDIO_RING_CACHE_LINE 64
+
+typedef struct {
+    _Alignas( AUDIO_RING_CACHE_LINE ) atomic_size_t head;
+    size_t                                          cached_tail;
+    int                                             flush_seen;
+    atomic_uint_fast64_t                            underruns;
+
+    _Alignas( AUDIO_RING_CACHE_LINE ) atomic_size_t tail;
+    size_t                                          cached_head;
+    atomic_uint_fast64_t                            overruns;
+
+    // NOTE: Producer to consumer, published with flush_count and tail
+    _Alignas( AUDIO_RING_CACHE_LINE ) atomic_size_t discard;
+    atomic_int                                      flush_count;
+    atomic_int                                      flush_serial;
+    atomic_size_t                                   anchor_byte;
+    atomic_int_fast64_t                             anchor_frame;
+    atomic_bool                                     end;
+
+    _Alignas( AUDIO_RING_CACHE_LINE ) uint8_t *     data;
+    size_t                                          mask;
+    size_t                                          capacity;
+    size_t                                          frame_bytes;
+    size_t                                          bytes_per_second;
+} AudioRing;
+
+// NOTE: Holds milliseconds of audio at rate frames per second
+bool
+audio_ring_init( AudioRing * ring, int rate, int frame_bytes, int milliseconds ) {
+    memset( ring, 0, sizeof( *ring ) );
+    ring->frame_bytes = frame_bytes;
+    ring->bytes_per_second = ( size_t )rate * frame_bytes;
+    ring->capacity = ( size_t )rate * milliseconds / 1000 * frame_bytes;
+    if( ring->capacity < ( size_t )frame_bytes ) ring->capacity = frame_bytes;
+
+    size_t size = 1;
+    while( size < ring->capacity ) size <<= 1;
+    ring->data = ( uint8_t * )calloc( size, 1 );
+    if( !ring->data ) return false;
+    ring->mask = size - 1;
+
+    atomic_init( &ring->head, 0 );
+    atomic_init( &ring->tail, 0 );
+    atomic_init( &ring->underruns, 0 );
+    atomic_init( &ring->overruns, 0 );
+    atomic_init( &ring->discard, 0 );
+    atomic_init( &ring->flush_count, 0 );
+    atomic_init( &ring->flush_serial, 0 );
+    atomic_init( &ring->anchor_byte, 0 );
+    atomic_init( &ring->anchor_frame, 0 );
+    atomic_init( &ring->end, false );
+    return true;
+}
+
+void
+audio_ring_destroy( AudioRing * ring ) {
+    free( ring->data );
+    ring->data = NULL;
+}
+
+// NOTE: Producer only. Copies as many whole frames as fit and returns the
+// bytes taken. Anything short of bytes counts as an overrun, the producer
+// has to come back later
+size_t
+audio_ring_write( AudioRing * ring, const void * data, size_t bytes ) {
+    size_t tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+    size_t space = ring->capacity - ( tail - ring->cached_head );
+    if( space < bytes ) {
+        ring->cached_head = atomic_load_explicit( &ring->head, memory_order_acquire );
+        space = ring->capacity - ( tail - ring->cached_head );
+    }
+
+    size_t count = bytes < space ? bytes : space;
+    count -= count % ring->frame_bytes;
+    if( count < bytes ) {
+        atomic_fetch_add_explicit( &ring->overruns, 1, memory_order_relaxed );
+    }
+
+    size_t offset = tail & ring->mask;
+    size_t first = ring->mask + 1 - offset;
+    if( first > count ) first = count;
+    memcpy( ring->data + offset, data, first );
+    memcpy( ring->data, ( const uint8_t * )data + first, count - first );
+    atomic_store_explicit( &ring->tail, tail + count, memory_order_release );
+    return count;
+}
+
+// NOTE: Producer only. Everything written so far is dropped by the
+// consumer's next read, which reports the serial
+void
+audio_ring_flush( AudioRing * ring, int serial ) {
+    size_t tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+    atomic_store_explicit( &ring->discard, tail, memory_order_relaxed );
+    atomic_store_explicit( &ring->flush_serial, serial, memory_order_relaxed );
+    atomic_store_explicit( &ring->end, false, memory_order_relaxed );
+    atomic_fetch_add_explicit( &ring->flush_count, 1, memory_order_release );
+}
+
+// NOTE: Producer only. True once the consumer has taken or dropped
+// everything, the only time the anchor may change
+bool
+audio_ring_empty( AudioRing * ring ) {
+    ring->cached_head = atomic_load_explicit( &ring->head, memory_order_acquire );
+    return ring->cached_head == atomic_load_explicit( &ring->tail, memory_order_relaxed );
+}
+
+// NOTE: Producer only, while the ring is empty. The next frame written is
+// at position frame
+void
+audio_ring_set_anchor( AudioRing * ring, int64_t frame ) {
+    size_t tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+    atomic_store_explicit( &ring->anchor_byte, tail, memory_order_relaxed );
+    atomic_store_explicit( &ring->anchor_frame, frame, memory_order_relaxed );
+}
+
+// NOTE: Producer only. Nothing follows what was written, so running dry
+// isn't an underrun
+void
+audio_ring_set_end( AudioRing * ring ) {
+    atomic_store_explicit( &ring->end, true, memory_order_release );
+}
+
+// NOTE: Consumer only. Drops data from before the last flush. Returns true
+// with the flush's serial if there was one since the last call
+bool
+audio_ring_take_flush( AudioRing * ring, int * serial ) {
+    int flush_count = atomic_load_explicit( &ring->flush_count, memory_order_acquire );
+    if( flush_count == ring->flush_seen ) return false;
+
+    ring->flush_seen = flush_count;
+    size_t discard = atomic_load_explicit( &ring->discard, memory_order_relaxed );
+    size_t head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+    if( ( ptrdiff_t )( discard - head ) > 0 ) {
+        // NOTE: The flush was published after the writes it drops, so tail
+        // is at least discard
+        if( ( ptrdiff_t )( discard - ring->cached_tail ) > 0 ) ring->cached_tail = discard;
+        atomic_store_explicit( &ring->head, discard, memory_order_release );
+    }
+    *serial = atomic_load_explicit( &ring->flush_serial, memory_order_relaxed );
+    return true;
+}
+
+// NOTE: Consumer only. Copies up to bytes of whole frames and returns the
+// bytes copied, with the position of the first frame. Coming up short is
+// an underrun unless the producer has marked the end
+size_t
+audio_ring_read( AudioRing * ring, void * data, size_t bytes, int64_t * first_frame ) {
+    size_t head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+    size_t available = ring->cached_tail - head;
+    if( available < bytes ) {
+        ring->cached_tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+        available = ring->cached_tail - head;
+    }
+
+    size_t count = bytes < available ? bytes : available;
+    count -= count % ring->frame_bytes;
+    if( count < bytes && !atomic_load_explicit( &ring->end, memory_order_acquire ) ) {
+        atomic_fetch_add_explicit( &ring->underruns, 1, memory_order_relaxed );
+    }
+    if( count == 0 ) return 0;
+
+    size_t anchor_byte = atomic_load_explicit( &ring->anchor_byte, memory_order_relaxed );
+    int64_t anchor_frame = atomic_load_explicit( &ring->anchor_frame, memory_order_relaxed );
+    *first_frame = anchor_frame + ( int64_t )( ( head - anchor_byte ) / ring->frame_bytes );
+
+    size_t offset = head & ring->mask;
+    size_t first = ring->mask + 1 - offset;
+    if( first > count ) first = count;
+    memcpy( data, ring->data + offset, first );
+    memcpy( ( uint8_t * )data + first, ring->data, count - first );
+    atomic_store_explicit( &ring->head, head + count, memory_order_release );
+    return count;
+}
+
+// NOTE: Consumer only. The producer has marked the end, whatever is still
+// in the ring is the last of it
+bool
+audio_ring_ended( AudioRing * ring ) {
+    return atomic_load_explicit( &ring->end, memory_order_acquire );
+}
+
+// NOTE: Any thread, approximate while the others run
+size_t
+audio_ring_fill( AudioRing * ring ) {
+    size_t head = atomic_load_explicit( &ring->head, memory_order_acquire );
+    size_t tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+    return tail - head;
+}
+
+// NOTE: How long the queued audio plays
+uint64_t
+audio_ring_latency_ns( AudioRing * ring ) {
+    return ( uint64_t )audio_ring_fill( ring ) * 1000000000 / ring->bytes_per_second;
+}
@@ -0,0 +1,210 @@
+// NOTE: Stress test for the audio ring. A producer writes frames numbered by
+// their sample position in random chunks and stalls at random, often for
+// longer than the ring holds, and now and then flushes and jumps to a new
+// position like a seek. A consumer acts as the device callback: it wakes
+// every period on an absolute deadline, takes one period and checks every
+// frame it gets against the position the ring reports.
+//
+// Passes if no frame is wrong and no callback took longer than the limit.
+// The ring calls never wait for the producer, so a slow callback can only
+// come from the scheduler preempting it.
+//
+// Usage: ./audio_ring_stress [seconds] [buffer_ms] [callback_limit_us]
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "audio_ring.c"
+
+#define STRESS_RATE      48000
+#define STRESS_PERIOD_MS 5
+
+typedef struct {
+    AudioRing   ring;
+    int         seconds;
+    atomic_bool done;
+
+    // NOTE: Producer
+    uint64_t    produced;
+    uint64_t    stalls;
+    uint64_t    flushes;
+
+    // NOTE: Consumer
+    uint64_t    callbacks;
+    uint64_t    consumed;
+    uint64_t    silent_frames;
+    uint64_t    wrong_frames;
+    uint64_t    late_wakeups;
+    uint64_t  * callback_ns;
+} Stress;
+
+static uint64_t
+now_ns( void ) {
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return ( uint64_t )t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void
+sleep_until( uint64_t deadline_ns ) {
+    struct timespec deadline = { deadline_ns / 1000000000, deadline_ns % 1000000000 };
+    while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL ) == EINTR ) {
+    }
+}
+
+static int
+compare_u64( const void * a, const void * b ) {
+    uint64_t x = *( const uint64_t * )a;
+    uint64_t y = *( const uint64_t * )b;
+    return ( x > y ) - ( x < y );
+}
+
+static void *
+producer_main( void * arg ) {
+    Stress * stress = ( Stress * )arg;
+    uint32_t chunk[4096];
+    uint32_t position = 0;
+    unsigned int seed = 1;
+    int serial = 0;
+    audio_ring_set_anchor( &stress->ring, position );
+
+    while( !atomic_load_explicit( &stress->done, memory_order_acquire ) ) {
+        int roll = rand_r( &seed ) % 100;
+
+        // NOTE: A decode stall, up to twice the ring
+        if( roll < 15 ) {
+            ++stress->stalls;
+            sleep_until( now_ns() + ( uint64_t )( rand_r( &seed ) % 400 ) * 1000000 );
+            continue;
+        }
+
+        // NOTE: A seek. The anchor can only move once the consumer has
+        // dropped what was there
+        if( roll < 18 ) {
+            ++stress->flushes;
+            audio_ring_flush( &stress->ring, ++serial );
+            while( !audio_ring_empty( &stress->ring ) &&
+                   !atomic_load_explicit( &stress->done, memory_order_acquire ) ) {
+                sleep_until( now_ns() + 1000000 );
+            }
+            position += 1000000;
+            audio_ring_set_anchor( &stress->ring, position );
+            continue;
+        }
+
+        int count = 1 + rand_r( &seed ) % 4096;
+        for( int i = 0; i < count; ++i ) chunk[i] = position + i;
+
+        size_t bytes = count * sizeof( uint32_t );
+        size_t written = 0;
+        while( written < bytes && !atomic_load_explicit( &stress->done, memory_order_acquire ) ) {
+            written += audio_ring_write( &stress->ring, ( uint8_t * )chunk + written, bytes - written );
+            if( written < bytes ) sleep_until( now_ns() + STRESS_PERIOD_MS * 500000ULL );
+        }
+        position += written / sizeof( uint32_t );
+        stress->produced += written / sizeof( uint32_t );
+    }
+    return NULL;
+}
+
+static void *
+consumer_main( void * arg ) {
+    Stress * stress = ( Stress * )arg;
+    int period = STRESS_RATE * STRESS_PERIOD_MS / 1000;
+    uint32_t * buffer = ( uint32_t * )malloc( period * sizeof( uint32_t ) );
+    uint64_t total = ( uint64_t )stress->seconds * 1000 / STRESS_PERIOD_MS;
+    uint64_t deadline = now_ns();
+
+    for( uint64_t i = 0; i < total; ++i ) {
+        deadline += STRESS_PERIOD_MS * 1000000ULL;
+        sleep_until( deadline );
+        if( now_ns() > deadline + STRESS_PERIOD_MS * 1000000ULL ) ++stress->late_wakeups;
+
+        uint64_t start = now_ns();
+        int serial;
+        audio_ring_take_flush( &stress->ring, &serial );
+        int64_t first = 0;
+        size_t got = audio_ring_read( &stress->ring, buffer, period * sizeof( uint32_t ), &first );
+        stress->callback_ns[i] = now_ns() - start;
+
+        int frames = ( int )( got / sizeof( uint32_t ) );
+        for( int j = 0; j < frames; ++j ) {
+            if( buffer[j] != ( uint32_t )( first + j ) ) ++stress->wrong_frames;
+        }
+        stress->consumed += frames;
+        stress->silent_frames += period - frames;
+        ++stress->callbacks;
+    }
+
+    atomic_store_explicit( &stress->done, true, memory_order_release );
+    free( buffer );
+    return NULL;
+}
+
+int
+main( int argc, char const * argv[] ) {
+    Stress stress;
+    memset( &stress, 0, sizeof( stress ) );
+    stress.seconds = argc > 1 ? atoi( argv[1] ) : 5;
+    int buffer_ms = argc > 2 ? atoi( argv[2] ) : 200;
+    uint64_t limit_ns = ( argc > 3 ? atoi( argv[3] ) : 2000 ) * 1000ULL;
+
+    if( stress.seconds <= 0 || buffer_ms < STRESS_PERIOD_MS ) {
+        fprintf( stdout, "Usage: ./audio_ring_stress [seconds] [buffer_ms] [callback_limit_us]\n" );
+        return 0;
+    }
+
+    uint64_t total = ( uint64_t )stress.seconds * 1000 / STRESS_PERIOD_MS;
+    stress.callback_ns = ( uint64_t * )calloc( total, sizeof( uint64_t ) );
+    if( !stress.callback_ns ||
+        !audio_ring_init( &stress.ring, STRESS_RATE, sizeof( uint32_t ), buffer_ms ) ) {
+        fprintf( stderr, "Out of memory\n" );
+        return 1;
+    }
+    atomic_init( &stress.done, false );
+
+    pthread_t producer, consumer;
+    pthread_create( &consumer, NULL, consumer_main, &stress );
+    pthread_create( &producer, NULL, producer_main, &stress );
+    pthread_join( consumer, NULL );
+    pthread_join( producer, NULL );
+
+    qsort( stress.callback_ns, total, sizeof( uint64_t ), compare_u64 );
+    uint64_t max_ns = stress.callback_ns[total - 1];
+    fprintf( stdout, "Audio ring stress: %d s, %d ms ring, %d ms periods\n",
+             stress.seconds, buffer_ms, STRESS_PERIOD_MS );
+    fprintf( stdout, "  producer  %llu frames, %llu stalls, %llu flushes, %llu overruns\n",
+             ( unsigned long long )stress.produced, ( unsigned long long )stress.stalls,
+             ( unsigned long long )stress.flushes,
+             ( unsigned long long )atomic_load( &stress.ring.overruns ) );
+    fprintf( stdout, "  consumer  %llu callbacks, %llu frames, %llu silent, %llu underruns, "
+                     "%llu late wakeups\n",
+             ( unsigned long long )stress.callbacks, ( unsigned long long )stress.consumed,
+             ( unsigned long long )stress.silent_frames,
+             ( unsigned long long )atomic_load( &stress.ring.underruns ),
+             ( unsigned long long )stress.late_wakeups );
+    fprintf( stdout, "  callback  p50 %llu ns, p99 %llu ns, max %llu ns (limit %llu ns)\n",
+             ( unsigned long long )stress.callback_ns[total / 2],
+             ( unsigned long long )stress.callback_ns[( uint64_t )( total * 0.99 )],
+             ( unsigned long long )max_ns, ( unsigned long long )limit_ns );
+
+    bool passed = stress.wrong_frames == 0 && max_ns <= limit_ns;
+    if( stress.wrong_frames ) {
+        fprintf( stdout, "FAILED: %llu frames out of place\n",
+                 ( unsigned long long )stress.wrong_frames );
+    }
+    if( max_ns > limit_ns ) fprintf( stdout, "FAILED: a callback took longer than the limit\n" );
+    if( passed ) fprintf( stdout, "PASSED\n" );
+
+    audio_ring_destroy( &stress.ring );
+    free( stress.callback_ns );
+    return passed ? 0 : 1;
+}
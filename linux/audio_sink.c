@@ -0,0 +1,195 @@
+// NOTE: Where decoded audio goes. Every sink takes interleaved signed 16-bit
+// samples at a fixed rate and channel count and blocks in audio_sink_write
+// while its buffer is full, so the audio thread runs at playback speed.
+//
+// - ALSA, the "default" device unless another one is named. On desktops
+//   that is routed to PulseAudio or PipeWire by their ALSA plugin
+// - null, throws the samples away
+// - WAV, writes them to a file
+//
+// The null and WAV sinks pretend to be a device with AUDIO_SINK_BUFFER_NS
+// of buffering that plays in real time on CLOCK_MONOTONIC. Without a sound
+// card they keep the same timing as a real device, so A/V sync can be
+// tested on headless machines.
+
+#include <alsa/asoundlib.h>
+
+#define AUDIO_SINK_BUFFER_NS 100000000
+
+typedef enum {
+    AUDIO_SINK_NONE,
+    AUDIO_SINK_ALSA,
+    AUDIO_SINK_NULL,
+    AUDIO_SINK_WAV
+} AudioSinkType;
+
+const char * audio_sink_names[] = { "none", "alsa", "null", "wav" };
+
+typedef struct {
+    AudioSinkType type;
+    int           rate;
+    int           channels;
+
+    snd_pcm_t   * pcm;
+
+    FILE        * file;
+    uint64_t      data_bytes;
+
+    // NOTE: Emulated device, the time the samples written so far run out
+    uint64_t      drain_ns;
+
+    uint64_t      underruns;
+} AudioSink;
+
+static void
+audio_sink_put_le( uint8_t * bytes, uint32_t value, int size ) {
+    for( int i = 0; i < size; ++i ) bytes[i] = ( uint8_t )( value >> ( 8 * i ) );
+}
+
+// NOTE: Canonical 44 byte header. Called again on close with the real size
+static void
+audio_sink_write_wav_header( AudioSink * sink ) {
+    uint8_t header[44];
+    uint32_t block_align = ( uint32_t )sink->channels * 2;
+    memcpy( header, "RIFF", 4 );
+    audio_sink_put_le( header + 4, ( uint32_t )( 36 + sink->data_bytes ), 4 );
+    memcpy( header + 8, "WAVEfmt ", 8 );
+    audio_sink_put_le( header + 16, 16, 4 );
+    audio_sink_put_le( header + 20, 1, 2 );
+    audio_sink_put_le( header + 22, ( uint32_t )sink->channels, 2 );
+    audio_sink_put_le( header + 24, ( uint32_t )sink->rate, 4 );
+    audio_sink_put_le( header + 28, ( uint32_t )sink->rate * block_align, 4 );
+    audio_sink_put_le( header + 32, block_align, 2 );
+    audio_sink_put_le( header + 34, 16, 2 );
+    memcpy( header + 36, "data", 4 );
+    audio_sink_put_le( header + 40, ( uint32_t )sink->data_bytes, 4 );
+
+    fseek( sink->file, 0, SEEK_SET );
+    fwrite( header, 1, sizeof( header ), sink->file );
+    fseek( sink->file, 0, SEEK_END );
+}
+
+// NOTE: target is the ALSA device name or the WAV file name, NULL for the
+// defaults
+bool
+audio_sink_open( AudioSink * sink, AudioSinkType type, const char * target,
+                 int rate, int channels ) {
+    memset( sink, 0, sizeof( *sink ) );
+    sink->type = type;
+    sink->rate = rate;
+    sink->channels = channels;
+
+    if( type == AUDIO_SINK_ALSA ) {
+        const char * device = target ? target : "default";
+        int ret = snd_pcm_open( &sink->pcm, device, SND_PCM_STREAM_PLAYBACK, 0 );
+        if( ret < 0 ) {
+            fprintf( stderr, "Could not open ALSA device %s: %s\n", device, snd_strerror( ret ) );
+            sink->pcm = NULL;
+            return false;
+        }
+        // NOTE: Lets alsa-lib resample if the hardware can't do our rate
+        ret = snd_pcm_set_params( sink->pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                                  channels, rate, 1, AUDIO_SINK_BUFFER_NS / 1000 );
+        if( ret < 0 ) {
+            fprintf( stderr, "Could not set up ALSA device %s: %s\n", device, snd_strerror( ret ) );
+            snd_pcm_close( sink->pcm );
+            sink->pcm = NULL;
+            return false;
+        }
+    } else if( type == AUDIO_SINK_WAV ) {
+        const char * file_name = target ? target : "audio.wav";
+        sink->file = fopen( file_name, "wb" );
+        if( !sink->file ) {
+            fprintf( stderr, "Could not open %s: %s\n", file_name, strerror( errno ) );
+            return false;
+        }
+        audio_sink_write_wav_header( sink );
+    }
+    return type != AUDIO_SINK_NONE;
+}
+
+// NOTE: Emulated device. Starts playing on the first write, runs dry if we
+// don't keep it fed and sleeps while more than its buffer is queued
+static void
+audio_sink_emulate_write( AudioSink * sink, int count ) {
+    uint64_t now = get_nanoseconds();
+    if( sink->drain_ns < now ) {
+        if( sink->drain_ns ) ++sink->underruns;
+        sink->drain_ns = now;
+    }
+    sink->drain_ns += ( uint64_t )count * 1000000000 / sink->rate;
+    if( sink->drain_ns > now + AUDIO_SINK_BUFFER_NS ) {
+        presentation_wait_until( sink->drain_ns - AUDIO_SINK_BUFFER_NS );
+    }
+}
+
+bool
+audio_sink_write( AudioSink * sink, const int16_t * samples, int count ) {
+    if( sink->type == AUDIO_SINK_ALSA ) {
+        while( count > 0 ) {
+            snd_pcm_sframes_t written = snd_pcm_writei( sink->pcm, samples, count );
+            if( written < 0 ) {
+                if( written == -EPIPE ) ++sink->underruns;
+                int ret = snd_pcm_recover( sink->pcm, ( int )written, 1 );
+                if( ret < 0 ) {
+                    fprintf( stderr, "ALSA write failed: %s\n", snd_strerror( ret ) );
+                    return false;
+                }
+                continue;
+            }
+            samples += written * sink->channels;
+            count -= ( int )written;
+        }
+        return true;
+    }
+
+    if( sink->type == AUDIO_SINK_WAV ) {
+        size_t bytes = ( size_t )count * sink->channels * sizeof( int16_t );
+        if( fwrite( samples, 1, bytes, sink->file ) != bytes ) {
+            fprintf( stderr, "Could not write audio: %s\n", strerror( errno ) );
+            return false;
+        }
+        sink->data_bytes += bytes;
+    }
+    audio_sink_emulate_write( sink, count );
+    return true;
+}
+
+// NOTE: Samples written but not heard yet, exact to the sample as far as
+// the device reports it
+int64_t
+audio_sink_delay( AudioSink * sink ) {
+    if( sink->type == AUDIO_SINK_ALSA ) {
+        snd_pcm_sframes_t delay = 0;
+        if( snd_pcm_delay( sink->pcm, &delay ) < 0 || delay < 0 ) return 0;
+        return delay;
+    }
+
+    uint64_t now = get_nanoseconds();
+    if( sink->drain_ns <= now ) return 0;
+    return ( int64_t )( ( sink->drain_ns - now ) * sink->rate / 1000000000 );
+}
+
+// NOTE: Throws away whatever is queued, for seeking
+void
+audio_sink_flush( AudioSink * sink ) {
+    if( sink->type == AUDIO_SINK_ALSA ) {
+        snd_pcm_drop( sink->pcm );
+        snd_pcm_prepare( sink->pcm );
+    }
+    sink->drain_ns = 0;
+}
+
+void
+audio_sink_close( AudioSink * sink ) {
+    if( sink->pcm ) {
+        snd_pcm_drop( sink->pcm );
+        snd_pcm_close( sink->pcm );
+        sink->pcm = NULL;
+    }
+    if( sink->file ) {
+        audio_sink_write_wav_header( sink );
+        fclose( sink->file );
+        sink->file = NULL;
+    }
+}
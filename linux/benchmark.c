@@ -0,0 +1,76 @@
+// NOTE: Headless benchmark. Runs the same demuxer and decoder threads as
+// playback, but the consumer takes frames as soon as they are ready and
+// releases them without rendering, so nothing needs a display and the
+// result is the decode+convert throughput of this build.
+
+typedef struct {
+    DecodeLatency decode_latency;
+    LatencyStats  demux_latency;
+    LatencyStats  convert_latency;
+} BenchmarkStats;
+
+// NOTE: Takes an opened codec and a pipeline with its context fields set,
+// returns the process exit code
+int
+benchmark_run( Pipeline * pipeline, int packet_queue_depth, int frame_queue_depth ) {
+    BenchmarkStats * stats = ( BenchmarkStats * )malloc( sizeof( BenchmarkStats ) );
+    if( !stats ) {
+        fprintf( stderr, "Out of memory\n" );
+        return 1;
+    }
+    decode_latency_init( &stats->decode_latency );
+    latency_stats_init( &stats->demux_latency );
+    latency_stats_init( &stats->convert_latency );
+    pipeline->decode_latency = &stats->decode_latency;
+    pipeline->demux_latency = &stats->demux_latency;
+    pipeline->convert_latency = &stats->convert_latency;
+
+    uint64_t start = get_nanoseconds();
+    if( !pipeline_start( pipeline, packet_queue_depth, frame_queue_depth ) ) {
+        fprintf( stderr, "Could not start demuxer and decoder threads\n" );
+        free( stats );
+        return 1;
+    }
+
+    uint64_t frames = 0;
+    while( true ) {
+        AVFrame * frame = pipeline_pop_frame( pipeline );
+        if( frame ) {
+            pipeline_release_frame( pipeline, frame );
+            ++frames;
+            continue;
+        }
+
+        if( pipeline_finished( pipeline ) ) break;
+
+        struct timespec backoff = { 0, 100000 };
+        nanosleep( &backoff, NULL );
+    }
+    double seconds = ( get_nanoseconds() - start ) / 1000000000.0;
+    pipeline_stop( pipeline );
+
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+
+    AVCodecContext * av_codec_ctx = pipeline->av_codec_ctx;
+    fprintf( stdout, "Benchmark: %s %dx%d %s, %d threads, %s threading, lowres %d\n",
+             av_codec_ctx->codec->name, av_codec_ctx->width, av_codec_ctx->height,
+             av_get_pix_fmt_name( av_codec_ctx->pix_fmt ), av_codec_ctx->thread_count,
+             av_codec_ctx->active_thread_type & FF_THREAD_FRAME ? "frame" :
+             av_codec_ctx->active_thread_type & FF_THREAD_SLICE ? "slice" : "no",
+             av_codec_ctx->lowres );
+    fprintf( stdout, "  %llu frames in %.3f s, %.1f frames/s, peak RSS %.1f MiB\n",
+             ( unsigned long long )frames, seconds, seconds > 0 ? frames / seconds : 0.0,
+             usage.ru_maxrss / 1024.0 );
+    latency_stats_print( "demux", &stats->demux_latency );
+    latency_stats_print( "decode", &stats->decode_latency.stats );
+    latency_stats_print( "convert", &stats->convert_latency );
+
+    FramePoolStats pool_stats = frame_pool_get_stats( &pipeline->frame_pool );
+    fprintf( stdout, "  frame pool: %llu buffer allocations, %llu frame allocations\n",
+             ( unsigned long long )pool_stats.buffer_allocations,
+             ( unsigned long long )pool_stats.frame_allocations );
+
+    free( stats );
+    return 0;
+}
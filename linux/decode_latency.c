@@ -0,0 +1,76 @@
+// NOTE: Per-frame decode latency, the time from handing a packet to the
+// decoder until the frame with the same PTS comes out. Frame threading
+// hides one frame per extra thread inside the decoder, so this is what we
+// pay in latency for its throughput. Packets are matched to frames by PTS
+// through a small table because frames come out in presentation order.
+//
+// The time includes waits for the renderer when the frame queue is full,
+// so the numbers are only meaningful while the decoder is the bottleneck.
+
+#define DECODE_LATENCY_PENDING 64
+
+typedef struct {
+    int64_t  pts;
+    uint64_t sent_ns;
+} DecodeLatencyPending;
+
+typedef struct {
+    // NOTE: Decoder thread only, read once it has stopped
+    DecodeLatencyPending pending[DECODE_LATENCY_PENDING];
+    int                  pending_index;
+    uint64_t             packets_sent;
+    uint64_t             frames_received;
+    int                  max_in_flight;
+    LatencyStats         stats;
+} DecodeLatency;
+
+void
+decode_latency_init( DecodeLatency * latency ) {
+    memset( latency, 0, sizeof( *latency ) );
+    for( int i = 0; i < DECODE_LATENCY_PENDING; ++i ) {
+        latency->pending[i].pts = AV_NOPTS_VALUE;
+    }
+}
+
+// NOTE: Call right before the first avcodec_send_packet for a packet
+void
+decode_latency_packet_sent( DecodeLatency * latency, AVPacket * packet ) {
+    ++latency->packets_sent;
+    if( packet->pts == AV_NOPTS_VALUE ) return;
+
+    // NOTE: The oldest entry is overwritten, it belonged to a packet the
+    // decoder dropped or one without a matching frame
+    DecodeLatencyPending * pending = &latency->pending[latency->pending_index];
+    pending->pts = packet->pts;
+    pending->sent_ns = get_nanoseconds();
+    latency->pending_index = ( latency->pending_index + 1 ) % DECODE_LATENCY_PENDING;
+}
+
+void
+decode_latency_frame_received( DecodeLatency * latency, AVFrame * frame ) {
+    ++latency->frames_received;
+    int in_flight = ( int )( latency->packets_sent - latency->frames_received );
+    if( in_flight > latency->max_in_flight ) latency->max_in_flight = in_flight;
+    if( frame->pts == AV_NOPTS_VALUE ) return;
+
+    for( int i = 0; i < DECODE_LATENCY_PENDING; ++i ) {
+        DecodeLatencyPending * pending = &latency->pending[i];
+        if( pending->pts != frame->pts ) continue;
+
+        latency_stats_add( &latency->stats, get_nanoseconds() - pending->sent_ns );
+        pending->pts = AV_NOPTS_VALUE;
+        return;
+    }
+}
+
+void
+decode_latency_print_stats( DecodeLatency * latency ) {
+    fprintf( stdout, "Decode latency: %llu frames, mean %.3f ms, p50 %.1f ms, "
+                     "p99 %.1f ms, max %.3f ms, up to %d frames in flight\n",
+             ( unsigned long long )latency->stats.count,
+             latency_stats_mean( &latency->stats ),
+             latency_stats_percentile( &latency->stats, 0.5 ),
+             latency_stats_percentile( &latency->stats, 0.99 ),
+             latency->stats.max_ns / 1000000.0,
+             latency->max_in_flight );
+}
@@ -0,0 +1,201 @@
+// NOTE: Demuxes a file as fast as possible through libavformat's file
+// protocol, mmap_io and readahead_io, and compares packets per second, read
+// syscalls (syscr from /proc/self/io) and page faults. Nothing is decoded,
+// so this is the I/O and container parsing cost alone.
+//
+// --cold drops the file from the page cache before every run with
+// posix_fadvise, which needs the pages to be clean, so the runs measure
+// the disk or network and not memcpy from the page cache. The readahead
+// line adds how often the demuxer had to wait for the I/O thread.
+//
+// Usage: ./demux_bench [--runs N] [--cold] [--readahead-mb N] file
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include <libavformat/avformat.h>
+
+#include "mmap_io.c"
+#include "readahead_io.c"
+
+typedef enum {
+    DEMUX_FILE,
+    DEMUX_MMAP,
+    DEMUX_READAHEAD
+} DemuxMode;
+
+const char * demux_mode_names[] = { "file", "mmap", "readahead" };
+
+typedef struct {
+    double   seconds;
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t read_syscalls;
+    uint64_t minor_faults;
+    uint64_t major_faults;
+    uint64_t stalls;
+    uint64_t stall_ns;
+} DemuxRun;
+
+static uint64_t
+now_ns( void ) {
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return ( uint64_t )t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// NOTE: Read syscalls made by the process so far, 0 if /proc/self/io
+// isn't there
+static uint64_t
+read_syscalls( void ) {
+    FILE * file = fopen( "/proc/self/io", "r" );
+    if( !file ) return 0;
+
+    char line[128];
+    unsigned long long count = 0;
+    while( fgets( line, sizeof( line ), file ) ) {
+        if( sscanf( line, "syscr: %llu", &count ) == 1 ) break;
+    }
+    fclose( file );
+    return count;
+}
+
+static void
+drop_page_cache( const char * file_name ) {
+    int fd = open( file_name, O_RDONLY );
+    if( fd < 0 ) return;
+    posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+    close( fd );
+}
+
+static bool
+demux_run( const char * file_name, DemuxMode mode, int readahead_mb, DemuxRun * run ) {
+    memset( run, 0, sizeof( *run ) );
+    struct rusage usage_start;
+    getrusage( RUSAGE_SELF, &usage_start );
+    uint64_t syscalls_start = read_syscalls();
+    uint64_t start = now_ns();
+
+    MmapIo io;
+    ReadaheadIo readahead;
+    AVFormatContext * av_format_ctx = avformat_alloc_context();
+    if( mode == DEMUX_MMAP ) {
+        if( !mmap_io_open( &io, file_name ) ) {
+            fprintf( stderr, "Could not map %s\n", file_name );
+            avformat_free_context( av_format_ctx );
+            return false;
+        }
+        av_format_ctx->pb = io.avio;
+    } else if( mode == DEMUX_READAHEAD ) {
+        if( !readahead_io_open( &readahead, file_name, readahead_mb ) ) {
+            fprintf( stderr, "Could not open %s for read-ahead\n", file_name );
+            avformat_free_context( av_format_ctx );
+            return false;
+        }
+        av_format_ctx->pb = readahead.avio;
+    }
+    bool opened = avformat_open_input( &av_format_ctx, file_name, NULL, NULL ) == 0;
+    if( !opened || avformat_find_stream_info( av_format_ctx, NULL ) < 0 ) {
+        fprintf( stderr, "Could not open %s\n", file_name );
+        if( opened ) avformat_close_input( &av_format_ctx );
+        if( mode == DEMUX_MMAP ) mmap_io_close( &io );
+        if( mode == DEMUX_READAHEAD ) readahead_io_close( &readahead );
+        return false;
+    }
+
+    AVPacket * packet = av_packet_alloc();
+    while( av_read_frame( av_format_ctx, packet ) >= 0 ) {
+        ++run->packets;
+        run->bytes += packet->size;
+        av_packet_unref( packet );
+    }
+    av_packet_free( &packet );
+    avformat_close_input( &av_format_ctx );
+    if( mode == DEMUX_MMAP ) mmap_io_close( &io );
+    if( mode == DEMUX_READAHEAD ) {
+        run->stalls = readahead.stalls;
+        run->stall_ns = readahead.stall_ns;
+        readahead_io_close( &readahead );
+    }
+
+    run->seconds = ( now_ns() - start ) / 1000000000.0;
+    run->read_syscalls = read_syscalls() - syscalls_start;
+    struct rusage usage_end;
+    getrusage( RUSAGE_SELF, &usage_end );
+    run->minor_faults = usage_end.ru_minflt - usage_start.ru_minflt;
+    run->major_faults = usage_end.ru_majflt - usage_start.ru_majflt;
+    return true;
+}
+
+static void
+print_runs( const char * name, DemuxRun * runs, int count ) {
+    DemuxRun best = runs[0];
+    double seconds = 0;
+    uint64_t syscalls = 0, minor = 0, major = 0, stalls = 0, stall_ns = 0;
+    for( int i = 0; i < count; ++i ) {
+        if( runs[i].seconds < best.seconds ) best = runs[i];
+        seconds += runs[i].seconds;
+        syscalls += runs[i].read_syscalls;
+        minor += runs[i].minor_faults;
+        major += runs[i].major_faults;
+        stalls += runs[i].stalls;
+        stall_ns += runs[i].stall_ns;
+    }
+    fprintf( stdout, "%-9s %9.0f packets/s %8.1f MiB/s (best %9.0f packets/s)  "
+                     "%8.0f reads  %8.0f minor %6.0f major faults per run\n",
+             name, best.packets * count / seconds, best.bytes * count / seconds / 1048576.0,
+             best.packets / best.seconds, ( double )syscalls / count, ( double )minor / count,
+             ( double )major / count );
+    if( stalls ) {
+        fprintf( stdout, "%-9s %.1f stalls for %.1f ms per run\n", "", ( double )stalls / count,
+                 stall_ns / 1000000.0 / count );
+    }
+}
+
+int
+main( int argc, char const * argv[] ) {
+    const char * file_name = NULL;
+    int run_count = 5;
+    bool cold = false;
+    int readahead_mb = READAHEAD_IO_DEFAULT_MB;
+    for( int i = 1; i < argc; ++i ) {
+        if( strcmp( argv[i], "--runs" ) == 0 && i + 1 < argc ) {
+            run_count = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--readahead-mb" ) == 0 && i + 1 < argc ) {
+            readahead_mb = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--cold" ) == 0 ) {
+            cold = true;
+        } else {
+            file_name = argv[i];
+        }
+    }
+    if( !file_name || run_count < 1 || readahead_mb < 1 ) {
+        fprintf( stdout, "Usage: ./demux_bench [--runs N] [--cold] [--readahead-mb N] file\n" );
+        return 0;
+    }
+
+    av_log_set_level( AV_LOG_ERROR );
+    DemuxRun * runs = ( DemuxRun * )calloc( run_count, sizeof( DemuxRun ) );
+    fprintf( stdout, "%s, %d runs%s\n", file_name, run_count, cold ? ", page cache dropped before each" : "" );
+
+    // NOTE: One untimed pass so a warm run doesn't pay for the first read
+    if( !cold && !demux_run( file_name, DEMUX_FILE, readahead_mb, &runs[0] ) ) return 1;
+
+    for( int mode = DEMUX_FILE; mode <= DEMUX_READAHEAD; ++mode ) {
+        for( int i = 0; i < run_count; ++i ) {
+            if( cold ) drop_page_cache( file_name );
+            if( !demux_run( file_name, ( DemuxMode )mode, readahead_mb, &runs[i] ) ) return 1;
+        }
+        print_runs( demux_mode_names[mode], runs, run_count );
+    }
+    free( runs );
+    return 0;
+}
@@ -0,0 +1,76 @@
+// NOTE: What to do when the decoder can't keep up. A frame that is more than
+// the threshold behind the presentation clock isn't rendered at all. If
+// frames keep arriving late we escalate through decoder skip levels, which
+// the decoder thread applies to av_codec_ctx, and step back down once we
+// have been on time for a while.
+//
+// Level 0: decode everything
+// Level 1: skip the loop filter on non-reference frames
+// Level 2: also skip decoding non-reference frames
+// Level 3: also skip the loop filter on every frame
+
+#define DROP_POLICY_MAX_LEVEL        3
+#define DROP_POLICY_ESCALATE_AFTER   8
+#define DROP_POLICY_RELAX_AFTER      60
+#define DROP_POLICY_MAX_CONSECUTIVE  8
+
+typedef struct {
+    // NOTE: Seconds behind the clock before a frame is dropped, 0 disables
+    double   threshold;
+    int      level;
+    int      late_streak;
+    int      on_time_streak;
+    int      consecutive_drops;
+
+    uint64_t late_frames;
+    uint64_t dropped_frames;
+} DropPolicy;
+
+void
+drop_policy_init( DropPolicy * policy, double threshold ) {
+    memset( policy, 0, sizeof( *policy ) );
+    policy->threshold = threshold;
+}
+
+// NOTE: Decides whether a frame lateness seconds behind the clock should be
+// dropped and updates the skip level. tolerance is how late a frame may be
+// and still count as on time
+bool
+drop_policy_should_drop( DropPolicy * policy, double lateness, double tolerance ) {
+    if( policy->threshold <= 0 ) return false;
+
+    if( lateness > policy->threshold ) {
+        policy->on_time_streak = 0;
+        if( ++policy->late_streak >= DROP_POLICY_ESCALATE_AFTER &&
+            policy->level < DROP_POLICY_MAX_LEVEL ) {
+            ++policy->level;
+            policy->late_streak = 0;
+        }
+
+        // NOTE: Still show something now and then, so a decoder that is
+        // hopelessly behind doesn't freeze the picture
+        if( policy->consecutive_drops < DROP_POLICY_MAX_CONSECUTIVE ) {
+            ++policy->consecutive_drops;
+            ++policy->dropped_frames;
+            return true;
+        }
+    } else if( lateness <= tolerance ) {
+        policy->late_streak = 0;
+        if( ++policy->on_time_streak >= DROP_POLICY_RELAX_AFTER && policy->level > 0 ) {
+            --policy->level;
+            policy->on_time_streak = 0;
+        }
+    }
+
+    policy->consecutive_drops = 0;
+    if( lateness > tolerance ) ++policy->late_frames;
+    return false;
+}
+
+// NOTE: Decoder thread only, between packets
+void
+drop_policy_apply_level( AVCodecContext * av_codec_ctx, int level ) {
+    av_codec_ctx->skip_loop_filter = level >= 3 ? AVDISCARD_ALL :
+                                     level >= 1 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    av_codec_ctx->skip_frame = level >= 2 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
@@ -0,0 +1,177 @@
+// NOTE: Offscreen GL 4.5 core context for machines without a display or
+// GPU, e.g. Mesa llvmpipe on CI. We prefer a surfaceless display
+// (EGL_MESA_platform_surfaceless) and fall back to a pbuffer on the
+// default display. Either way rendering goes into a framebuffer object of
+// the requested size, so the renderer doesn't care which one we got.
+//
+// The GL loader resolves functions from libGL.so.1, which EGL itself
+// doesn't load. We keep our own reference so the function pointers stay
+// valid no matter how the binary was linked.
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <dlfcn.h>
+
+typedef struct {
+    EGLDisplay   display;
+    EGLContext   context;
+    EGLSurface   surface;
+    bool         surfaceless;
+    void       * gl_library;
+    GLuint       framebuffer;
+    GLuint       color_buffer;
+    int          width;
+    int          height;
+} EglOffscreen;
+
+static EGLContext
+egl_offscreen_create_context( EGLDisplay display, EGLConfig config ) {
+    EGLint context_attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 5,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    if( !eglBindAPI( EGL_OPENGL_API ) ) return EGL_NO_CONTEXT;
+    return eglCreateContext( display, config, EGL_NO_CONTEXT, context_attributes );
+}
+
+static bool
+egl_offscreen_init_surfaceless( EglOffscreen * offscreen ) {
+    const char * client_extensions = eglQueryString( EGL_NO_DISPLAY, EGL_EXTENSIONS );
+    if( !client_extensions || !strstr( client_extensions, "EGL_MESA_platform_surfaceless" ) ) {
+        return false;
+    }
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = ( PFNEGLGETPLATFORMDISPLAYEXTPROC )
+        eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+    if( !get_platform_display ) return false;
+
+    offscreen->display = get_platform_display( EGL_PLATFORM_SURFACELESS_MESA,
+                                               EGL_DEFAULT_DISPLAY, NULL );
+    if( offscreen->display == EGL_NO_DISPLAY ||
+        !eglInitialize( offscreen->display, NULL, NULL ) ) {
+        offscreen->display = EGL_NO_DISPLAY;
+        return false;
+    }
+
+    // NOTE: Surfaceless contexts need no config
+    offscreen->context = egl_offscreen_create_context( offscreen->display, EGL_NO_CONFIG_KHR );
+    if( offscreen->context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent( offscreen->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                         offscreen->context ) ) {
+        if( offscreen->context != EGL_NO_CONTEXT ) {
+            eglDestroyContext( offscreen->display, offscreen->context );
+        }
+        eglTerminate( offscreen->display );
+        offscreen->display = EGL_NO_DISPLAY;
+        offscreen->context = EGL_NO_CONTEXT;
+        return false;
+    }
+
+    offscreen->surfaceless = true;
+    return true;
+}
+
+static bool
+egl_offscreen_init_pbuffer( EglOffscreen * offscreen ) {
+    offscreen->display = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+    if( offscreen->display == EGL_NO_DISPLAY ||
+        !eglInitialize( offscreen->display, NULL, NULL ) ) {
+        return false;
+    }
+
+    EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint config_count = 0;
+    if( !eglChooseConfig( offscreen->display, config_attributes, &config, 1, &config_count ) ||
+        config_count < 1 ) {
+        eglTerminate( offscreen->display );
+        return false;
+    }
+
+    // NOTE: The pbuffer only exists to make the context current, we draw
+    // into our own framebuffer object
+    EGLint pbuffer_attributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    offscreen->surface = eglCreatePbufferSurface( offscreen->display, config, pbuffer_attributes );
+    offscreen->context = egl_offscreen_create_context( offscreen->display, config );
+    if( offscreen->surface == EGL_NO_SURFACE || offscreen->context == EGL_NO_CONTEXT ||
+        !eglMakeCurrent( offscreen->display, offscreen->surface, offscreen->surface,
+                         offscreen->context ) ) {
+        fprintf( stderr, "Could not create an EGL pbuffer context (0x%x)\n", eglGetError() );
+        return false;
+    }
+
+    return true;
+}
+
+// NOTE: Creates the context, loads GL and binds a width x height RGBA8
+// framebuffer object. Returns false if there is no usable EGL
+bool
+egl_offscreen_create( EglOffscreen * offscreen, int width, int height ) {
+    memset( offscreen, 0, sizeof( *offscreen ) );
+    offscreen->display = EGL_NO_DISPLAY;
+    offscreen->context = EGL_NO_CONTEXT;
+    offscreen->surface = EGL_NO_SURFACE;
+
+    offscreen->gl_library = dlopen( "libGL.so.1", RTLD_NOW | RTLD_GLOBAL );
+    if( !offscreen->gl_library ) {
+        fprintf( stderr, "Could not load libGL.so.1\n" );
+        return false;
+    }
+
+    if( !egl_offscreen_init_surfaceless( offscreen ) &&
+        !egl_offscreen_init_pbuffer( offscreen ) ) {
+        fprintf( stderr, "No EGL display with OpenGL 4.5 core\n" );
+        return false;
+    }
+
+    if( !sogl_loadOpenGL() ) {
+        const char * * failures = sogl_getFailures();
+        while( *failures ) fprintf( stderr, "Failed to load function %s\n", *failures++ );
+    }
+
+    offscreen->width = width;
+    offscreen->height = height;
+    glCreateRenderbuffers( 1, &offscreen->color_buffer );
+    glNamedRenderbufferStorage( offscreen->color_buffer, GL_RGBA8, width, height );
+    glCreateFramebuffers( 1, &offscreen->framebuffer );
+    glNamedFramebufferRenderbuffer( offscreen->framebuffer, GL_COLOR_ATTACHMENT0,
+                                    GL_RENDERBUFFER, offscreen->color_buffer );
+    if( glCheckNamedFramebufferStatus( offscreen->framebuffer, GL_FRAMEBUFFER ) !=
+        GL_FRAMEBUFFER_COMPLETE ) {
+        fprintf( stderr, "Offscreen framebuffer is incomplete\n" );
+        return false;
+    }
+
+    glBindFramebuffer( GL_FRAMEBUFFER, offscreen->framebuffer );
+    glViewport( 0, 0, width, height );
+    return true;
+}
+
+void
+egl_offscreen_destroy( EglOffscreen * offscreen ) {
+    if( offscreen->framebuffer ) glDeleteFramebuffers( 1, &offscreen->framebuffer );
+    if( offscreen->color_buffer ) glDeleteRenderbuffers( 1, &offscreen->color_buffer );
+
+    if( offscreen->display != EGL_NO_DISPLAY ) {
+        eglMakeCurrent( offscreen->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+        if( offscreen->context != EGL_NO_CONTEXT ) {
+            eglDestroyContext( offscreen->display, offscreen->context );
+        }
+        if( offscreen->surface != EGL_NO_SURFACE ) {
+            eglDestroySurface( offscreen->display, offscreen->surface );
+        }
+        eglTerminate( offscreen->display );
+    }
+
+    if( offscreen->gl_library ) dlclose( offscreen->gl_library );
+    memset( offscreen, 0, sizeof( *offscreen ) );
+}
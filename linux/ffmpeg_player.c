@@ -13,19 +13,108 @@
 #include <libavutil/time.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/mastering_display_metadata.h>
 
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <time.h> // time precision Linux
 
 
 typedef struct {
-    float ratio;
     int texture_width;
     int texture_height;
+    int texture_format;
 } FrameData;
 
+uint64_t
+get_nanoseconds( void ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( uint64_t )now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
 // NOTE: Order is important
 #include "../opengl/opengl_render.c"
+#include "spsc_ring.c"
+#include "frame_pool.c"
+#include "drop_policy.c"
+#include "reduced_decode.c"
+#include "latency_stats.c"
+#include "decode_latency.c"
+#include "mmap_io.c"
+#include "readahead_io.c"
+#include "keyframe_index.c"
+#include "pipeline.c"
+#include "benchmark.c"
+#include "presentation.c"
+#include "audio_sink.c"
+#include "audio_ring.c"
+#include "time_stretch.c"
+#include "audio_player.c"
+#include "seek_control.c"
+#include "playback_speed.c"
+
+typedef enum {
+    UPLOAD_DIRECT,
+    UPLOAD_PBO,
+    UPLOAD_PERSISTENT
+} UploadMode;
+
+const char * upload_mode_names[] = { "direct", "pbo", "persistent" };
+
+typedef enum {
+    DECODE_THREADS_AUTO,
+    DECODE_THREADS_FRAME,
+    DECODE_THREADS_SLICE
+} DecodeThreadType;
+
+typedef enum {
+    INPUT_IO_AUTO,
+    INPUT_IO_MMAP,
+    INPUT_IO_READAHEAD,
+    INPUT_IO_FILE
+} InputIoMode;
+
+typedef struct {
+    // NOTE: What was opened, INPUT_IO_FILE when libavformat reads itself
+    InputIoMode  mode;
+    MmapIo       mmap;
+    ReadaheadIo  readahead;
+} InputIo;
+
+typedef struct {
+    const char * file_name;
+    InputIoMode  io_mode;
+    int          readahead_mb;
+    int          packet_queue_depth;
+    int          frame_queue_depth;
+    UploadMode   upload_mode;
+    int          upload_buffers;
+    double       refresh_rate;
+    double       drop_threshold;
+    int          decode_threads;
+    DecodeThreadType decode_thread_type;
+    bool         decode_latency;
+    bool         benchmark;
+    bool         force_convert;
+    OpenGLToneMap tone_map;
+    OpenGLScaleFilter scale_filter;
+    int          window_width;
+    int          window_height;
+    bool         reduced_decode;
+    bool         index_scan;
+    const char * ipc_path;
+    AudioSinkType audio_sink;
+    const char * audio_target;
+    int          audio_buffer_ms;
+    double       speed;
+    bool         print_stats;
+} PlayerOptions;
 
 typedef GLXContext ( * glXCreateContextAttribsARBFUNC )( Display*,
                                                          GLXFBConfig,
@@ -33,32 +122,361 @@ typedef GLXContext ( * glXCreateContextAttribsARBFUNC )( Display*,
                                                          Bool,
                                                          const int*);
 
+// NOTE: Gives back a frame that won't be shown
+void
+drop_frame( Pipeline * pipeline, OpenGLUploader * uploader, AVFrame * frame ) {
+    opengl_release_staged_frame( uploader, frame );
+    pipeline_release_frame( pipeline, frame );
+}
+
+// NOTE: Opens the I/O for a file. auto reads ahead on a thread on network
+// filesystems and maps anything else. Returns the AVIOContext for
+// av_format_ctx->pb, or NULL to let libavformat open the file itself
+AVIOContext *
+open_input_io( InputIo * io, const char * file_name, InputIoMode mode, int readahead_mb ) {
+    if( mode == INPUT_IO_AUTO ) {
+        mode = readahead_io_is_network_file( file_name ) ? INPUT_IO_READAHEAD : INPUT_IO_MMAP;
+    }
+
+    io->mode = INPUT_IO_FILE;
+    if( mode == INPUT_IO_MMAP && mmap_io_open( &io->mmap, file_name ) ) {
+        io->mode = mode;
+        return io->mmap.avio;
+    }
+    if( mode == INPUT_IO_READAHEAD && readahead_io_open( &io->readahead, file_name, readahead_mb ) ) {
+        io->mode = mode;
+        return io->readahead.avio;
+    }
+    return NULL;
+}
+
+// NOTE: After avformat_close_input
+void
+close_input_io( InputIo * io, bool print_stats ) {
+    if( io->mode == INPUT_IO_MMAP ) {
+        if( print_stats ) mmap_io_print_stats( &io->mmap );
+        mmap_io_close( &io->mmap );
+    } else if( io->mode == INPUT_IO_READAHEAD ) {
+        if( print_stats ) readahead_io_print_stats( &io->readahead );
+        readahead_io_close( &io->readahead );
+    }
+    io->mode = INPUT_IO_FILE;
+}
+
+// NOTE: Opens the best audio stream, its decoder and the sink. The sink
+// gets the stream's rate and at most two channels, swresample converts the
+// rest. A sound card that can't be opened falls back to the null sink so
+// video keeps the same timing. Returns false if there is no audio to play
+bool
+open_audio( AVFormatContext * av_format_ctx, int video_index, AudioSinkType sink_type,
+            const char * sink_target, int buffer_ms, AVCodecContext * * av_codec_ctx,
+            int * audio_index, AudioPlayer * player ) {
+    *av_codec_ctx = NULL;
+    if( sink_type == AUDIO_SINK_NONE ) return false;
+
+    const AVCodec * av_codec = NULL;
+    *audio_index = av_find_best_stream( av_format_ctx, AVMEDIA_TYPE_AUDIO, -1, video_index,
+                                        &av_codec, 0 );
+    if( *audio_index < 0 ) return false;
+
+    AVStream * audio_stream = av_format_ctx->streams[*audio_index];
+    *av_codec_ctx = avcodec_alloc_context3( av_codec );
+    if( !*av_codec_ctx ||
+        avcodec_parameters_to_context( *av_codec_ctx, audio_stream->codecpar ) < 0 ||
+        avcodec_open2( *av_codec_ctx, av_codec, NULL ) < 0 ) {
+        fprintf( stderr, "Could not open the audio decoder, playing without audio\n" );
+        avcodec_free_context( av_codec_ctx );
+        return false;
+    }
+
+    int rate = ( *av_codec_ctx )->sample_rate;
+    int channels = ( *av_codec_ctx )->ch_layout.nb_channels > 1 ? 2 : 1;
+    AudioSink sink;
+    if( !audio_sink_open( &sink, sink_type, sink_target, rate, channels ) ) {
+        if( sink_type != AUDIO_SINK_ALSA ||
+            !audio_sink_open( &sink, AUDIO_SINK_NULL, NULL, rate, channels ) ) {
+            avcodec_free_context( av_codec_ctx );
+            return false;
+        }
+        fprintf( stderr, "Using the null audio sink\n" );
+    }
+
+    if( !audio_player_init( player, *av_codec_ctx, audio_stream->time_base, &sink, buffer_ms ) ) {
+        fprintf( stderr, "Could not set up audio playback\n" );
+        audio_sink_close( &sink );
+        avcodec_free_context( av_codec_ctx );
+        return false;
+    }
+    return true;
+}
+
+void
+print_usage( void ) {
+    fprintf( stdout, "Usage: ./ffmpeg_player [options] full_path_to_file_name.whatever_extension\n"
+                     "Options:\n"
+                     "  --packet-queue N  demuxed packets buffered ahead of the decoder (default 64)\n"
+                     "  --frame-queue N   decoded frames buffered ahead of the renderer (default 8)\n"
+                     "  --upload MODE     direct, pbo or persistent (default pbo). persistent\n"
+                     "                    makes the decoder write into mapped GPU memory\n"
+                     "  --pbo N           buffers in flight for the pbo and persistent modes,\n"
+                     "                    0 is the same as --upload direct (default 3, max 8)\n"
+                     "  --refresh HZ      display refresh rate, only needed when the driver\n"
+                     "                    doesn't report it (default 60)\n"
+                     "  --drop-threshold MS\n"
+                     "                    drop frames this far behind the clock and make the\n"
+                     "                    decoder skip work if it keeps happening, 0 disables\n"
+                     "                    (default 50)\n"
+                     "  --threads N       decoder threads, 0 means one per core (default 0)\n"
+                     "  --thread-type T   frame, slice or auto (default auto). frame has the\n"
+                     "                    best throughput but adds a frame of latency per\n"
+                     "                    thread, slice adds none but few codecs scale with it\n"
+                     "  --decode-latency  report how long each frame spends in the decoder\n"
+                     "  --stats           print playback statistics on exit\n"
+                     "  --benchmark       decode as fast as possible without a window and\n"
+                     "                    print throughput, per-stage latency and peak RSS\n"
+                     "  --force-convert   convert every frame to 8-bit YUV420P with swscale\n"
+                     "                    instead of sampling it in the shader, for comparison\n"
+                     "  --tone-map OP     how PQ and HLG frames are mapped to SDR: bt2390,\n"
+                     "                    hable, clip or off (default bt2390)\n"
+                     "  --scale FILTER    bilinear, bicubic or lanczos scaling to the window on\n"
+                     "                    the GPU (default bilinear)\n"
+                     "  --window WxH      initial window size (default the video size)\n"
+                     "  --reduced-decode  decode at a lower resolution and skip deblocking\n"
+                     "                    when the window is much smaller than the video\n"
+                     "  --index-scan      read the whole file for its keyframes before playing,\n"
+                     "                    so every seek can go straight to the right one\n"
+                     "  --ipc PATH        take commands like \"seek +10\", \"seek 90\" or\n"
+                     "                    \"seek 50%%\" from a FIFO at PATH\n"
+                     "  --audio SINK      alsa[:DEVICE], null, wav[:FILE] or none (default alsa).\n"
+                     "                    null and wav play in real time without a sound card\n"
+                     "  --audio-buffer MS decoded audio buffered ahead of the device (default 200)\n"
+                     "  --speed X         playback speed from 0.25 to 4, audio keeps its pitch\n"
+                     "                    (default 1). Also \"speed X\" on the --ipc FIFO\n"
+                     "  --io MODE         auto, mmap, readahead or file (default auto). mmap\n"
+                     "                    reads local files through a memory mapping, readahead\n"
+                     "                    on a thread into a ring ahead of the demuxer, file\n"
+                     "                    through libavformat's own read() calls. auto picks\n"
+                     "                    readahead on network filesystems and mmap elsewhere.\n"
+                     "                    Anything but a regular file uses file\n"
+                     "  --readahead-mb N  size of the readahead ring in MiB (default 64)\n"
+                     "Keys: Left/Right seek 10 s, Down/Up 60 s, Home to the start, 0-9 to 0-90%%,\n"
+                     "      [ and ] slower and faster, Backspace back to normal speed\n" );
+}
+
+bool
+parse_options( int argc, char const * argv[], PlayerOptions * options ) {
+    options->file_name = NULL;
+    options->io_mode = INPUT_IO_AUTO;
+    options->readahead_mb = READAHEAD_IO_DEFAULT_MB;
+    options->packet_queue_depth = 64;
+    options->frame_queue_depth = 8;
+    options->upload_mode = UPLOAD_PBO;
+    options->upload_buffers = 3;
+    options->refresh_rate = 0;
+    options->drop_threshold = 0.05;
+    options->decode_threads = 0;
+    options->decode_thread_type = DECODE_THREADS_AUTO;
+    options->decode_latency = false;
+    options->benchmark = false;
+    options->force_convert = false;
+    options->tone_map = OPENGL_TONE_MAP_BT2390;
+    options->scale_filter = OPENGL_SCALE_BILINEAR;
+    options->window_width = 0;
+    options->window_height = 0;
+    options->reduced_decode = false;
+    options->index_scan = false;
+    options->ipc_path = NULL;
+    options->audio_sink = AUDIO_SINK_ALSA;
+    options->audio_target = NULL;
+    options->audio_buffer_ms = AUDIO_PLAYER_DEFAULT_BUFFER_MS;
+    options->speed = 1.0;
+    options->print_stats = false;
+
+    for( int i = 1; i < argc; ++i ) {
+        if( strcmp( argv[i], "--packet-queue" ) == 0 && i + 1 < argc ) {
+            options->packet_queue_depth = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--frame-queue" ) == 0 && i + 1 < argc ) {
+            options->frame_queue_depth = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--upload" ) == 0 && i + 1 < argc ) {
+            ++i;
+            if( strcmp( argv[i], "direct" ) == 0 ) {
+                options->upload_mode = UPLOAD_DIRECT;
+            } else if( strcmp( argv[i], "pbo" ) == 0 ) {
+                options->upload_mode = UPLOAD_PBO;
+            } else if( strcmp( argv[i], "persistent" ) == 0 ) {
+                options->upload_mode = UPLOAD_PERSISTENT;
+            } else {
+                fprintf( stderr, "Unknown upload mode %s\n", argv[i] );
+                return false;
+            }
+        } else if( strcmp( argv[i], "--pbo" ) == 0 && i + 1 < argc ) {
+            options->upload_buffers = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--refresh" ) == 0 && i + 1 < argc ) {
+            options->refresh_rate = atof( argv[++i] );
+        } else if( strcmp( argv[i], "--drop-threshold" ) == 0 && i + 1 < argc ) {
+            options->drop_threshold = atof( argv[++i] ) / 1000.0;
+        } else if( strcmp( argv[i], "--threads" ) == 0 && i + 1 < argc ) {
+            options->decode_threads = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--thread-type" ) == 0 && i + 1 < argc ) {
+            ++i;
+            if( strcmp( argv[i], "auto" ) == 0 ) {
+                options->decode_thread_type = DECODE_THREADS_AUTO;
+            } else if( strcmp( argv[i], "frame" ) == 0 ) {
+                options->decode_thread_type = DECODE_THREADS_FRAME;
+            } else if( strcmp( argv[i], "slice" ) == 0 ) {
+                options->decode_thread_type = DECODE_THREADS_SLICE;
+            } else {
+                fprintf( stderr, "Unknown thread type %s\n", argv[i] );
+                return false;
+            }
+        } else if( strcmp( argv[i], "--decode-latency" ) == 0 ) {
+            options->decode_latency = true;
+        } else if( strcmp( argv[i], "--force-convert" ) == 0 ) {
+            options->force_convert = true;
+        } else if( strcmp( argv[i], "--tone-map" ) == 0 && i + 1 < argc ) {
+            ++i;
+            options->tone_map = OPENGL_TONE_MAP_COUNT;
+            for( int j = 0; j < OPENGL_TONE_MAP_COUNT; ++j ) {
+                if( strcmp( argv[i], opengl_tone_map_names[j] ) == 0 ) {
+                    options->tone_map = ( OpenGLToneMap )j;
+                }
+            }
+            if( options->tone_map == OPENGL_TONE_MAP_COUNT ) {
+                fprintf( stderr, "Unknown tone mapping %s\n", argv[i] );
+                return false;
+            }
+        } else if( strcmp( argv[i], "--scale" ) == 0 && i + 1 < argc ) {
+            ++i;
+            options->scale_filter = OPENGL_SCALE_COUNT;
+            for( int j = 0; j < OPENGL_SCALE_COUNT; ++j ) {
+                if( strcmp( argv[i], opengl_scale_filter_names[j] ) == 0 ) {
+                    options->scale_filter = ( OpenGLScaleFilter )j;
+                }
+            }
+            if( options->scale_filter == OPENGL_SCALE_COUNT ) {
+                fprintf( stderr, "Unknown scaling filter %s\n", argv[i] );
+                return false;
+            }
+        } else if( strcmp( argv[i], "--window" ) == 0 && i + 1 < argc ) {
+            ++i;
+            if( sscanf( argv[i], "%dx%d", &options->window_width, &options->window_height ) != 2 ||
+                options->window_width < 1 || options->window_height < 1 ) {
+                fprintf( stderr, "Bad window size %s\n", argv[i] );
+                return false;
+            }
+        } else if( strcmp( argv[i], "--reduced-decode" ) == 0 ) {
+            options->reduced_decode = true;
+        } else if( strcmp( argv[i], "--index-scan" ) == 0 ) {
+            options->index_scan = true;
+        } else if( strcmp( argv[i], "--ipc" ) == 0 && i + 1 < argc ) {
+            options->ipc_path = argv[++i];
+        } else if( strcmp( argv[i], "--audio" ) == 0 && i + 1 < argc ) {
+            ++i;
+            const char * colon = strchr( argv[i], ':' );
+            size_t length = colon ? ( size_t )( colon - argv[i] ) : strlen( argv[i] );
+            options->audio_target = colon ? colon + 1 : NULL;
+            options->audio_sink = AUDIO_SINK_NONE;
+            bool found = false;
+            for( int j = AUDIO_SINK_NONE; j <= AUDIO_SINK_WAV; ++j ) {
+                if( strlen( audio_sink_names[j] ) == length &&
+                    strncmp( argv[i], audio_sink_names[j], length ) == 0 ) {
+                    options->audio_sink = ( AudioSinkType )j;
+                    found = true;
+                }
+            }
+            if( !found ) {
+                fprintf( stderr, "Unknown audio sink %s\n", argv[i] );
+                return false;
+            }
+        } else if( strcmp( argv[i], "--audio-buffer" ) == 0 && i + 1 < argc ) {
+            options->audio_buffer_ms = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--speed" ) == 0 && i + 1 < argc ) {
+            options->speed = atof( argv[++i] );
+        } else if( strcmp( argv[i], "--io" ) == 0 && i + 1 < argc ) {
+            ++i;
+            if( strcmp( argv[i], "auto" ) == 0 ) {
+                options->io_mode = INPUT_IO_AUTO;
+            } else if( strcmp( argv[i], "mmap" ) == 0 ) {
+                options->io_mode = INPUT_IO_MMAP;
+            } else if( strcmp( argv[i], "readahead" ) == 0 ) {
+                options->io_mode = INPUT_IO_READAHEAD;
+            } else if( strcmp( argv[i], "file" ) == 0 ) {
+                options->io_mode = INPUT_IO_FILE;
+            } else {
+                fprintf( stderr, "Unknown I/O mode %s\n", argv[i] );
+                return false;
+            }
+        } else if( strcmp( argv[i], "--readahead-mb" ) == 0 && i + 1 < argc ) {
+            options->readahead_mb = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--benchmark" ) == 0 ) {
+            options->benchmark = true;
+        } else if( strcmp( argv[i], "--stats" ) == 0 ) {
+            options->print_stats = true;
+        } else if( argv[i][0] == '-' && argv[i][1] == '-' ) {
+            fprintf( stderr, "Unknown option %s\n", argv[i] );
+            return false;
+        } else {
+            options->file_name = argv[i];
+        }
+    }
+
+    if( options->packet_queue_depth < 1 || options->frame_queue_depth < 1 ) {
+        fprintf( stderr, "Queue depth must be at least 1\n" );
+        return false;
+    }
+
+    if( options->upload_buffers < 0 || options->upload_buffers > OPENGL_MAX_UPLOAD_BUFFERS ) {
+        fprintf( stderr, "Upload ring depth must be between 0 and %d\n",
+                 OPENGL_MAX_UPLOAD_BUFFERS );
+        return false;
+    }
+
+    if( options->audio_buffer_ms < AUDIO_PLAYER_PERIOD_MS ) {
+        fprintf( stderr, "Audio buffer must be at least %d ms\n", AUDIO_PLAYER_PERIOD_MS );
+        return false;
+    }
+
+    if( options->speed < TIME_STRETCH_MIN_SPEED || options->speed > TIME_STRETCH_MAX_SPEED ) {
+        fprintf( stderr, "Speed must be between %g and %g\n", TIME_STRETCH_MIN_SPEED,
+                 TIME_STRETCH_MAX_SPEED );
+        return false;
+    }
+
+    if( options->readahead_mb < 1 || options->readahead_mb > 4096 ) {
+        fprintf( stderr, "Read-ahead ring must be between 1 and 4096 MiB\n" );
+        return false;
+    }
+
+    if( options->upload_buffers == 0 ) {
+        options->upload_mode = UPLOAD_DIRECT;
+    }
+
+    return options->file_name != NULL;
+}
+
 int
 main( int argc, char const * argv[] ) {
-    if( argc <= 1 ) {
-        fprintf( stdout, "Usage: ./ffmpeg_player full_path_to_file_name.whatever_extension\n" );
+    PlayerOptions options;
+    if( !parse_options( argc, argv, &options ) ) {
+        print_usage();
         return 0;
     }
 
     AVFormatContext   * av_format_ctx;
     AVCodecContext    * av_codec_ctx;
     const AVCodec     * av_codec;
-    AVFrame           * frame;
-    AVFrame           * frame_copy;
-    AVPacket          * packet;
-    struct SwsContext * img_convert_ctx;
-    unsigned char     * buffer;
     int                 video_index;
     FrameData           frame_data;
+    Pipeline            pipeline;
 
     Display           * display;
     Window              window;
     XEvent              event;
     XWindowAttributes   x_window_attributes;
 
-    frame_data.ratio = 1.0f;
     frame_data.texture_width = -1;
     frame_data.texture_height = -1;
+    frame_data.texture_format = -1;
 
     /* FFmpeg stuff */
     av_log_set_flags( AV_LOG_SKIP_REPEATED );
@@ -66,7 +484,13 @@ main( int argc, char const * argv[] ) {
     avformat_network_init();
     av_format_ctx = avformat_alloc_context();
 
-    if( avformat_open_input( &av_format_ctx, argv[1] ,NULL, NULL ) != 0 ) {
+    // NOTE: libavformat leaves a pb it was given alone, we close it after
+    // avformat_close_input
+    InputIo input_io;
+    av_format_ctx->pb = open_input_io( &input_io, options.file_name, options.io_mode,
+                                       options.readahead_mb );
+
+    if( avformat_open_input( &av_format_ctx, options.file_name, NULL, NULL ) != 0 ) {
         fprintf( stderr, "Couldn't open input stream.\n" );
         return -1;
     }
@@ -107,21 +531,61 @@ main( int argc, char const * argv[] ) {
         return -1;
     }
 
+    // NOTE: A thread count of 0 lets libavcodec use one thread per core.
+    // Codecs that can't do the requested kind of threading decode on a
+    // single thread
+    av_codec_ctx->thread_count = options.decode_threads;
+    av_codec_ctx->thread_type = options.decode_thread_type == DECODE_THREADS_FRAME ? FF_THREAD_FRAME :
+                                options.decode_thread_type == DECODE_THREADS_SLICE ? FF_THREAD_SLICE :
+                                FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+    // NOTE: lowres has to be chosen before opening, so it follows the
+    // initial window size
+    int viewport_width = options.window_width ? options.window_width : video_stream->codecpar->width;
+    int viewport_height = options.window_height ? options.window_height : video_stream->codecpar->height;
+    if( options.reduced_decode ) {
+        av_codec_ctx->lowres = reduced_decode_pick_lowres( av_codec, video_stream->codecpar->width,
+                                                           video_stream->codecpar->height,
+                                                           viewport_width, viewport_height );
+    }
+
     if( avcodec_open2( av_codec_ctx, av_codec, NULL ) < 0 ) {
         fprintf( stderr, "Could not open codec.\n" );
         return -1;
     }
 
-    frame = av_frame_alloc();
-    frame_copy = av_frame_alloc();
+    memset( &pipeline, 0, sizeof( pipeline ) );
+    pipeline.av_format_ctx = av_format_ctx;
+    pipeline.av_codec_ctx = av_codec_ctx;
+    pipeline.img_convert_ctx = NULL;
+    pipeline.frame_data = &frame_data;
+    pipeline.video_index = video_index;
+    pipeline.audio_index = -1;
+    pipeline.force_convert = options.force_convert;
+    pipeline.reduced_decode = options.reduced_decode;
+    pipeline_set_viewport( &pipeline, viewport_width, viewport_height );
+    keyframe_index_init( &pipeline.keyframe_index );
+
+    if( options.index_scan ) {
+        uint64_t scan_start = get_nanoseconds();
+        if( keyframe_index_scan( &pipeline.keyframe_index, options.file_name, video_index,
+                                 input_io.mode == INPUT_IO_MMAP ) ) {
+            fprintf( stdout, "Indexed %d keyframes in %.1f ms\n", pipeline.keyframe_index.count,
+                     ( get_nanoseconds() - scan_start ) / 1000000.0 );
+        } else {
+            fprintf( stderr, "Could not scan %s for keyframes\n", options.file_name );
+        }
+    }
 
-    buffer = ( unsigned char * )av_malloc( av_image_get_buffer_size( AV_PIX_FMT_YUV420P,
-                                                                     av_codec_ctx->width,
-                                                                     av_codec_ctx->height,
-                                                                     1 ) );
-    av_image_fill_arrays( frame_copy->data, frame_copy->linesize, buffer,
-                          AV_PIX_FMT_YUV420P, av_codec_ctx->width,
-                          av_codec_ctx->height, 1 );
+    if( options.benchmark ) {
+        int result = benchmark_run( &pipeline, options.packet_queue_depth,
+                                    options.frame_queue_depth );
+        keyframe_index_destroy( &pipeline.keyframe_index );
+        avcodec_free_context( &av_codec_ctx );
+        avformat_close_input( &av_format_ctx );
+        close_input_io( &input_io, true );
+        return result;
+    }
 
     /* If you need print file information
     printf("---------------- File Information ---------------\n");
@@ -129,21 +593,6 @@ main( int argc, char const * argv[] ) {
     printf("-------------------------------------------------\n");
     */
 
-    img_convert_ctx = sws_getContext( av_codec_ctx->width,
-                                      av_codec_ctx->height,
-                                      av_codec_ctx->pix_fmt,
-                                      av_codec_ctx->width,
-                                      av_codec_ctx->height,
-                                      AV_PIX_FMT_YUV420P,
-                                      SWS_BICUBIC, NULL, NULL, NULL);
-
-    if( !img_convert_ctx ) {
-        fprintf( stderr, "Cannot create image context with sws_getContext\n" );
-        return 1;
-    }
-
-    packet=( AVPacket * )av_malloc( sizeof( AVPacket ) );
-
     /* X Windows stuff */
     display = XOpenDisplay( NULL );
 
@@ -156,8 +605,8 @@ main( int argc, char const * argv[] ) {
                                   DefaultRootWindow( display ),
                                   20,
                                   20,
-                                  av_codec_ctx->width,
-                                  av_codec_ctx->height,
+                                  viewport_width,
+                                  viewport_height,
                                   0, 0, 0);
 
 
@@ -224,29 +673,115 @@ main( int argc, char const * argv[] ) {
     glClearColor( 0.0, 0.0, 0.0, 1.0 );
 
     unsigned int textures[3];
+    OpenGLGeometry geometry;
+    OpenGLUploader uploader;
     opengl_generate_texture( textures );
     opengl_make_program();
+    opengl_set_tone_map( options.tone_map );
+    OpenGLScaler scaler;
+    opengl_create_scaler( &scaler, options.scale_filter );
+    opengl_create_geometry( &geometry );
+
+    if( options.upload_mode == UPLOAD_PERSISTENT ) {
+        // NOTE: Every queued frame holds a slot, plus the one the decoder is
+        // writing and the ones the GPU is still reading
+        int slot_count = options.frame_queue_depth + options.upload_buffers + 1;
+        if( slot_count > OPENGL_MAX_STAGING_SLOTS ) slot_count = OPENGL_MAX_STAGING_SLOTS;
+        // NOTE: Slots hold frames in the decoder's format if the shaders
+        // sample it, otherwise converted to YUV420P
+        int staged_format = opengl_can_render_format( av_codec_ctx->pix_fmt ) &&
+                            !options.force_convert ? av_codec_ctx->pix_fmt : AV_PIX_FMT_YUV420P;
+        GLsizeiptr slot_size = av_image_get_buffer_size( staged_format,
+                                                         av_codec_ctx->width,
+                                                         av_codec_ctx->height,
+                                                         FRAME_POOL_ALIGN );
+        uint8_t * slots[OPENGL_MAX_STAGING_SLOTS];
+
+        if( slot_size > 0 &&
+            opengl_create_persistent_uploader( &uploader, slot_size, slot_count ) ) {
+            for( int i = 0; i < slot_count; ++i ) {
+                slots[i] = opengl_staging_slot_memory( &uploader, i );
+            }
+            pipeline_set_staging_slots( &pipeline, slots, slot_count, slot_size );
+        } else {
+            fprintf( stderr, "Persistent mapped buffers not available, using PBOs\n" );
+            options.upload_mode = UPLOAD_PBO;
+        }
+    }
+
+    if( options.upload_mode != UPLOAD_PERSISTENT ) {
+        opengl_create_uploader( &uploader, options.upload_mode == UPLOAD_DIRECT ?
+                                           0 : options.upload_buffers );
+    }
+
+    uint64_t upload_count = 0;
+    uint64_t upload_nanoseconds = 0;
+    uint64_t upload_max_nanoseconds = 0;
 
     Atom wmDeleteMessage = XInternAtom( display, "WM_DELETE_WINDOW", False );
     XSetWMProtocols( display, window, &wmDeleteMessage, 1 );
 
-    // NOTE: tv_sec, tv_nsec
-    struct timespec start_time = {0};
-    clock_gettime( CLOCK_MONOTONIC, &start_time );
-    uint64_t start_time_nanoseconds = ( start_time.tv_sec * 1000000000 ) + start_time.tv_nsec;
+    DecodeLatency decode_latency;
+    if( options.decode_latency ) {
+        decode_latency_init( &decode_latency );
+        pipeline.decode_latency = &decode_latency;
+    }
 
-    // Animation loop
-    while ( av_read_frame( av_format_ctx, packet ) >= 0 ) {
-        if( packet->stream_index != video_index ) {
-            av_packet_unref( packet );
-            continue;
-        }
+    // NOTE: With audio the sound card is the master clock and video follows
+    AVCodecContext * audio_codec_ctx;
+    AudioPlayer audio_player;
+    bool audio = open_audio( av_format_ctx, video_index, options.audio_sink, options.audio_target,
+                             options.audio_buffer_ms, &audio_codec_ctx, &pipeline.audio_index,
+                             &audio_player );
+    if( audio ) {
+        pipeline.audio_queue = &audio_player.queue;
+        audio_player_set_speed( &audio_player, options.speed );
+    }
 
-        opengl_render();
+    if( !pipeline_start( &pipeline, options.packet_queue_depth, options.frame_queue_depth ) ||
+        ( audio && !audio_player_start( &audio_player ) ) ) {
+        fprintf( stderr, "Could not start demuxer and decoder threads\n" );
+        return 1;
+    }
+
+    AvOffsetStats av_offset;
+    av_offset_stats_init( &av_offset, options.print_stats );
+
+    PresentationScheduler scheduler;
+    presentation_init( &scheduler, display, window, options.refresh_rate );
+
+    PlaybackSpeed speed_control;
+    AVRational frame_rate = av_guess_frame_rate( av_format_ctx, video_stream, NULL );
+    playback_speed_init( &speed_control, options.speed,
+                         frame_rate.num > 0 && frame_rate.den > 0 ? av_q2d( frame_rate ) : 0.0,
+                         get_nanoseconds() );
+    presentation_set_speed( &scheduler, get_nanoseconds(), options.speed );
+
+    DropPolicy drop_policy;
+    drop_policy_init( &drop_policy, options.drop_threshold );
+
+    // NOTE: Seek targets are media time in seconds, like frame_pts
+    double media_start = video_stream->start_time != AV_NOPTS_VALUE ?
+                         timebase * video_stream->start_time / 1000.0 : 0.0;
+    double media_duration = video_stream->duration != AV_NOPTS_VALUE ?
+                            timebase * video_stream->duration / 1000.0 :
+                            av_format_ctx->duration != AV_NOPTS_VALUE ?
+                            av_format_ctx->duration / ( double )AV_TIME_BASE : 0.0;
+    SeekControl seek_control;
+    if( !seek_control_init( &seek_control, options.ipc_path, media_start, media_duration ) ) {
+        pipeline_stop( &pipeline );
+        if( audio ) audio_player_stop( &audio_player );
+        return 1;
+    }
 
+    // Animation loop
+    while ( true ) {
         if ( XCheckTypedWindowEvent( display, window, Expose, &event ) == True ) {
             XGetWindowAttributes( display, window, &x_window_attributes );
-            glViewport( 0, 0, x_window_attributes.width, x_window_attributes.height );
+            viewport_width = x_window_attributes.width;
+            viewport_height = x_window_attributes.height;
+            glViewport( 0, 0, viewport_width, viewport_height );
+            pipeline_set_viewport( &pipeline, viewport_width, viewport_height );
         }
 
         if ( XCheckTypedWindowEvent( display, window, ClientMessage, &event ) == True ) {
@@ -255,59 +790,204 @@ main( int argc, char const * argv[] ) {
             }
         }
 
-        bool okay = false;
-        while( !okay ) {
-            int ret = avcodec_send_packet( av_codec_ctx, packet );
-            if( ret >= 0 ) {
-                okay = true;
-                av_packet_unref( packet );
+        // NOTE: Relative seeks stack on top of a seek still in progress
+        double seek_position = seek_control.pending ? seek_control.target : scheduler.last_pts;
+        double seek_target;
+        bool seek = false;
+        double speed;
+        bool speed_change = false;
+        if ( XCheckTypedWindowEvent( display, window, KeyPress, &event ) == True ) {
+            KeySym key = XLookupKeysym( &event.xkey, 0 );
+            seek = seek_control_key( &seek_control, key, seek_position, &seek_target );
+            speed_change = playback_speed_key( &speed_control, key, &speed );
+        }
+        if( seek_control_poll( &seek_control, seek_position, &seek_target ) ) seek = true;
+        if( seek ) {
+            int serial = seek_control_begin( &seek_control, seek_target );
+            pipeline_request_seek( &pipeline, ( int64_t )( seek_target * 1000.0 / timebase ), serial );
+        }
+        if( seek_control_take_speed( &seek_control, &speed ) ) speed_change = true;
+        if( speed_change ) {
+            uint64_t change_ns = get_nanoseconds();
+            if( playback_speed_set( &speed_control, &pipeline, change_ns, scheduler.presented, speed ) ) {
+                presentation_set_speed( &scheduler, change_ns, speed_control.speed );
+                if( audio ) audio_player_set_speed( &audio_player, speed_control.speed );
             }
+        }
 
-            while( ( ret = avcodec_receive_frame( av_codec_ctx, frame ) ) >= 0 ) {
-                frame_copy->width = frame->width;
-                frame_copy->height = frame->height;
-                frame_copy->format = AV_PIX_FMT_YUV420P;
-                // NOTE: According to ffmpeg documentation we can set our
-                // private data, so we use it to get later our texture
-                // width/height and ratio and avoiding global variables
-                frame_copy->opaque = &frame_data;
-                av_frame_get_buffer( frame_copy, 0 );
-                sws_scale( img_convert_ctx,
-                          ( const unsigned char * const * )frame->data,
-                          frame->linesize, 0, av_codec_ctx->height,
-                          frame_copy->data, frame_copy->linesize );
-                copy_frame_to_texture( frame_copy, textures );
-
-                // NOTE: We have to calculate time before we unref our frame
-                struct timespec elapsed = {0};
-                clock_gettime( CLOCK_MONOTONIC, &elapsed );
-                uint64_t elapsed_nanoseconds = elapsed.tv_nsec + ( elapsed.tv_sec * 1000000000 ) - start_time_nanoseconds;
-                double eps = elapsed_nanoseconds / 1000000000.0;
-                double frame_pts = timebase * frame->pts / 1000.0;
-
-                av_frame_unref( frame );
-                av_frame_unref( frame_copy );
-                // NOTE: microseconds
-                // It assumes our CPU fast enough to decode, so frame
-                // presentation timestamp should be always greater
-                // than real elapsed time
-                if( frame_pts > eps )
-                    usleep( ( ( frame_pts - eps ) * 1000000 ) );
+        uint8_t * free_slot;
+        while( ( free_slot = opengl_reclaim_staging_slot( &uploader ) ) != NULL ) {
+            pipeline_return_staging_slot( &pipeline, free_slot );
+        }
+
+        // NOTE: Everything before the marker of the latest seek is from the
+        // old position. It goes back unseen, and nothing is shown until
+        // the first frame after the marker
+        if( seek_control.pending ) {
+            AVFrame * stale;
+            while( seek_control.pending && ( stale = pipeline_pop_frame( &pipeline ) ) != NULL ) {
+                if( pipeline_is_seek_marker( &pipeline, stale ) &&
+                    seek_control_marker( &seek_control, ( int )stale->pts ) ) {
+                    presentation_restart( &scheduler );
+                }
+                drop_frame( &pipeline, &uploader, stale );
+            }
+            if( seek_control.pending ) {
+                presentation_wait_until( get_nanoseconds() + 1000000 );
+                continue;
             }
         }
 
-        glXSwapBuffers(display, window);
+        AVFrame * next = pipeline_peek_frame( &pipeline );
+        if( next && pipeline_is_seek_marker( &pipeline, next ) ) {
+            drop_frame( &pipeline, &uploader, pipeline_pop_frame( &pipeline ) );
+            continue;
+        }
+        if( !next ) {
+            if( pipeline_finished( &pipeline ) ) break;
+            // NOTE: Decoder is catching up, keep handling window events
+            presentation_wait_until( get_nanoseconds() + 1000000 );
+            continue;
+        }
+
+        uint64_t now = get_nanoseconds();
+        uint64_t vblank = presentation_next_vblank( &scheduler, now );
+        double frame_pts = timebase * next->pts / 1000.0;
+        if( !scheduler.started ) {
+            presentation_start( &scheduler, vblank, frame_pts );
+        }
+        double audio_time;
+        if( audio && audio_player_clock( &audio_player, vblank, seek_control.serial, &audio_time ) ) {
+            presentation_sync( &scheduler, vblank, audio_time );
+        }
 
-        av_packet_unref( packet );
+        // NOTE: Media time on screen at the next vblank. Frames that a later
+        // queued frame matches better would never be seen, so skip them
+        double target = presentation_media_time( &scheduler, vblank ) +
+                        presentation_tolerance( &scheduler );
+        AVFrame * after;
+        while( ( after = pipeline_peek_frame_at( &pipeline, 1 ) ) != NULL &&
+               !pipeline_is_seek_marker( &pipeline, after ) &&
+               timebase * after->pts / 1000.0 <= target ) {
+            drop_frame( &pipeline, &uploader, pipeline_pop_frame( &pipeline ) );
+            ++scheduler.skipped;
+            next = after;
+        }
+        frame_pts = timebase * next->pts / 1000.0;
+
+        // NOTE: Not due at this vblank. Peeking the timestamp lets us wait
+        // without taking the frame out of the ring, waking up at least
+        // every 10ms for events
+        if( frame_pts > target ) {
+            uint64_t deadline = now + 10000000;
+            presentation_wait_until( vblank < deadline ? vblank : deadline );
+            continue;
+        }
+
+        // NOTE: Without a later frame to skip to, a frame that is far behind
+        // the clock is dropped here, and if that keeps happening the drop
+        // policy makes the decoder skip work until we catch up. Lateness is
+        // in wall time, so the threshold means the same at every speed
+        double lateness = ( target - presentation_tolerance( &scheduler ) - frame_pts ) /
+                          scheduler.speed;
+        bool drop = drop_policy_should_drop( &drop_policy, lateness,
+                                             presentation_tolerance( &scheduler ) * 2 /
+                                             scheduler.speed );
+        pipeline_set_skip_level( &pipeline, playback_speed_update( &speed_control, &pipeline, now,
+                                                                   scheduler.presented,
+                                                                   drop_policy.level ) );
+        if( drop ) {
+            drop_frame( &pipeline, &uploader, pipeline_pop_frame( &pipeline ) );
+            continue;
+        }
+
+        AVFrame * frame = pipeline_pop_frame( &pipeline );
+        uint64_t upload_start = get_nanoseconds();
+        opengl_upload_frame( frame, textures, &uploader );
+        uint64_t upload_time = get_nanoseconds() - upload_start;
+        opengl_scaler_draw( &scaler, frame->width, frame->height, viewport_width, viewport_height );
+        pipeline_release_frame( &pipeline, frame );
+
+        ++upload_count;
+        upload_nanoseconds += upload_time;
+        if( upload_time > upload_max_nanoseconds ) upload_max_nanoseconds = upload_time;
+
+        // NOTE: Swap interval is 1, so this is shown at the vblank we aimed at
+        // unless upload and draw took longer than a refresh
+        glXSwapBuffers( display, window );
+        presentation_record( &scheduler, frame_pts, vblank );
+        seek_control_frame_shown( &seek_control, frame_pts );
+        if( audio && audio_player_clock( &audio_player, vblank, seek_control.serial, &audio_time ) ) {
+            av_offset_stats_add( &av_offset, &audio_player, vblank, audio_time,
+                                 audio_time - frame_pts );
+        }
     }
 
     // Teardown
-    sws_freeContext( img_convert_ctx );
+    pipeline_stop( &pipeline );
+    if( audio ) audio_player_stop( &audio_player );
+    seek_control_destroy( &seek_control );
+    opengl_destroy_uploader( &uploader );
+    opengl_destroy_scaler( &scaler );
+    opengl_destroy_geometry( &geometry );
+
+    if( options.print_stats || options.decode_latency ) {
+        fprintf( stdout, "Decoder: %s, %d threads, %s threading, lowres %d\n",
+                 av_codec->name, av_codec_ctx->thread_count,
+                 av_codec_ctx->active_thread_type & FF_THREAD_FRAME ? "frame" :
+                 av_codec_ctx->active_thread_type & FF_THREAD_SLICE ? "slice" : "no",
+                 av_codec_ctx->lowres );
+    }
+    if( options.decode_latency ) {
+        decode_latency_print_stats( &decode_latency );
+    }
+
+    if( options.print_stats ) {
+        FramePoolStats pool_stats = frame_pool_get_stats( &pipeline.frame_pool );
+        fprintf( stdout, "Frame pool: %llu buffer allocations, %llu buffer reuses, "
+                         "%llu frame allocations, %llu frame reuses\n",
+                 ( unsigned long long )pool_stats.buffer_allocations,
+                 ( unsigned long long )pool_stats.buffer_reuses,
+                 ( unsigned long long )pool_stats.frame_allocations,
+                 ( unsigned long long )pool_stats.frame_reuses );
+        fprintf( stdout, "Upload (%s): %llu frames, mean %.3f ms, max %.3f ms, "
+                         "%llu fence waits\n",
+                 upload_mode_names[options.upload_mode],
+                 ( unsigned long long )upload_count,
+                 upload_count ? upload_nanoseconds / 1000000.0 / upload_count : 0.0,
+                 upload_max_nanoseconds / 1000000.0,
+                 ( unsigned long long )uploader.fence_waits );
+        presentation_print_stats( &scheduler );
+        fprintf( stdout, "Drops: %llu late frames shown, %llu dropped late, "
+                         "~%llu skipped at decoder, final skip level %d\n",
+                 ( unsigned long long )drop_policy.late_frames,
+                 ( unsigned long long )drop_policy.dropped_frames,
+                 ( unsigned long long )pipeline_decoder_skipped_frames( &pipeline ),
+                 drop_policy.level );
+        fprintf( stdout, "Seeks: %llu requested, %llu done, %llu from the keyframe index, "
+                         "%d keyframes indexed, %llu frames decoded up to targets\n",
+                 ( unsigned long long )seek_control.requests,
+                 ( unsigned long long )pipeline.seeks,
+                 ( unsigned long long )pipeline.index_seeks,
+                 pipeline.keyframe_index.count,
+                 ( unsigned long long )pipeline.seek_discarded_frames );
+        if( seek_control.latency.count ) {
+            latency_stats_print( "seek", &seek_control.latency );
+        }
+        playback_speed_print_stats( &speed_control, &pipeline, get_nanoseconds(), scheduler.presented );
+        if( audio ) {
+            audio_player_print_stats( &audio_player );
+            av_offset_stats_print( &av_offset );
+            fprintf( stdout, "Audio clock: %llu jumps taken at once\n",
+                     ( unsigned long long )scheduler.clock_snaps );
+        }
+    }
+    avcodec_free_context( &audio_codec_ctx );
+    keyframe_index_destroy( &pipeline.keyframe_index );
     avcodec_free_context( &av_codec_ctx );
-    av_frame_free( &frame_copy );
-    av_frame_free( &frame );
     avcodec_close( av_codec_ctx );
     avformat_close_input( &av_format_ctx );
+    close_input_io( &input_io, options.print_stats );
 
     XDestroyWindow( display, window );
     XCloseDisplay( display );
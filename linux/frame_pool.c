@@ -0,0 +1,131 @@
+// NOTE: Recycles everything the decoder thread needs per frame. Conversion
+// targets come from an AVBufferPool keyed by width/height/format, so in the
+// steady state swscale writes into buffers that were already faulted in
+// and no frame-sized memory is allocated. Empty AVFrame shells travel back
+// from the renderer through a second SPSC ring instead of being freed.
+// The counters let us check that allocations stop after the first frames.
+
+#define FRAME_POOL_ALIGN 32
+
+typedef struct {
+    uint64_t buffer_allocations;
+    uint64_t buffer_reuses;
+    uint64_t frame_allocations;
+    uint64_t frame_reuses;
+} FramePoolStats;
+
+typedef struct {
+    // NOTE: Decoder thread only
+    AVBufferPool * buffer_pool;
+    int            width;
+    int            height;
+    int            format;
+    int            buffer_size;
+    FramePoolStats stats;
+
+    // NOTE: Render thread pushes released shells, decoder thread pops them
+    SpscRing       free_frames;
+
+    // NOTE: Bumped from the pool's alloc callback, which may run while
+    // another thread reads the counters
+    atomic_uint_fast64_t buffer_allocations;
+} FramePool;
+
+static AVBufferRef *
+frame_pool_alloc_buffer( void * opaque, size_t size ) {
+    FramePool * pool = ( FramePool * )opaque;
+    atomic_fetch_add_explicit( &pool->buffer_allocations, 1, memory_order_relaxed );
+    return av_buffer_alloc( size );
+}
+
+bool
+frame_pool_init( FramePool * pool, int max_frames ) {
+    memset( pool, 0, sizeof( *pool ) );
+    pool->format = AV_PIX_FMT_NONE;
+    atomic_init( &pool->buffer_allocations, 0 );
+    return spsc_ring_init( &pool->free_frames, max_frames );
+}
+
+// NOTE: Call once no other thread touches the pool. Buffers still
+// referenced by frames are freed when their last reference goes away
+void
+frame_pool_destroy( FramePool * pool ) {
+    AVFrame * frame;
+    while( ( frame = ( AVFrame * )spsc_ring_pop( &pool->free_frames ) ) != NULL ) {
+        av_frame_free( &frame );
+    }
+    spsc_ring_destroy( &pool->free_frames );
+    av_buffer_pool_uninit( &pool->buffer_pool );
+}
+
+// NOTE: Decoder thread. Returns an empty frame shell
+AVFrame *
+frame_pool_get_frame( FramePool * pool ) {
+    AVFrame * frame = ( AVFrame * )spsc_ring_pop( &pool->free_frames );
+    if( frame ) {
+        ++pool->stats.frame_reuses;
+        return frame;
+    }
+
+    ++pool->stats.frame_allocations;
+    return av_frame_alloc();
+}
+
+// NOTE: Decoder thread. Attaches a pooled buffer big enough for the given
+// picture to an empty frame and sets up its planes
+int
+frame_pool_get_buffer( FramePool * pool, AVFrame * frame,
+                       int width, int height, int format ) {
+    if( !pool->buffer_pool || pool->width != width ||
+        pool->height != height || pool->format != format ) {
+        // NOTE: Resolution or format changed, so the old buffers are no use.
+        // Frames that still hold them keep them alive until released
+        av_buffer_pool_uninit( &pool->buffer_pool );
+        pool->buffer_size = av_image_get_buffer_size( format, width, height,
+                                                      FRAME_POOL_ALIGN );
+        if( pool->buffer_size < 0 ) return pool->buffer_size;
+
+        pool->buffer_pool = av_buffer_pool_init2( pool->buffer_size, pool,
+                                                  frame_pool_alloc_buffer, NULL );
+        if( !pool->buffer_pool ) return AVERROR( ENOMEM );
+
+        pool->width = width;
+        pool->height = height;
+        pool->format = format;
+    }
+
+    uint64_t allocations = atomic_load_explicit( &pool->buffer_allocations,
+                                                 memory_order_relaxed );
+    frame->buf[0] = av_buffer_pool_get( pool->buffer_pool );
+    if( !frame->buf[0] ) return AVERROR( ENOMEM );
+
+    if( atomic_load_explicit( &pool->buffer_allocations, memory_order_relaxed ) == allocations ) {
+        ++pool->stats.buffer_reuses;
+    }
+
+    frame->width = width;
+    frame->height = height;
+    frame->format = format;
+    int ret = av_image_fill_arrays( frame->data, frame->linesize, frame->buf[0]->data,
+                                    format, width, height, FRAME_POOL_ALIGN );
+    return ret < 0 ? ret : 0;
+}
+
+// NOTE: Render thread. Drops the frame's references and hands the shell
+// back to the decoder thread
+void
+frame_pool_release_frame( FramePool * pool, AVFrame * frame ) {
+    av_frame_unref( frame );
+    if( !spsc_ring_push( &pool->free_frames, frame ) ) {
+        av_frame_free( &frame );
+    }
+}
+
+// NOTE: Exact once the decoder thread has stopped, approximate before
+FramePoolStats
+frame_pool_get_stats( FramePool * pool ) {
+    FramePoolStats result = pool->stats;
+    result.buffer_allocations = atomic_load_explicit( &pool->buffer_allocations,
+                                                      memory_order_relaxed );
+    return result;
+}
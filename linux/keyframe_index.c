@@ -0,0 +1,166 @@
+// NOTE: Timestamps and byte positions of the video stream's keyframes, so a
+// seek lands on the last keyframe before the target and the decoder only
+// has to go forward from there. It fills up as the demuxer reads packets,
+// or all at once with keyframe_index_scan, which reads every packet of
+// the file without decoding anything.
+//
+// Built lazily the index has holes where playback seeked over part of the
+// file. An entry is only trusted for a target if the demuxer read straight
+// through to the next keyframe (or the end of the file), otherwise there
+// may be a closer keyframe it never saw.
+//
+// Demuxer thread only once playback has started.
+
+typedef struct {
+    int64_t pts;
+    int64_t pos;
+    // NOTE: Read without a seek since the previous entry
+    bool    follows_previous;
+} KeyframeEntry;
+
+typedef struct {
+    KeyframeEntry * entries;
+    int             count;
+    int             capacity;
+    // NOTE: Entry of the last keyframe read, -1 right after a seek
+    int             last_seen;
+    // NOTE: Read without a seek from the last entry to the end of the file
+    bool            reached_end;
+} KeyframeIndex;
+
+void
+keyframe_index_init( KeyframeIndex * index ) {
+    memset( index, 0, sizeof( *index ) );
+    index->last_seen = -1;
+}
+
+void
+keyframe_index_destroy( KeyframeIndex * index ) {
+    av_freep( &index->entries );
+    index->count = 0;
+    index->capacity = 0;
+}
+
+// NOTE: Entry of the last keyframe at or before pts, -1 if there is none
+static int
+keyframe_index_find( const KeyframeIndex * index, int64_t pts ) {
+    int low = 0;
+    int high = index->count - 1;
+    int found = -1;
+    while( low <= high ) {
+        int middle = low + ( high - low ) / 2;
+        if( index->entries[middle].pts <= pts ) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+// NOTE: Packets mostly arrive in order, so this is nearly always an append.
+// After a backward seek the same keyframes come by again and only fill in
+// what we learn about the gaps between them
+void
+keyframe_index_add_packet( KeyframeIndex * index, const AVPacket * packet ) {
+    if( !( packet->flags & AV_PKT_FLAG_KEY ) ) return;
+
+    int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    if( pts == AV_NOPTS_VALUE ) return;
+
+    int entry = keyframe_index_find( index, pts );
+    if( entry < 0 || index->entries[entry].pts != pts ) {
+        if( index->count == index->capacity ) {
+            int capacity = index->capacity ? index->capacity * 2 : 256;
+            KeyframeEntry * entries = ( KeyframeEntry * )av_realloc_array( index->entries, capacity,
+                                                                           sizeof( KeyframeEntry ) );
+            if( !entries ) return;
+            index->entries = entries;
+            index->capacity = capacity;
+        }
+
+        ++entry;
+        memmove( &index->entries[entry + 1], &index->entries[entry],
+                 ( size_t )( index->count - entry ) * sizeof( KeyframeEntry ) );
+        index->entries[entry].pts = pts;
+        index->entries[entry].pos = packet->pos;
+        index->entries[entry].follows_previous = false;
+        ++index->count;
+        if( index->last_seen >= entry ) ++index->last_seen;
+    }
+
+    if( index->last_seen >= 0 && index->last_seen == entry - 1 ) {
+        index->entries[entry].follows_previous = true;
+    }
+    index->last_seen = entry;
+}
+
+// NOTE: Call whenever the demuxer position jumps
+void
+keyframe_index_mark_seek( KeyframeIndex * index ) {
+    index->last_seen = -1;
+}
+
+void
+keyframe_index_mark_end( KeyframeIndex * index ) {
+    if( index->count > 0 && index->last_seen == index->count - 1 ) {
+        index->reached_end = true;
+    }
+}
+
+// NOTE: Last keyframe at or before pts, if the index is sure about it
+bool
+keyframe_index_lookup( const KeyframeIndex * index, int64_t pts, KeyframeEntry * entry ) {
+    int found = keyframe_index_find( index, pts );
+    if( found < 0 ) return false;
+
+    bool covered = found + 1 < index->count ? index->entries[found + 1].follows_previous :
+                                              index->reached_end;
+    if( !covered ) return false;
+
+    *entry = index->entries[found];
+    return true;
+}
+
+// NOTE: Reads the whole file with its own demuxer, skipping everything but
+// the video stream's packets. Much faster than playback since nothing is
+// decoded, but it is still a full read of the file, through a mapping of
+// its own when use_mmap is set
+bool
+keyframe_index_scan( KeyframeIndex * index, const char * file_name, int video_index, bool use_mmap ) {
+    MmapIo io;
+    bool mapped = use_mmap && mmap_io_open( &io, file_name );
+    AVFormatContext * av_format_ctx = avformat_alloc_context();
+    if( av_format_ctx && mapped ) av_format_ctx->pb = io.avio;
+    if( avformat_open_input( &av_format_ctx, file_name, NULL, NULL ) != 0 ) {
+        if( mapped ) mmap_io_close( &io );
+        return false;
+    }
+    if( avformat_find_stream_info( av_format_ctx, NULL ) < 0 ||
+        video_index >= ( int )av_format_ctx->nb_streams ) {
+        avformat_close_input( &av_format_ctx );
+        if( mapped ) mmap_io_close( &io );
+        return false;
+    }
+
+    for( unsigned int i = 0; i < av_format_ctx->nb_streams; ++i ) {
+        if( ( int )i != video_index ) av_format_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+
+    AVPacket * packet = av_packet_alloc();
+    keyframe_index_mark_seek( index );
+    while( packet && av_read_frame( av_format_ctx, packet ) >= 0 ) {
+        if( packet->stream_index == video_index ) {
+            keyframe_index_add_packet( index, packet );
+        }
+        av_packet_unref( packet );
+    }
+    keyframe_index_mark_end( index );
+    keyframe_index_mark_seek( index );
+
+    av_packet_free( &packet );
+    avformat_close_input( &av_format_ctx );
+    if( mapped ) mmap_io_close( &io );
+    return true;
+}
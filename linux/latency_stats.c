@@ -0,0 +1,60 @@
+// NOTE: Fixed-size latency histogram with 0.1 ms buckets up to 200 ms, so
+// threads can record a sample per frame without allocating. Each instance
+// is written by one thread and read after that thread has stopped.
+
+#define LATENCY_STATS_BUCKET_NS  100000
+#define LATENCY_STATS_BUCKETS    2000
+
+typedef struct {
+    uint64_t histogram[LATENCY_STATS_BUCKETS + 1];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} LatencyStats;
+
+void
+latency_stats_init( LatencyStats * stats ) {
+    memset( stats, 0, sizeof( *stats ) );
+}
+
+void
+latency_stats_add( LatencyStats * stats, uint64_t elapsed_ns ) {
+    uint64_t bucket = elapsed_ns / LATENCY_STATS_BUCKET_NS;
+    if( bucket > LATENCY_STATS_BUCKETS ) bucket = LATENCY_STATS_BUCKETS;
+    ++stats->histogram[bucket];
+    ++stats->count;
+    stats->sum_ns += elapsed_ns;
+    if( elapsed_ns > stats->max_ns ) stats->max_ns = elapsed_ns;
+}
+
+double
+latency_stats_mean( LatencyStats * stats ) {
+    return stats->count ? stats->sum_ns / 1000000.0 / stats->count : 0.0;
+}
+
+// NOTE: Upper edge of the bucket holding the given fraction of samples, in
+// milliseconds
+double
+latency_stats_percentile( LatencyStats * stats, double fraction ) {
+    uint64_t wanted = ( uint64_t )ceil( stats->count * fraction );
+    uint64_t seen = 0;
+    for( int i = 0; i <= LATENCY_STATS_BUCKETS; ++i ) {
+        seen += stats->histogram[i];
+        if( seen >= wanted && seen > 0 ) {
+            if( i == LATENCY_STATS_BUCKETS ) return stats->max_ns / 1000000.0;
+            return ( i + 1 ) * LATENCY_STATS_BUCKET_NS / 1000000.0;
+        }
+    }
+    return 0.0;
+}
+
+void
+latency_stats_print( const char * name, LatencyStats * stats ) {
+    fprintf( stdout, "  %-8s %8llu samples, mean %7.3f ms, p50 %6.1f ms, p99 %6.1f ms, "
+                     "max %7.3f ms\n",
+             name, ( unsigned long long )stats->count,
+             latency_stats_mean( stats ),
+             latency_stats_percentile( stats, 0.5 ),
+             latency_stats_percentile( stats, 0.99 ),
+             stats->max_ns / 1000000.0 );
+}
@@ -0,0 +1,147 @@
+// NOTE: Reads local files through a memory mapping instead of the file
+// protocol's read() calls. The whole file is mapped once and libavformat
+// reads it through an AVIOContext whose callbacks copy straight out of the
+// mapping, so reading costs no syscalls, only page faults, and with the
+// read-ahead below those find the pages already in the page cache.
+//
+// Read-ahead is asked for with madvise: MADV_SEQUENTIAL on the whole file
+// and MADV_WILLNEED a few windows ahead of the read position. Windows are
+// 2 MiB and aligned to 2 MiB, so on filesystems with large folios the page
+// cache can back them with huge pages.
+//
+// libavformat reads larger than its buffer go straight into the packet,
+// so most of the file is copied once, from the page cache into packets.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define MMAP_IO_BUFFER_SIZE   ( 64 * 1024 )
+#define MMAP_IO_WINDOW        ( 2 * 1024 * 1024 )
+#define MMAP_IO_WINDOWS_AHEAD 4
+
+typedef struct {
+    uint8_t     * data;
+    int64_t       size;
+    int64_t       position;
+    // NOTE: Range already asked for with MADV_WILLNEED
+    int64_t       advised_start;
+    int64_t       advised_end;
+    AVIOContext * avio;
+
+    uint64_t      reads;
+    uint64_t      bytes_read;
+    uint64_t      seeks;
+    uint64_t      advice_calls;
+} MmapIo;
+
+// NOTE: Asks for the windows ahead of the read position. A jump out of
+// the advised range, a seek, starts again from the window it lands in
+static void
+mmap_io_advise( MmapIo * io ) {
+    if( io->position < io->advised_start || io->position > io->advised_end ) {
+        io->advised_start = io->position & ~( int64_t )( MMAP_IO_WINDOW - 1 );
+        io->advised_end = io->advised_start;
+    }
+
+    int64_t wanted = ( io->position / MMAP_IO_WINDOW + MMAP_IO_WINDOWS_AHEAD ) * MMAP_IO_WINDOW;
+    if( wanted > io->size ) wanted = io->size;
+    if( wanted <= io->advised_end ) return;
+
+    madvise( io->data + io->advised_end, wanted - io->advised_end, MADV_WILLNEED );
+    io->advised_end = wanted;
+    ++io->advice_calls;
+}
+
+static int
+mmap_io_read( void * opaque, uint8_t * buffer, int size ) {
+    MmapIo * io = ( MmapIo * )opaque;
+    if( io->position >= io->size ) return AVERROR_EOF;
+
+    int64_t count = io->size - io->position;
+    if( count > size ) count = size;
+    mmap_io_advise( io );
+    memcpy( buffer, io->data + io->position, count );
+    io->position += count;
+    ++io->reads;
+    io->bytes_read += count;
+    return ( int )count;
+}
+
+static int64_t
+mmap_io_seek( void * opaque, int64_t offset, int whence ) {
+    MmapIo * io = ( MmapIo * )opaque;
+    int64_t position;
+    switch( whence & ~AVSEEK_FORCE ) {
+        case AVSEEK_SIZE: return io->size;
+        case SEEK_SET:    position = offset; break;
+        case SEEK_CUR:    position = io->position + offset; break;
+        case SEEK_END:    position = io->size + offset; break;
+        default:          return AVERROR( EINVAL );
+    }
+    if( position < 0 ) return AVERROR( EINVAL );
+
+    io->position = position;
+    ++io->seeks;
+    return position;
+}
+
+void mmap_io_close( MmapIo * io );
+
+// NOTE: Maps file_name and makes an AVIOContext for av_format_ctx->pb.
+// False for anything that isn't a regular file, like URLs and pipes, the
+// caller then lets libavformat open it the usual way
+bool
+mmap_io_open( MmapIo * io, const char * file_name ) {
+    memset( io, 0, sizeof( *io ) );
+
+    int fd = open( file_name, O_RDONLY | O_CLOEXEC );
+    if( fd < 0 ) return false;
+
+    struct stat status;
+    if( fstat( fd, &status ) != 0 || !S_ISREG( status.st_mode ) || status.st_size == 0 ) {
+        close( fd );
+        return false;
+    }
+
+    // NOTE: The mapping keeps the file open
+    void * data = mmap( NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if( data == MAP_FAILED ) {
+        fprintf( stderr, "Could not map %s: %s\n", file_name, strerror( errno ) );
+        return false;
+    }
+    io->data = ( uint8_t * )data;
+    io->size = status.st_size;
+    madvise( io->data, io->size, MADV_SEQUENTIAL );
+
+    uint8_t * buffer = ( uint8_t * )av_malloc( MMAP_IO_BUFFER_SIZE );
+    if( buffer ) {
+        io->avio = avio_alloc_context( buffer, MMAP_IO_BUFFER_SIZE, 0, io,
+                                       mmap_io_read, NULL, mmap_io_seek );
+    }
+    if( !io->avio ) {
+        av_free( buffer );
+        mmap_io_close( io );
+        return false;
+    }
+    return true;
+}
+
+// NOTE: After avformat_close_input, which leaves a custom AVIOContext alone
+void
+mmap_io_close( MmapIo * io ) {
+    if( io->avio ) {
+        av_freep( &io->avio->buffer );
+        avio_context_free( &io->avio );
+    }
+    if( io->data ) munmap( io->data, io->size );
+    io->data = NULL;
+}
+
+void
+mmap_io_print_stats( MmapIo * io ) {
+    fprintf( stdout, "I/O (mmap): %.1f MiB in %llu reads, %llu seeks, %llu read-ahead requests\n",
+             io->bytes_read / 1048576.0, ( unsigned long long )io->reads,
+             ( unsigned long long )io->seeks, ( unsigned long long )io->advice_calls );
+}
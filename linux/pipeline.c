@@ -0,0 +1,833 @@
+// NOTE: Demuxer -> decoder -> renderer pipeline. The demuxer thread reads
+// packets into a bounded packet queue, the decoder thread turns them into
+// frames the shader can sample and pushes them into a bounded lock-free
+// frame ring and the render (main) thread peeks and pops frames and
+// presents them. Both hand-offs stall the producer when full, so decode
+// can run ahead of display only by the configured depth.
+//
+// Seeking: the render thread posts a target, the demuxer seeks and flushes
+// the packet queue, the decoder flushes the codec and sends a marker frame
+// through the ring. Frames the renderer pops before the marker are from
+// before the seek. Requests carry a serial, so when several pile up the
+// renderer waits for the marker of the last one.
+
+#define QUEUE_EOF       0
+#define QUEUE_ABORT     -1
+#define QUEUE_FLUSH     2
+#define QUEUE_INTERRUPT 3
+
+// NOTE: What the decoder needs to know about the seek behind a flush
+typedef struct {
+    // NOTE: Frames that end before this are decoded but not shown
+    int64_t target_pts;
+    int     serial;
+} PacketQueueFlush;
+
+typedef struct {
+    AVPacket * *     packets;
+    int              capacity;
+    int              read_index;
+    int              count;
+    bool             eof;
+    bool             abort;
+    bool             interrupt;
+    bool             flush;
+    PacketQueueFlush flush_info;
+    pthread_mutex_t  mutex;
+    pthread_cond_t   cond;
+} PacketQueue;
+
+typedef struct {
+    AVFormatContext   * av_format_ctx;
+    AVCodecContext    * av_codec_ctx;
+    struct SwsContext * img_convert_ctx;
+    FrameData         * frame_data;
+    int                 video_index;
+    PacketQueue         packet_queue;
+
+    // NOTE: Optional, owned by the caller. Packets of the audio stream go to
+    // audio_queue, without one they are dropped like every other stream
+    int                 audio_index;
+    PacketQueue       * audio_queue;
+    SpscRing            frame_ring;
+    FramePool           frame_pool;
+
+    // NOTE: Persistent-mapped upload mode. Free slots of the mapped staging
+    // buffer travel from the renderer to the decoder through this ring
+    SpscRing            free_slots;
+    size_t              staging_slot_size;
+
+    // NOTE: Converts every frame to YUV420P with swscale, even the ones the
+    // shaders could sample, to compare against the old CPU path
+    bool                force_convert;
+    atomic_bool         abort;
+    atomic_bool         decode_finished;
+
+    // NOTE: Set by the render thread's drop policy, applied by the decoder
+    // thread between packets. The counters are decoder thread only and
+    // compare packets and frames while non-reference frames are skipped
+    atomic_int          skip_level;
+    uint64_t            packets_while_skipping;
+    uint64_t            frames_while_skipping;
+
+    // NOTE: Decoder throughput, read by the render thread for the speed
+    // control. Busy time leaves out waiting for packets, ring space and
+    // staging slots, which the decoder thread adds up in decode_wait_ns
+    atomic_uint_fast64_t decoded_frames;
+    atomic_uint_fast64_t decode_busy_ns;
+    uint64_t            decode_wait_ns;
+
+    // NOTE: Reduced decode for small windows, see reduced_decode.c. The
+    // viewport is written by the render thread and read by the decoder
+    bool                reduced_decode;
+    atomic_int          viewport_width;
+    atomic_int          viewport_height;
+
+    // NOTE: Optional, owned by the caller. Demux latency is written by the
+    // demuxer thread, the others by the decoder thread
+    DecodeLatency     * decode_latency;
+    LatencyStats      * demux_latency;
+    LatencyStats      * convert_latency;
+
+    // NOTE: Seek request from the render thread, see the top of this file
+    pthread_mutex_t     seek_mutex;
+    pthread_cond_t      seek_cond;
+    bool                seek_requested;
+    int64_t             seek_target_pts;
+    int                 seek_serial;
+
+    // NOTE: Demuxer thread only, read once it has stopped
+    KeyframeIndex       keyframe_index;
+    uint64_t            seeks;
+    uint64_t            index_seeks;
+
+    // NOTE: Decoder thread only, read once it has stopped
+    uint64_t            seek_discarded_frames;
+
+    pthread_t           demux_thread;
+    pthread_t           decode_thread;
+} Pipeline;
+
+bool
+packet_queue_init( PacketQueue * queue, int capacity ) {
+    // NOTE: packet_queue_destroy cleans up after a failure too
+    memset( queue, 0, sizeof( *queue ) );
+    pthread_mutex_init( &queue->mutex, NULL );
+    pthread_cond_init( &queue->cond, NULL );
+    queue->packets = ( AVPacket * * )av_calloc( capacity, sizeof( AVPacket * ) );
+    if( !queue->packets ) return false;
+
+    queue->capacity = capacity;
+    for( int i = 0; i < capacity; ++i ) {
+        queue->packets[i] = av_packet_alloc();
+        if( !queue->packets[i] ) return false;
+    }
+    return true;
+}
+
+void
+packet_queue_destroy( PacketQueue * queue ) {
+    if( queue->packets ) {
+        for( int i = 0; i < queue->capacity; ++i ) {
+            av_packet_free( &queue->packets[i] );
+        }
+        av_freep( &queue->packets );
+    }
+    pthread_mutex_destroy( &queue->mutex );
+    pthread_cond_destroy( &queue->cond );
+}
+
+// NOTE: Takes ownership of the packet reference, blocks while the queue is
+// full
+int
+packet_queue_put( PacketQueue * queue, AVPacket * packet ) {
+    pthread_mutex_lock( &queue->mutex );
+    while( queue->count == queue->capacity && !queue->abort && !queue->interrupt ) {
+        pthread_cond_wait( &queue->cond, &queue->mutex );
+    }
+
+    if( queue->abort ) {
+        pthread_mutex_unlock( &queue->mutex );
+        av_packet_unref( packet );
+        return QUEUE_ABORT;
+    }
+
+    // NOTE: A seek is waiting, the packet is from before it anyway
+    if( queue->interrupt ) {
+        queue->interrupt = false;
+        pthread_mutex_unlock( &queue->mutex );
+        av_packet_unref( packet );
+        return QUEUE_INTERRUPT;
+    }
+
+    int write_index = ( queue->read_index + queue->count ) % queue->capacity;
+    av_packet_move_ref( queue->packets[write_index], packet );
+    ++queue->count;
+
+    pthread_cond_broadcast( &queue->cond );
+    pthread_mutex_unlock( &queue->mutex );
+    return 1;
+}
+
+void
+packet_queue_set_eof( PacketQueue * queue ) {
+    pthread_mutex_lock( &queue->mutex );
+    queue->eof = true;
+    pthread_cond_broadcast( &queue->cond );
+    pthread_mutex_unlock( &queue->mutex );
+}
+
+// NOTE: Demuxer thread, right after seeking. Drops the queued packets and
+// tells the decoder to flush before the packets that follow
+void
+packet_queue_flush( PacketQueue * queue, PacketQueueFlush flush_info ) {
+    pthread_mutex_lock( &queue->mutex );
+    while( queue->count > 0 ) {
+        av_packet_unref( queue->packets[queue->read_index] );
+        queue->read_index = ( queue->read_index + 1 ) % queue->capacity;
+        --queue->count;
+    }
+    queue->eof = false;
+    queue->interrupt = false;
+    queue->flush = true;
+    queue->flush_info = flush_info;
+    pthread_cond_broadcast( &queue->cond );
+    pthread_mutex_unlock( &queue->mutex );
+}
+
+// NOTE: Wakes the demuxer if it is blocked on a full queue, so it can get
+// to a pending seek without waiting for the decoder
+void
+packet_queue_interrupt( PacketQueue * queue ) {
+    pthread_mutex_lock( &queue->mutex );
+    queue->interrupt = true;
+    pthread_cond_broadcast( &queue->cond );
+    pthread_mutex_unlock( &queue->mutex );
+}
+
+// NOTE: Returns 1 with a packet, QUEUE_FLUSH with flush_info after a seek,
+// QUEUE_EOF once when drained, or QUEUE_ABORT. After QUEUE_EOF it blocks
+// until there is a seek
+int
+packet_queue_get( PacketQueue * queue, AVPacket * packet, PacketQueueFlush * flush_info ) {
+    int result;
+    pthread_mutex_lock( &queue->mutex );
+    while( queue->count == 0 && !queue->eof && !queue->abort && !queue->flush ) {
+        pthread_cond_wait( &queue->cond, &queue->mutex );
+    }
+
+    if( queue->abort ) {
+        result = QUEUE_ABORT;
+    } else if( queue->flush ) {
+        queue->flush = false;
+        *flush_info = queue->flush_info;
+        result = QUEUE_FLUSH;
+    } else if( queue->count == 0 ) {
+        queue->eof = false;
+        result = QUEUE_EOF;
+    } else {
+        av_packet_move_ref( packet, queue->packets[queue->read_index] );
+        queue->read_index = ( queue->read_index + 1 ) % queue->capacity;
+        --queue->count;
+        pthread_cond_broadcast( &queue->cond );
+        result = 1;
+    }
+
+    pthread_mutex_unlock( &queue->mutex );
+    return result;
+}
+
+void
+packet_queue_abort( PacketQueue * queue ) {
+    pthread_mutex_lock( &queue->mutex );
+    queue->abort = true;
+    pthread_cond_broadcast( &queue->cond );
+    pthread_mutex_unlock( &queue->mutex );
+}
+
+// NOTE: Decoder thread. Sleeps a millisecond while the renderer catches up
+static void
+decode_thread_back_off( Pipeline * pipeline ) {
+    uint64_t start = get_nanoseconds();
+    struct timespec backoff = { 0, 1000000 };
+    nanosleep( &backoff, NULL );
+    pipeline->decode_wait_ns += get_nanoseconds() - start;
+}
+
+// NOTE: Hands a frame to the renderer, backing off while the ring is full.
+// A full ring means we are a whole queue depth ahead of presentation, so a
+// millisecond of sleep costs nothing and keeps the hot path free of locks
+static int
+frame_ring_put( Pipeline * pipeline, AVFrame * frame ) {
+    while( !spsc_ring_push( &pipeline->frame_ring, frame ) ) {
+        if( atomic_load_explicit( &pipeline->abort, memory_order_acquire ) ) {
+            av_frame_free( &frame );
+            return QUEUE_ABORT;
+        }
+        decode_thread_back_off( pipeline );
+    }
+    return 1;
+}
+
+// NOTE: Render thread only. Oldest decoded frame or NULL, without blocking
+AVFrame *
+pipeline_peek_frame( Pipeline * pipeline ) {
+    return ( AVFrame * )spsc_ring_peek( &pipeline->frame_ring );
+}
+
+// NOTE: Render thread only. Frame index places behind the oldest one or NULL
+AVFrame *
+pipeline_peek_frame_at( Pipeline * pipeline, int index ) {
+    return ( AVFrame * )spsc_ring_peek_at( &pipeline->frame_ring, index );
+}
+
+// NOTE: Render thread only. The caller owns the returned frame and gives
+// it back with pipeline_release_frame
+AVFrame *
+pipeline_pop_frame( Pipeline * pipeline ) {
+    return ( AVFrame * )spsc_ring_pop( &pipeline->frame_ring );
+}
+
+// NOTE: Render thread only
+void
+pipeline_release_frame( Pipeline * pipeline, AVFrame * frame ) {
+    frame_pool_release_frame( &pipeline->frame_pool, frame );
+}
+
+// NOTE: Render thread only. Gives a staging slot the GPU is done with back
+// to the decoder
+void
+pipeline_return_staging_slot( Pipeline * pipeline, uint8_t * slot ) {
+    // NOTE: Can't fail, the ring holds every slot there is
+    spsc_ring_push( &pipeline->free_slots, slot );
+}
+
+// NOTE: Render thread. Asks the decoder to skip work, see drop_policy.c
+void
+pipeline_set_skip_level( Pipeline * pipeline, int level ) {
+    atomic_store_explicit( &pipeline->skip_level, level, memory_order_relaxed );
+}
+
+// NOTE: Render thread. Asks for a seek to target_pts in the video stream's
+// time base, replacing any request the demuxer hasn't picked up yet.
+// The interrupt goes first: raised after the request it could arrive once
+// the demuxer has already seeked and cost us the keyframe after the seek
+void
+pipeline_request_seek( Pipeline * pipeline, int64_t target_pts, int serial ) {
+    packet_queue_interrupt( &pipeline->packet_queue );
+    if( pipeline->audio_queue ) packet_queue_interrupt( pipeline->audio_queue );
+    pthread_mutex_lock( &pipeline->seek_mutex );
+    pipeline->seek_requested = true;
+    pipeline->seek_target_pts = target_pts;
+    pipeline->seek_serial = serial;
+    pthread_cond_broadcast( &pipeline->seek_cond );
+    pthread_mutex_unlock( &pipeline->seek_mutex );
+}
+
+// NOTE: Marker frames carry the serial of their seek in pts
+bool
+pipeline_is_seek_marker( Pipeline * pipeline, const AVFrame * frame ) {
+    return frame->opaque == pipeline;
+}
+
+// NOTE: Render thread, or before pipeline_start. Only used with
+// reduced_decode set
+void
+pipeline_set_viewport( Pipeline * pipeline, int width, int height ) {
+    atomic_store_explicit( &pipeline->viewport_width, width, memory_order_relaxed );
+    atomic_store_explicit( &pipeline->viewport_height, height, memory_order_relaxed );
+}
+
+// NOTE: Approximate, frames that were in flight when skipping started or
+// stopped are counted on the wrong side
+uint64_t
+pipeline_decoder_skipped_frames( Pipeline * pipeline ) {
+    if( pipeline->packets_while_skipping < pipeline->frames_while_skipping ) return 0;
+    return pipeline->packets_while_skipping - pipeline->frames_while_skipping;
+}
+
+// NOTE: True once the decoder has output its last frame and the renderer
+// has taken every frame out of the ring
+bool
+pipeline_finished( Pipeline * pipeline ) {
+    if( !atomic_load_explicit( &pipeline->decode_finished, memory_order_acquire ) ) {
+        return false;
+    }
+    return spsc_ring_peek( &pipeline->frame_ring ) == NULL;
+}
+
+// NOTE: Seeks to the last keyframe before the target. With a keyframe
+// index hit we know exactly where that is: streams with timestamp
+// discontinuities (MPEG-TS and the like) seek by byte position, since
+// their timestamp seek is only a guess, everything else by the keyframe's
+// timestamp. Without one libavformat finds the keyframe itself
+static void
+demux_thread_seek( Pipeline * pipeline ) {
+    pthread_mutex_lock( &pipeline->seek_mutex );
+    PacketQueueFlush flush_info = { pipeline->seek_target_pts, pipeline->seek_serial };
+    pipeline->seek_requested = false;
+    pthread_mutex_unlock( &pipeline->seek_mutex );
+
+    AVFormatContext * av_format_ctx = pipeline->av_format_ctx;
+    KeyframeEntry keyframe;
+    int ret;
+    if( keyframe_index_lookup( &pipeline->keyframe_index, flush_info.target_pts, &keyframe ) ) {
+        ++pipeline->index_seeks;
+        if( ( av_format_ctx->iformat->flags & AVFMT_TS_DISCONT ) &&
+            !( av_format_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK ) && keyframe.pos >= 0 ) {
+            ret = avformat_seek_file( av_format_ctx, -1, keyframe.pos, keyframe.pos,
+                                      keyframe.pos, AVSEEK_FLAG_BYTE );
+        } else {
+            ret = avformat_seek_file( av_format_ctx, pipeline->video_index, INT64_MIN,
+                                      keyframe.pts, keyframe.pts, 0 );
+        }
+    } else {
+        ret = avformat_seek_file( av_format_ctx, pipeline->video_index, INT64_MIN,
+                                  flush_info.target_pts, flush_info.target_pts, 0 );
+    }
+
+    // NOTE: Playback goes on from where it was, but the renderer still
+    // needs its marker
+    if( ret < 0 ) {
+        fprintf( stderr, "Seek failed: %s\n", av_err2str( ret ) );
+        flush_info.target_pts = AV_NOPTS_VALUE;
+    }
+
+    ++pipeline->seeks;
+    keyframe_index_mark_seek( &pipeline->keyframe_index );
+    packet_queue_flush( &pipeline->packet_queue, flush_info );
+    if( pipeline->audio_queue ) {
+        PacketQueueFlush audio_flush = flush_info;
+        if( audio_flush.target_pts != AV_NOPTS_VALUE ) {
+            audio_flush.target_pts = av_rescale_q( flush_info.target_pts,
+                av_format_ctx->streams[pipeline->video_index]->time_base,
+                av_format_ctx->streams[pipeline->audio_index]->time_base );
+        }
+        packet_queue_flush( pipeline->audio_queue, audio_flush );
+    }
+}
+
+static bool
+demux_thread_seek_pending( Pipeline * pipeline ) {
+    pthread_mutex_lock( &pipeline->seek_mutex );
+    bool pending = pipeline->seek_requested;
+    pthread_mutex_unlock( &pipeline->seek_mutex );
+    return pending;
+}
+
+void *
+demux_thread_main( void * arg ) {
+    Pipeline * pipeline = ( Pipeline * )arg;
+    AVPacket * packet = av_packet_alloc();
+
+    uint64_t read_start = get_nanoseconds();
+    while( !atomic_load_explicit( &pipeline->abort, memory_order_acquire ) ) {
+        if( demux_thread_seek_pending( pipeline ) ) {
+            demux_thread_seek( pipeline );
+            read_start = get_nanoseconds();
+        }
+
+        if( av_read_frame( pipeline->av_format_ctx, packet ) < 0 ) {
+            keyframe_index_mark_end( &pipeline->keyframe_index );
+            packet_queue_set_eof( &pipeline->packet_queue );
+            if( pipeline->audio_queue ) packet_queue_set_eof( pipeline->audio_queue );
+
+            // NOTE: Nothing more to read unless there is a seek back
+            pthread_mutex_lock( &pipeline->seek_mutex );
+            while( !pipeline->seek_requested &&
+                   !atomic_load_explicit( &pipeline->abort, memory_order_acquire ) ) {
+                pthread_cond_wait( &pipeline->seek_cond, &pipeline->seek_mutex );
+            }
+            pthread_mutex_unlock( &pipeline->seek_mutex );
+            continue;
+        }
+
+        if( pipeline->demux_latency ) {
+            uint64_t now = get_nanoseconds();
+            latency_stats_add( pipeline->demux_latency, now - read_start );
+            read_start = now;
+        }
+
+        if( pipeline->audio_queue && packet->stream_index == pipeline->audio_index ) {
+            if( packet_queue_put( pipeline->audio_queue, packet ) == QUEUE_ABORT ) break;
+            read_start = get_nanoseconds();
+            continue;
+        }
+
+        if( packet->stream_index != pipeline->video_index ) {
+            av_packet_unref( packet );
+            continue;
+        }
+
+        keyframe_index_add_packet( &pipeline->keyframe_index, packet );
+        if( packet_queue_put( &pipeline->packet_queue, packet ) == QUEUE_ABORT ) {
+            break;
+        }
+        read_start = get_nanoseconds();
+    }
+
+    av_packet_free( &packet );
+    return NULL;
+}
+
+// NOTE: Whether the frame goes to the renderer in its own format
+static bool
+decode_thread_passes_through( Pipeline * pipeline, int format ) {
+    return !pipeline->force_convert && opengl_can_render_format( format );
+}
+
+// NOTE: Keeps the timestamps and the color description the shader needs.
+// swscale expands full range (yuvj) input to the limited range of YUV420P
+static void
+decode_thread_copy_props( AVFrame * frame_copy, const AVFrame * frame ) {
+    av_frame_copy_props( frame_copy, frame );
+    if( frame_copy->format != frame->format &&
+        ( frame->format == AV_PIX_FMT_YUVJ420P || frame->format == AV_PIX_FMT_YUVJ422P ||
+          frame->format == AV_PIX_FMT_YUVJ444P || frame->format == AV_PIX_FMT_YUVJ440P ) ) {
+        frame_copy->color_range = AVCOL_RANGE_MPEG;
+    }
+}
+
+// NOTE: Size swscale converts to, smaller than the frame when reduced
+// decode is on and the window is much smaller
+static void
+decode_thread_conversion_size( Pipeline * pipeline, const AVFrame * frame,
+                               int * width, int * height ) {
+    *width = frame->width;
+    *height = frame->height;
+    if( !pipeline->reduced_decode ) return;
+
+    reduced_decode_target_size( frame->width, frame->height,
+                                atomic_load_explicit( &pipeline->viewport_width, memory_order_relaxed ),
+                                atomic_load_explicit( &pipeline->viewport_height, memory_order_relaxed ),
+                                width, height );
+}
+
+// NOTE: Persistent upload mode. Writes the frame straight into a free slot
+// of the mapped staging buffer, as is if the shaders can sample its format
+// and converted to YUV420P otherwise, waiting for the renderer to release
+// a slot if needed. Returns 0 if the frame doesn't fit in a slot, so the
+// caller falls back to the pooled path
+static int
+decode_thread_stage_frame( Pipeline * pipeline, AVFrame * frame, AVFrame * frame_copy,
+                           int width, int height ) {
+    bool renderable = decode_thread_passes_through( pipeline, frame->format );
+    int format = renderable ? frame->format : AV_PIX_FMT_YUV420P;
+    if( renderable ) {
+        width = frame->width;
+        height = frame->height;
+    }
+    int required = av_image_get_buffer_size( format, width, height, FRAME_POOL_ALIGN );
+    if( required < 0 || ( size_t )required > pipeline->staging_slot_size ) {
+        return 0;
+    }
+
+    uint8_t * slot;
+    while( ( slot = ( uint8_t * )spsc_ring_pop( &pipeline->free_slots ) ) == NULL ) {
+        if( atomic_load_explicit( &pipeline->abort, memory_order_acquire ) ) {
+            return QUEUE_ABORT;
+        }
+        decode_thread_back_off( pipeline );
+    }
+
+    frame_copy->width = width;
+    frame_copy->height = height;
+    frame_copy->format = format;
+    av_image_fill_arrays( frame_copy->data, frame_copy->linesize, slot,
+                          format, width, height, FRAME_POOL_ALIGN );
+
+    if( renderable ) {
+        av_image_copy( frame_copy->data, frame_copy->linesize,
+                       ( const uint8_t * * )frame->data, frame->linesize,
+                       format, frame->width, frame->height );
+    } else {
+        sws_scale( pipeline->img_convert_ctx,
+                   ( const unsigned char * const * )frame->data,
+                   frame->linesize, 0, frame->height,
+                   frame_copy->data, frame_copy->linesize );
+    }
+
+    return 1;
+}
+
+// NOTE: Hands a decoded frame to the renderer. Frames the shader can sample
+// directly are passed by reference, so the renderer uploads straight from
+// the decoder's own buffers; only other formats go through swscale. In
+// persistent upload mode every frame is written into mapped GPU memory
+static int
+decode_thread_output_frame( Pipeline * pipeline, AVFrame * frame ) {
+    uint64_t convert_start = get_nanoseconds();
+    AVFrame * frame_copy = frame_pool_get_frame( &pipeline->frame_pool );
+    if( !frame_copy ) {
+        av_frame_unref( frame );
+        return AVERROR( ENOMEM );
+    }
+
+    // NOTE: Scaling to the window is done on the GPU, here only the pixel
+    // format changes, unless reduced decode shrinks the frame to about the
+    // window size. The filter then mostly resamples chroma, where bilinear
+    // is as good as bicubic and cheaper
+    int target_width, target_height;
+    decode_thread_conversion_size( pipeline, frame, &target_width, &target_height );
+    if( !decode_thread_passes_through( pipeline, frame->format ) ) {
+        pipeline->img_convert_ctx = sws_getCachedContext( pipeline->img_convert_ctx,
+                                                          frame->width,
+                                                          frame->height,
+                                                          frame->format,
+                                                          target_width,
+                                                          target_height,
+                                                          AV_PIX_FMT_YUV420P,
+                                                          SWS_BILINEAR, NULL, NULL, NULL );
+        if( !pipeline->img_convert_ctx ) {
+            fprintf( stderr, "Cannot convert frame from %s\n",
+                     av_get_pix_fmt_name( frame->format ) );
+            av_frame_free( &frame_copy );
+            av_frame_unref( frame );
+            return AVERROR( EINVAL );
+        }
+    }
+
+    int staged = 0;
+    if( pipeline->staging_slot_size > 0 ) {
+        staged = decode_thread_stage_frame( pipeline, frame, frame_copy,
+                                            target_width, target_height );
+        if( staged == QUEUE_ABORT ) {
+            av_frame_free( &frame_copy );
+            av_frame_unref( frame );
+            return QUEUE_ABORT;
+        }
+    }
+
+    if( staged ) {
+        decode_thread_copy_props( frame_copy, frame );
+        av_frame_unref( frame );
+    } else if( decode_thread_passes_through( pipeline, frame->format ) ) {
+        av_frame_move_ref( frame_copy, frame );
+    } else {
+        if( frame_pool_get_buffer( &pipeline->frame_pool, frame_copy, target_width,
+                                   target_height, AV_PIX_FMT_YUV420P ) < 0 ) {
+            av_frame_free( &frame_copy );
+            av_frame_unref( frame );
+            return AVERROR( ENOMEM );
+        }
+
+        sws_scale( pipeline->img_convert_ctx,
+                   ( const unsigned char * const * )frame->data,
+                   frame->linesize, 0, frame->height,
+                   frame_copy->data, frame_copy->linesize );
+        decode_thread_copy_props( frame_copy, frame );
+        av_frame_unref( frame );
+    }
+
+    frame_copy->pts = frame_copy->best_effort_timestamp;
+    // NOTE: According to ffmpeg documentation we can set our
+    // private data, so we use it to get later our texture
+    // width/height and format and avoiding global variables
+    frame_copy->opaque = pipeline->frame_data;
+
+    if( pipeline->convert_latency ) {
+        latency_stats_add( pipeline->convert_latency, get_nanoseconds() - convert_start );
+    }
+    return frame_ring_put( pipeline, frame_copy );
+}
+
+// NOTE: Tells the renderer that every frame after this one is from after
+// the seek with the given serial
+static int
+decode_thread_put_seek_marker( Pipeline * pipeline, int serial ) {
+    AVFrame * marker = frame_pool_get_frame( &pipeline->frame_pool );
+    if( !marker ) return AVERROR( ENOMEM );
+
+    marker->opaque = pipeline;
+    marker->pts = serial;
+    return frame_ring_put( pipeline, marker );
+}
+
+// NOTE: After a seek the decoder starts at a keyframe before the target,
+// frames that end before it are decoded only to get there
+static bool
+decode_thread_before_target( AVFrame * frame, int64_t target_pts ) {
+    if( target_pts == AV_NOPTS_VALUE ) return false;
+
+    int64_t pts = frame->best_effort_timestamp;
+    if( pts == AV_NOPTS_VALUE ) return false;
+    // NOTE: pkt_duration was deprecated for duration in libavutil 57.30
+    // and is gone in FFmpeg 7
+#if LIBAVUTIL_VERSION_INT >= AV_VERSION_INT( 57, 30, 100 )
+    int64_t duration = frame->duration;
+#else
+    int64_t duration = frame->pkt_duration;
+#endif
+    return pts + ( duration > 0 ? duration : 1 ) <= target_pts;
+}
+
+void *
+decode_thread_main( void * arg ) {
+    Pipeline * pipeline = ( Pipeline * )arg;
+    AVCodecContext * av_codec_ctx = pipeline->av_codec_ctx;
+    AVPacket * packet = av_packet_alloc();
+    AVFrame * frame = av_frame_alloc();
+    int skip_level = 0;
+    int reduced_level = 0;
+    int64_t target_pts = AV_NOPTS_VALUE;
+
+    bool aborted = false;
+    while( !aborted ) {
+        PacketQueueFlush flush_info;
+        int ret = packet_queue_get( &pipeline->packet_queue, packet, &flush_info );
+        if( ret == QUEUE_ABORT ) break;
+
+        if( ret == QUEUE_FLUSH ) {
+            avcodec_flush_buffers( av_codec_ctx );
+            target_pts = flush_info.target_pts;
+            atomic_store_explicit( &pipeline->decode_finished, false, memory_order_release );
+            if( decode_thread_put_seek_marker( pipeline, flush_info.serial ) == QUEUE_ABORT ) break;
+            continue;
+        }
+
+        int wanted_level = atomic_load_explicit( &pipeline->skip_level, memory_order_relaxed );
+        int wanted_reduction = 0;
+        if( pipeline->reduced_decode ) {
+            wanted_reduction = reduced_decode_level(
+                av_codec_ctx->width, av_codec_ctx->height,
+                atomic_load_explicit( &pipeline->viewport_width, memory_order_relaxed ),
+                atomic_load_explicit( &pipeline->viewport_height, memory_order_relaxed ) );
+        }
+        if( wanted_level != skip_level || wanted_reduction != reduced_level ) {
+            skip_level = wanted_level;
+            reduced_level = wanted_reduction;
+            reduced_decode_apply( av_codec_ctx, skip_level, reduced_level );
+        }
+        bool skipping_frames = av_codec_ctx->skip_frame >= AVDISCARD_NONREF;
+        if( skipping_frames && ret != QUEUE_EOF ) ++pipeline->packets_while_skipping;
+        uint64_t work_start = get_nanoseconds();
+        uint64_t wait_start = pipeline->decode_wait_ns;
+
+        // NOTE: A NULL packet puts the decoder into draining mode so we
+        // also get the frames it is still holding back
+        bool draining = ( ret == QUEUE_EOF );
+        AVPacket * to_send = draining ? NULL : packet;
+        if( to_send && pipeline->decode_latency ) {
+            decode_latency_packet_sent( pipeline->decode_latency, to_send );
+        }
+
+        bool sent = false;
+        while( !sent && !aborted ) {
+            ret = avcodec_send_packet( av_codec_ctx, to_send );
+            // NOTE: EAGAIN means we have to receive frames before the
+            // decoder accepts this packet again
+            sent = ( ret != AVERROR( EAGAIN ) );
+
+            while( ( ret = avcodec_receive_frame( av_codec_ctx, frame ) ) >= 0 ) {
+                if( skipping_frames ) ++pipeline->frames_while_skipping;
+                atomic_fetch_add_explicit( &pipeline->decoded_frames, 1, memory_order_relaxed );
+                if( pipeline->decode_latency ) {
+                    decode_latency_frame_received( pipeline->decode_latency, frame );
+                }
+                if( decode_thread_before_target( frame, target_pts ) ) {
+                    ++pipeline->seek_discarded_frames;
+                    av_frame_unref( frame );
+                    continue;
+                }
+                target_pts = AV_NOPTS_VALUE;
+                if( decode_thread_output_frame( pipeline, frame ) == QUEUE_ABORT ) {
+                    aborted = true;
+                    break;
+                }
+            }
+        }
+
+        av_packet_unref( packet );
+        atomic_fetch_add_explicit( &pipeline->decode_busy_ns,
+                                   get_nanoseconds() - work_start -
+                                   ( pipeline->decode_wait_ns - wait_start ),
+                                   memory_order_relaxed );
+
+        // NOTE: Everything is out. The decoder has to be flushed before it
+        // takes packets again, which only happens after a seek back
+        if( draining && !aborted ) {
+            avcodec_flush_buffers( av_codec_ctx );
+            atomic_store_explicit( &pipeline->decode_finished, true, memory_order_release );
+        }
+    }
+
+    atomic_store_explicit( &pipeline->decode_finished, true, memory_order_release );
+    av_frame_free( &frame );
+    av_packet_free( &packet );
+    return NULL;
+}
+
+// NOTE: Switches the decoder to writing frames into the given mapped slots.
+// Call before pipeline_start, the memory must stay mapped until pipeline_stop
+bool
+pipeline_set_staging_slots( Pipeline * pipeline, uint8_t * * slots,
+                            int slot_count, size_t slot_size ) {
+    if( !spsc_ring_init( &pipeline->free_slots, slot_count ) ) return false;
+
+    for( int i = 0; i < slot_count; ++i ) {
+        spsc_ring_push( &pipeline->free_slots, slots[i] );
+    }
+    pipeline->staging_slot_size = slot_size;
+    return true;
+}
+
+bool
+pipeline_start( Pipeline * pipeline, int packet_queue_depth, int frame_queue_depth ) {
+    atomic_init( &pipeline->abort, false );
+    atomic_init( &pipeline->decode_finished, false );
+    atomic_init( &pipeline->skip_level, 0 );
+    atomic_init( &pipeline->decoded_frames, 0 );
+    atomic_init( &pipeline->decode_busy_ns, 0 );
+    pthread_mutex_init( &pipeline->seek_mutex, NULL );
+    pthread_cond_init( &pipeline->seek_cond, NULL );
+    pipeline->seek_requested = false;
+    keyframe_index_mark_seek( &pipeline->keyframe_index );
+    // NOTE: Besides the queued frames one is on screen and one is being
+    // converted, so that many shells are enough to never allocate again
+    if( !packet_queue_init( &pipeline->packet_queue, packet_queue_depth ) ||
+        !spsc_ring_init( &pipeline->frame_ring, frame_queue_depth ) ||
+        !frame_pool_init( &pipeline->frame_pool, frame_queue_depth + 2 ) ) {
+        return false;
+    }
+
+    if( pthread_create( &pipeline->demux_thread, NULL, demux_thread_main, pipeline ) != 0 ) {
+        return false;
+    }
+
+    if( pthread_create( &pipeline->decode_thread, NULL, decode_thread_main, pipeline ) != 0 ) {
+        packet_queue_abort( &pipeline->packet_queue );
+        pthread_join( pipeline->demux_thread, NULL );
+        return false;
+    }
+
+    return true;
+}
+
+void
+pipeline_stop( Pipeline * pipeline ) {
+    atomic_store_explicit( &pipeline->abort, true, memory_order_release );
+    packet_queue_abort( &pipeline->packet_queue );
+    if( pipeline->audio_queue ) packet_queue_abort( pipeline->audio_queue );
+    pthread_mutex_lock( &pipeline->seek_mutex );
+    pthread_cond_broadcast( &pipeline->seek_cond );
+    pthread_mutex_unlock( &pipeline->seek_mutex );
+    pthread_join( pipeline->demux_thread, NULL );
+    pthread_join( pipeline->decode_thread, NULL );
+
+    // NOTE: Both threads are gone, so it's safe to drain the ring from here
+    AVFrame * frame;
+    while( ( frame = pipeline_pop_frame( pipeline ) ) != NULL ) {
+        av_frame_free( &frame );
+    }
+    spsc_ring_destroy( &pipeline->frame_ring );
+    frame_pool_destroy( &pipeline->frame_pool );
+    if( pipeline->staging_slot_size > 0 ) {
+        spsc_ring_destroy( &pipeline->free_slots );
+        pipeline->staging_slot_size = 0;
+    }
+    packet_queue_destroy( &pipeline->packet_queue );
+    pthread_mutex_destroy( &pipeline->seek_mutex );
+    pthread_cond_destroy( &pipeline->seek_cond );
+    sws_freeContext( pipeline->img_convert_ctx );
+    pipeline->img_convert_ctx = NULL;
+}
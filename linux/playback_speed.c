@@ -0,0 +1,203 @@
+// NOTE: Playback speed. The presentation clock runs speed times as fast as
+// wall time and the audio is time stretched to match, so it keeps its
+// pitch. Keys: [ and ] step through playback_speed_steps, Backspace goes
+// back to 1x. The IPC FIFO takes "speed 1.5".
+//
+// Faster playback needs frame rate * speed decoded frames per second. We
+// measure how many frames the decoder gets through per second of busy
+// time while it decodes everything, and when the speed asks for more than
+// that it skips non-reference frames, which nothing is predicted from,
+// instead of falling behind until the drop policy notices. The drop
+// policy can still escalate on top.
+//
+// Decoded and shown frames per second are kept for every speed played at.
+
+#define PLAYBACK_SPEED_MAX_STATS  16
+#define PLAYBACK_SPEED_SAMPLE_NS  1000000000ULL
+// NOTE: Fewer frames in a sample say too little about the decoder
+#define PLAYBACK_SPEED_MIN_FRAMES 10
+// NOTE: Skip above this share of the decoder's capacity, stop again below
+// the lower one, so we don't flap around the limit
+#define PLAYBACK_SPEED_SKIP_ABOVE 0.9
+#define PLAYBACK_SPEED_SKIP_BELOW 0.7
+// NOTE: Drop policy level 2, skip decoding non-reference frames
+#define PLAYBACK_SPEED_SKIP_LEVEL 2
+
+const double playback_speed_steps[] = { 0.25, 0.5, 0.75, 1.0, 1.25, 1.5, 2.0, 3.0, 4.0 };
+
+typedef struct {
+    double   speed;
+    uint64_t wall_ns;
+    uint64_t skipping_ns;
+    uint64_t decoded;
+    uint64_t shown;
+} PlaybackSpeedStats;
+
+typedef struct {
+    double             speed;
+    // NOTE: Nominal frames per second of the stream, 0 if unknown
+    double             frame_rate;
+    int                skip_level;
+
+    // NOTE: Decoded frames per second of busy time while nothing was
+    // skipped, 0 until measured
+    double             decode_capacity;
+    uint64_t           sample_ns;
+    uint64_t           sample_frames;
+    uint64_t           sample_busy_ns;
+    bool               sample_skipped;
+
+    // NOTE: Counters when the stats were last brought up to date
+    uint64_t           period_ns;
+    uint64_t           period_decoded;
+    uint64_t           period_shown;
+    PlaybackSpeedStats stats[PLAYBACK_SPEED_MAX_STATS];
+    int                stats_count;
+} PlaybackSpeed;
+
+void
+playback_speed_init( PlaybackSpeed * control, double speed, double frame_rate, uint64_t now ) {
+    memset( control, 0, sizeof( *control ) );
+    control->speed = speed;
+    control->frame_rate = frame_rate;
+    control->sample_ns = now;
+    control->period_ns = now;
+}
+
+static double
+playback_speed_clamp( double speed ) {
+    if( speed < TIME_STRETCH_MIN_SPEED ) return TIME_STRETCH_MIN_SPEED;
+    if( speed > TIME_STRETCH_MAX_SPEED ) return TIME_STRETCH_MAX_SPEED;
+    return speed;
+}
+
+// NOTE: Adds what happened since the last call to the current speed
+static void
+playback_speed_account( PlaybackSpeed * control, Pipeline * pipeline, uint64_t now, uint64_t shown ) {
+    uint64_t decoded = atomic_load_explicit( &pipeline->decoded_frames, memory_order_relaxed );
+
+    PlaybackSpeedStats * stats = NULL;
+    for( int i = 0; i < control->stats_count; ++i ) {
+        if( control->stats[i].speed == control->speed ) stats = &control->stats[i];
+    }
+    if( !stats && control->stats_count < PLAYBACK_SPEED_MAX_STATS ) {
+        stats = &control->stats[control->stats_count++];
+        stats->speed = control->speed;
+    }
+    if( stats ) {
+        stats->wall_ns += now - control->period_ns;
+        if( control->skip_level >= PLAYBACK_SPEED_SKIP_LEVEL ) {
+            stats->skipping_ns += now - control->period_ns;
+        }
+        stats->decoded += decoded - control->period_decoded;
+        stats->shown += shown - control->period_shown;
+    }
+
+    control->period_ns = now;
+    control->period_decoded = decoded;
+    control->period_shown = shown;
+}
+
+static void
+playback_speed_choose_level( PlaybackSpeed * control ) {
+    if( control->frame_rate <= 0 || control->decode_capacity <= 0 ) {
+        control->skip_level = 0;
+        return;
+    }
+
+    double needed = control->frame_rate * control->speed;
+    if( needed > control->decode_capacity * PLAYBACK_SPEED_SKIP_ABOVE ) {
+        control->skip_level = PLAYBACK_SPEED_SKIP_LEVEL;
+    } else if( needed < control->decode_capacity * PLAYBACK_SPEED_SKIP_BELOW ) {
+        control->skip_level = 0;
+    }
+}
+
+// NOTE: New speed for a key, false if the key doesn't change speed
+bool
+playback_speed_key( PlaybackSpeed * control, KeySym key, double * speed ) {
+    int count = sizeof( playback_speed_steps ) / sizeof( playback_speed_steps[0] );
+    switch( key ) {
+        case XK_bracketright:
+            *speed = playback_speed_steps[count - 1];
+            for( int i = count - 1; i >= 0; --i ) {
+                if( playback_speed_steps[i] > control->speed ) *speed = playback_speed_steps[i];
+            }
+            return true;
+        case XK_bracketleft:
+            *speed = playback_speed_steps[0];
+            for( int i = 0; i < count; ++i ) {
+                if( playback_speed_steps[i] < control->speed ) *speed = playback_speed_steps[i];
+            }
+            return true;
+        case XK_BackSpace:
+            *speed = 1.0;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// NOTE: Render thread. shown is the number of frames shown so far. Returns
+// false if nothing changes, otherwise the caller hands the new speed to
+// the presentation scheduler and the audio
+bool
+playback_speed_set( PlaybackSpeed * control, Pipeline * pipeline, uint64_t now, uint64_t shown,
+                    double speed ) {
+    speed = playback_speed_clamp( speed );
+    if( speed == control->speed ) return false;
+
+    playback_speed_account( control, pipeline, now, shown );
+    control->speed = speed;
+    playback_speed_choose_level( control );
+    fprintf( stdout, "Speed %.2fx%s\n", speed,
+             control->skip_level ? ", skipping non-reference frames" : "" );
+    return true;
+}
+
+// NOTE: Render thread, once per frame. Returns the skip level for the
+// decoder, the stronger of the drop policy's and the one the speed needs
+int
+playback_speed_update( PlaybackSpeed * control, Pipeline * pipeline, uint64_t now, uint64_t shown,
+                       int drop_level ) {
+    int level = drop_level > control->skip_level ? drop_level : control->skip_level;
+    if( level >= PLAYBACK_SPEED_SKIP_LEVEL ) control->sample_skipped = true;
+    if( now - control->sample_ns < PLAYBACK_SPEED_SAMPLE_NS ) return level;
+
+    // NOTE: Only samples where everything was decoded count, skipped
+    // frames would make the decoder look faster than it is
+    uint64_t frames = atomic_load_explicit( &pipeline->decoded_frames, memory_order_relaxed );
+    uint64_t busy_ns = atomic_load_explicit( &pipeline->decode_busy_ns, memory_order_relaxed );
+    if( !control->sample_skipped && busy_ns > control->sample_busy_ns &&
+        frames >= control->sample_frames + PLAYBACK_SPEED_MIN_FRAMES ) {
+        double capacity = ( frames - control->sample_frames ) * 1000000000.0 /
+                          ( busy_ns - control->sample_busy_ns );
+        control->decode_capacity = control->decode_capacity > 0 ?
+                                   ( control->decode_capacity + capacity ) / 2 : capacity;
+    }
+    control->sample_ns = now;
+    control->sample_frames = frames;
+    control->sample_busy_ns = busy_ns;
+    control->sample_skipped = level >= PLAYBACK_SPEED_SKIP_LEVEL;
+
+    playback_speed_account( control, pipeline, now, shown );
+    playback_speed_choose_level( control );
+    return drop_level > control->skip_level ? drop_level : control->skip_level;
+}
+
+void
+playback_speed_print_stats( PlaybackSpeed * control, Pipeline * pipeline, uint64_t now,
+                            uint64_t shown ) {
+    playback_speed_account( control, pipeline, now, shown );
+    fprintf( stdout, "Speed: stream %.3f fps, decoder manages %.1f fps without skipping\n",
+             control->frame_rate, control->decode_capacity );
+    for( int i = 0; i < control->stats_count; ++i ) {
+        PlaybackSpeedStats * stats = &control->stats[i];
+        double seconds = stats->wall_ns / 1000000000.0;
+        if( seconds <= 0 ) continue;
+        fprintf( stdout, "  %.2fx: %.1f s, %.1f fps decoded, %.1f fps shown, "
+                         "non-reference frames skipped %.0f%% of the time\n",
+                 stats->speed, seconds, stats->decoded / seconds, stats->shown / seconds,
+                 100.0 * stats->skipping_ns / stats->wall_ns );
+    }
+}
@@ -0,0 +1,251 @@
+// NOTE: Presentation scheduler. Swaps are locked to vsync and every frame is
+// aimed at a vblank: we predict when the next vblank happens, pick the
+// queued frame whose PTS best matches it and swap exactly once for it.
+// Vblank times come from GLX_OML_sync_control when the driver has it,
+// otherwise from the refresh interval and the time of our last swap.
+// Waiting uses clock_nanosleep with absolute deadlines, so oversleeping
+// one wait doesn't push every later frame back.
+//
+// All times are CLOCK_MONOTONIC nanoseconds, media time is in seconds.
+// Media time runs speed times as fast as wall time.
+
+typedef Bool ( * glXGetSyncValuesOMLFUNC )( Display *, GLXDrawable,
+                                            int64_t *, int64_t *, int64_t * );
+typedef Bool ( * glXGetMscRateOMLFUNC )( Display *, GLXDrawable, int32_t *, int32_t * );
+typedef void ( * glXSwapIntervalEXTFUNC )( Display *, GLXDrawable, int );
+typedef int ( * glXSwapIntervalMESAFUNC )( unsigned int );
+typedef int ( * glXSwapIntervalSGIFUNC )( int );
+
+#define PRESENTATION_DEFAULT_REFRESH 60.0
+// NOTE: Master clock errors above this are jumps (start, seek, underrun)
+// and are taken at once, smaller ones are slewed out
+#define PRESENTATION_SYNC_SNAP       0.1
+#define PRESENTATION_SYNC_SLEW       0.125
+
+typedef struct {
+    Display                 * display;
+    GLXDrawable               drawable;
+    glXGetSyncValuesOMLFUNC   get_sync_values;
+    bool                      vsync;
+    uint64_t                  refresh_ns;
+    uint64_t                  last_swap_ns;
+
+    // NOTE: Wall time of media time 0, set when the first frame is shown
+    bool                      started;
+    uint64_t                  start_ns;
+    double                    speed;
+    uint64_t                  clock_snaps;
+
+    // NOTE: Judder statistics
+    uint64_t                  presented;
+    uint64_t                  skipped;
+    double                    error_sum;
+    double                    error_square_sum;
+    double                    error_max;
+    double                    cadence_error_sum;
+    uint64_t                  cadence_count;
+    // NOTE: last_vblank_ns and last_pts belong to the frame shown just
+    // before, false after a restart
+    bool                      has_last;
+    uint64_t                  last_vblank_ns;
+    double                    last_pts;
+} PresentationScheduler;
+
+static bool
+presentation_has_extension( const char * extensions, const char * name ) {
+    size_t length = strlen( name );
+    const char * found = extensions;
+    while( found && ( found = strstr( found, name ) ) != NULL ) {
+        if( ( found == extensions || found[-1] == ' ' ) &&
+            ( found[length] == ' ' || found[length] == '\0' ) ) {
+            return true;
+        }
+        found += length;
+    }
+    return false;
+}
+
+// NOTE: Turns on vsync and finds out how to predict vblanks. A refresh rate
+// above zero overrides what the driver reports
+void
+presentation_init( PresentationScheduler * scheduler, Display * display,
+                   GLXDrawable drawable, double refresh_rate ) {
+    memset( scheduler, 0, sizeof( *scheduler ) );
+    scheduler->display = display;
+    scheduler->drawable = drawable;
+    scheduler->speed = 1.0;
+
+    const char * extensions = glXQueryExtensionsString( display, DefaultScreen( display ) );
+
+    if( presentation_has_extension( extensions, "GLX_EXT_swap_control" ) ) {
+        glXSwapIntervalEXTFUNC swap_interval = ( glXSwapIntervalEXTFUNC )
+            glXGetProcAddress( ( const GLubyte * )"glXSwapIntervalEXT" );
+        if( swap_interval ) {
+            swap_interval( display, drawable, 1 );
+            scheduler->vsync = true;
+        }
+    } else if( presentation_has_extension( extensions, "GLX_MESA_swap_control" ) ) {
+        glXSwapIntervalMESAFUNC swap_interval = ( glXSwapIntervalMESAFUNC )
+            glXGetProcAddress( ( const GLubyte * )"glXSwapIntervalMESA" );
+        scheduler->vsync = swap_interval && swap_interval( 1 ) == 0;
+    } else if( presentation_has_extension( extensions, "GLX_SGI_swap_control" ) ) {
+        glXSwapIntervalSGIFUNC swap_interval = ( glXSwapIntervalSGIFUNC )
+            glXGetProcAddress( ( const GLubyte * )"glXSwapIntervalSGI" );
+        scheduler->vsync = swap_interval && swap_interval( 1 ) == 0;
+    }
+
+    if( presentation_has_extension( extensions, "GLX_OML_sync_control" ) ) {
+        scheduler->get_sync_values = ( glXGetSyncValuesOMLFUNC )
+            glXGetProcAddress( ( const GLubyte * )"glXGetSyncValuesOML" );
+        glXGetMscRateOMLFUNC get_msc_rate = ( glXGetMscRateOMLFUNC )
+            glXGetProcAddress( ( const GLubyte * )"glXGetMscRateOML" );
+
+        int32_t numerator = 0;
+        int32_t denominator = 0;
+        if( refresh_rate <= 0 && get_msc_rate &&
+            get_msc_rate( display, drawable, &numerator, &denominator ) &&
+            numerator > 0 && denominator > 0 ) {
+            refresh_rate = ( double )numerator / denominator;
+        }
+    }
+
+    if( refresh_rate <= 0 ) refresh_rate = PRESENTATION_DEFAULT_REFRESH;
+    scheduler->refresh_ns = ( uint64_t )( 1000000000.0 / refresh_rate );
+    scheduler->last_swap_ns = get_nanoseconds();
+}
+
+// NOTE: Predicted time of the first vblank after now
+uint64_t
+presentation_next_vblank( PresentationScheduler * scheduler, uint64_t now ) {
+    uint64_t anchor = scheduler->last_swap_ns;
+
+    if( scheduler->get_sync_values ) {
+        int64_t ust = 0, msc = 0, sbc = 0;
+        // NOTE: UST is CLOCK_MONOTONIC microseconds on Mesa. Anything too far
+        // from our clock means the driver uses another time base, so we stop
+        // trusting it
+        if( scheduler->get_sync_values( scheduler->display, scheduler->drawable,
+                                        &ust, &msc, &sbc ) && ust > 0 ) {
+            uint64_t ust_ns = ( uint64_t )ust * 1000;
+            if( ust_ns <= now + 1000000000 && ust_ns + 1000000000 >= now ) {
+                anchor = ust_ns;
+            } else {
+                scheduler->get_sync_values = NULL;
+            }
+        }
+    }
+
+    if( anchor > now ) return anchor;
+    uint64_t periods = ( now - anchor ) / scheduler->refresh_ns + 1;
+    return anchor + periods * scheduler->refresh_ns;
+}
+
+// NOTE: Sleeps until the absolute monotonic deadline
+void
+presentation_wait_until( uint64_t deadline_ns ) {
+    struct timespec deadline;
+    deadline.tv_sec = deadline_ns / 1000000000;
+    deadline.tv_nsec = deadline_ns % 1000000000;
+    while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL ) == EINTR ) {
+    }
+}
+
+double
+presentation_media_time( PresentationScheduler * scheduler, uint64_t time_ns ) {
+    return ( ( int64_t )time_ns - ( int64_t )scheduler->start_ns ) * scheduler->speed / 1000000000.0;
+}
+
+// NOTE: Anchors the media clock so the first frame lands on the given vblank
+void
+presentation_start( PresentationScheduler * scheduler, uint64_t vblank_ns, double pts ) {
+    scheduler->start_ns = vblank_ns - ( int64_t )( pts / scheduler->speed * 1000000000.0 );
+    scheduler->started = true;
+}
+
+// NOTE: After a seek the media clock jumps, so the next frame anchors it
+// again and isn't compared to the one shown before the seek
+void
+presentation_restart( PresentationScheduler * scheduler ) {
+    scheduler->started = false;
+    scheduler->has_last = false;
+}
+
+// NOTE: Slaves the media clock to a master clock, the audio, that says
+// media_time is heard at time_ns. Called once per frame the correction is
+// spread over a few frames instead of showing up as a skip or repeat
+void
+presentation_sync( PresentationScheduler * scheduler, uint64_t time_ns, double media_time ) {
+    if( !scheduler->started ) return;
+
+    double error = media_time - presentation_media_time( scheduler, time_ns );
+    if( fabs( error ) > PRESENTATION_SYNC_SNAP ) {
+        ++scheduler->clock_snaps;
+    } else {
+        error *= PRESENTATION_SYNC_SLEW;
+    }
+    scheduler->start_ns -= ( int64_t )( error / scheduler->speed * 1000000000.0 );
+}
+
+// NOTE: Changes how fast media time runs from time_ns on, without a jump
+void
+presentation_set_speed( PresentationScheduler * scheduler, uint64_t time_ns, double speed ) {
+    if( scheduler->started ) {
+        double media_time = presentation_media_time( scheduler, time_ns );
+        scheduler->start_ns = time_ns - ( int64_t )( media_time / speed * 1000000000.0 );
+    }
+    scheduler->speed = speed;
+    // NOTE: Frame durations on screen change with the speed
+    scheduler->has_last = false;
+}
+
+// NOTE: Half a refresh interval in media time. A frame is the best match
+// for a vblank if its PTS is within this distance of it
+double
+presentation_tolerance( PresentationScheduler * scheduler ) {
+    return scheduler->refresh_ns * scheduler->speed / 2000000000.0;
+}
+
+// NOTE: Call right after the swap for the frame aimed at vblank_ns
+void
+presentation_record( PresentationScheduler * scheduler, double pts, uint64_t vblank_ns ) {
+    double error = presentation_media_time( scheduler, vblank_ns ) - pts;
+    scheduler->error_sum += error;
+    scheduler->error_square_sum += error * error;
+    if( fabs( error ) > scheduler->error_max ) scheduler->error_max = fabs( error );
+
+    // NOTE: Cadence error is how many refreshes a frame stayed on screen
+    // compared to how many its duration asked for, the visible judder
+    if( scheduler->has_last ) {
+        double shown = ( double )( vblank_ns - scheduler->last_vblank_ns ) / scheduler->refresh_ns;
+        double wanted = ( pts - scheduler->last_pts ) / scheduler->speed * 1000000000.0 /
+                        scheduler->refresh_ns;
+        scheduler->cadence_error_sum += fabs( shown - wanted );
+        ++scheduler->cadence_count;
+    }
+
+    ++scheduler->presented;
+    scheduler->has_last = true;
+    scheduler->last_vblank_ns = vblank_ns;
+    scheduler->last_pts = pts;
+    scheduler->last_swap_ns = get_nanoseconds();
+}
+
+void
+presentation_print_stats( PresentationScheduler * scheduler ) {
+    uint64_t count = scheduler->presented;
+    double mean = count ? scheduler->error_sum / count : 0.0;
+    double variance = count ? scheduler->error_square_sum / count - mean * mean : 0.0;
+    fprintf( stdout, "Presentation (%s, %.2f Hz, %s): %llu frames shown, %llu skipped\n",
+             scheduler->vsync ? "vsync" : "no vsync",
+             1000000000.0 / scheduler->refresh_ns,
+             scheduler->get_sync_values ? "OML sync" : "estimated vblank",
+             ( unsigned long long )count,
+             ( unsigned long long )scheduler->skipped );
+    fprintf( stdout, "Judder: error mean %.3f ms, stddev %.3f ms, max %.3f ms, "
+                     "cadence error %.3f refreshes/frame\n",
+             mean * 1000.0,
+             sqrt( variance > 0 ? variance : 0 ) * 1000.0,
+             scheduler->error_max * 1000.0,
+             scheduler->cadence_count ?
+             scheduler->cadence_error_sum / scheduler->cadence_count : 0.0 );
+}
@@ -0,0 +1,307 @@
+// NOTE: Reads files on a thread of its own into a large ring, ahead of
+// where libavformat reads, for network mounts (NFS, SMB) where a single
+// read() can take tens of milliseconds. The demuxer reads from the ring
+// through an AVIOContext and only waits when the ring has run dry, which
+// is counted as a stall.
+//
+// The ring keeps file bytes [start, end). The demuxer reads at position,
+// and everything from position to end is read ahead. The I/O thread keeps
+// READAHEAD_IO_KEEP_BEHIND of the ring behind position, so the short
+// backward seeks demuxers make while probing and parsing are served from
+// the ring too. A seek outside of it empties the ring and the I/O thread
+// starts again at the target; a read it had in flight is thrown away,
+// which the generation tells it.
+//
+// Only the I/O thread writes the ring, only the demuxer thread reads it
+// and moves position, so each copies outside of the lock.
+
+#include <sys/vfs.h>
+
+#define READAHEAD_IO_BUFFER_SIZE ( 64 * 1024 )
+#define READAHEAD_IO_CHUNK       ( 1024 * 1024 )
+#define READAHEAD_IO_DEFAULT_MB  64
+// NOTE: Share of the ring kept behind the read position
+#define READAHEAD_IO_KEEP_BEHIND 8
+
+typedef struct {
+    int             fd;
+    int64_t         size;
+    uint8_t       * ring;
+    int64_t         capacity;
+    int64_t         keep_behind;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  filled;
+    pthread_cond_t  drained;
+    pthread_t       thread;
+    bool            thread_started;
+    bool            quit;
+
+    int64_t         start;
+    int64_t         end;
+    int64_t         position;
+    uint64_t        generation;
+    // NOTE: errno of a failed read at end, 0 if none
+    int             error;
+
+    AVIOContext   * avio;
+
+    // NOTE: Demuxer thread
+    uint64_t        reads;
+    uint64_t        stalls;
+    uint64_t        stall_ns;
+    uint64_t        longest_stall_ns;
+    uint64_t        seeks;
+    uint64_t        seeks_in_ring;
+    // NOTE: Fill level seen by reads, for the mean and the minimum
+    double          fill_sum;
+    double          fill_min;
+
+    // NOTE: I/O thread
+    uint64_t        bytes_read;
+    uint64_t        read_calls;
+    uint64_t        longest_read_ns;
+} ReadaheadIo;
+
+static uint64_t
+readahead_io_nanoseconds( void ) {
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return ( uint64_t )t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// NOTE: Bytes read ahead of the demuxer, under the lock
+static int64_t
+readahead_io_ahead( ReadaheadIo * io ) {
+    return io->end - io->position;
+}
+
+static void *
+readahead_io_thread( void * data ) {
+    ReadaheadIo * io = ( ReadaheadIo * )data;
+    pthread_mutex_lock( &io->mutex );
+    while( !io->quit ) {
+        // NOTE: Room to the end of the ring, without touching what is ahead
+        // of the demuxer or kept behind it
+        int64_t room = io->capacity - readahead_io_ahead( io ) - io->keep_behind;
+        if( io->end >= io->size || io->error || room <= 0 ) {
+            pthread_cond_wait( &io->drained, &io->mutex );
+            continue;
+        }
+
+        int64_t offset = io->end;
+        int64_t slot = offset % io->capacity;
+        int64_t count = READAHEAD_IO_CHUNK;
+        if( count > room ) count = room;
+        if( count > io->capacity - slot ) count = io->capacity - slot;
+        if( count > io->size - offset ) count = io->size - offset;
+        // NOTE: The bytes about to be overwritten leave the ring first, so
+        // a seek can't land on them while we read
+        if( io->start < offset + count - io->capacity ) io->start = offset + count - io->capacity;
+        uint64_t generation = io->generation;
+        pthread_mutex_unlock( &io->mutex );
+
+        uint64_t read_start = readahead_io_nanoseconds();
+        ssize_t result = pread( io->fd, io->ring + slot, count, offset );
+        int error = result < 0 ? errno : 0;
+        uint64_t read_ns = readahead_io_nanoseconds() - read_start;
+
+        pthread_mutex_lock( &io->mutex );
+        ++io->read_calls;
+        if( read_ns > io->longest_read_ns ) io->longest_read_ns = read_ns;
+        if( generation != io->generation ) continue;
+
+        if( result < 0 ) {
+            if( error == EINTR ) continue;
+            io->error = error;
+        } else if( result == 0 ) {
+            // NOTE: The file got shorter than when we opened it
+            io->size = offset;
+        } else {
+            io->end += result;
+            io->bytes_read += result;
+        }
+        pthread_cond_broadcast( &io->filled );
+    }
+    pthread_mutex_unlock( &io->mutex );
+    return NULL;
+}
+
+static int
+readahead_io_read( void * opaque, uint8_t * buffer, int size ) {
+    ReadaheadIo * io = ( ReadaheadIo * )opaque;
+    pthread_mutex_lock( &io->mutex );
+    int64_t ahead = readahead_io_ahead( io );
+    double fill = ( double )ahead / io->capacity;
+    io->fill_sum += fill;
+    if( io->reads == 0 || fill < io->fill_min ) io->fill_min = fill;
+    ++io->reads;
+
+    if( ahead == 0 && io->position < io->size && !io->error ) {
+        uint64_t stall_start = readahead_io_nanoseconds();
+        ++io->stalls;
+        while( readahead_io_ahead( io ) == 0 && io->position < io->size && !io->error ) {
+            pthread_cond_wait( &io->filled, &io->mutex );
+        }
+        uint64_t stall_ns = readahead_io_nanoseconds() - stall_start;
+        io->stall_ns += stall_ns;
+        if( stall_ns > io->longest_stall_ns ) io->longest_stall_ns = stall_ns;
+        ahead = readahead_io_ahead( io );
+    }
+
+    if( ahead == 0 ) {
+        int result = io->error && io->position < io->size ? AVERROR( io->error ) : AVERROR_EOF;
+        pthread_mutex_unlock( &io->mutex );
+        return result;
+    }
+    int64_t position = io->position;
+    pthread_mutex_unlock( &io->mutex );
+
+    int64_t slot = position % io->capacity;
+    int64_t count = ahead < size ? ahead : size;
+    if( count > io->capacity - slot ) count = io->capacity - slot;
+    memcpy( buffer, io->ring + slot, count );
+
+    pthread_mutex_lock( &io->mutex );
+    io->position += count;
+    pthread_cond_signal( &io->drained );
+    pthread_mutex_unlock( &io->mutex );
+    return ( int )count;
+}
+
+static int64_t
+readahead_io_seek( void * opaque, int64_t offset, int whence ) {
+    ReadaheadIo * io = ( ReadaheadIo * )opaque;
+    pthread_mutex_lock( &io->mutex );
+    int64_t position;
+    switch( whence & ~AVSEEK_FORCE ) {
+        case AVSEEK_SIZE: position = io->size; break;
+        case SEEK_SET:    position = offset; break;
+        case SEEK_CUR:    position = io->position + offset; break;
+        case SEEK_END:    position = io->size + offset; break;
+        default:          position = -1; break;
+    }
+    if( position < 0 || ( whence & AVSEEK_SIZE ) ) {
+        pthread_mutex_unlock( &io->mutex );
+        return position < 0 ? AVERROR( EINVAL ) : position;
+    }
+
+    // NOTE: A read that failed is tried again after any seek
+    ++io->seeks;
+    io->error = 0;
+    if( position >= io->start && position <= io->end ) {
+        ++io->seeks_in_ring;
+    } else {
+        io->start = position;
+        io->end = position;
+        ++io->generation;
+    }
+    io->position = position;
+    pthread_cond_signal( &io->drained );
+    pthread_mutex_unlock( &io->mutex );
+    return position;
+}
+
+void readahead_io_close( ReadaheadIo * io );
+
+// NOTE: Opens file_name with a ring of buffer_mb MiB and starts the I/O
+// thread. False for anything that isn't a regular file
+bool
+readahead_io_open( ReadaheadIo * io, const char * file_name, int buffer_mb ) {
+    memset( io, 0, sizeof( *io ) );
+    io->fd = open( file_name, O_RDONLY | O_CLOEXEC );
+    if( io->fd < 0 ) return false;
+
+    struct stat status;
+    if( fstat( io->fd, &status ) != 0 || !S_ISREG( status.st_mode ) ) {
+        close( io->fd );
+        return false;
+    }
+    io->size = status.st_size;
+    io->capacity = ( int64_t )buffer_mb * 1024 * 1024;
+    io->keep_behind = io->capacity / READAHEAD_IO_KEEP_BEHIND;
+    // NOTE: Our reads are sequential, the kernel can send the next ones
+    // to the server while we wait for this one
+    posix_fadvise( io->fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+    pthread_mutex_init( &io->mutex, NULL );
+    pthread_cond_init( &io->filled, NULL );
+    pthread_cond_init( &io->drained, NULL );
+
+    io->ring = ( uint8_t * )malloc( io->capacity );
+    uint8_t * buffer = ( uint8_t * )av_malloc( READAHEAD_IO_BUFFER_SIZE );
+    if( io->ring && buffer ) {
+        io->avio = avio_alloc_context( buffer, READAHEAD_IO_BUFFER_SIZE, 0, io,
+                                       readahead_io_read, NULL, readahead_io_seek );
+    }
+    if( !io->avio ) {
+        av_free( buffer );
+        readahead_io_close( io );
+        return false;
+    }
+
+    if( pthread_create( &io->thread, NULL, readahead_io_thread, io ) != 0 ) {
+        fprintf( stderr, "Could not start the read-ahead thread\n" );
+        readahead_io_close( io );
+        return false;
+    }
+    io->thread_started = true;
+    return true;
+}
+
+// NOTE: After avformat_close_input, which leaves a custom AVIOContext alone
+void
+readahead_io_close( ReadaheadIo * io ) {
+    if( io->thread_started ) {
+        pthread_mutex_lock( &io->mutex );
+        io->quit = true;
+        pthread_cond_broadcast( &io->drained );
+        pthread_mutex_unlock( &io->mutex );
+        pthread_join( io->thread, NULL );
+        io->thread_started = false;
+    }
+    if( io->avio ) {
+        av_freep( &io->avio->buffer );
+        avio_context_free( &io->avio );
+    }
+    free( io->ring );
+    io->ring = NULL;
+    if( io->fd >= 0 ) close( io->fd );
+    io->fd = -1;
+    pthread_mutex_destroy( &io->mutex );
+    pthread_cond_destroy( &io->filled );
+    pthread_cond_destroy( &io->drained );
+}
+
+void
+readahead_io_print_stats( ReadaheadIo * io ) {
+    pthread_mutex_lock( &io->mutex );
+    fprintf( stdout, "I/O (read-ahead, %lld MiB): %.1f MiB in %llu reads, longest %.1f ms\n",
+             ( long long )( io->capacity / 1048576 ), io->bytes_read / 1048576.0,
+             ( unsigned long long )io->read_calls, io->longest_read_ns / 1000000.0 );
+    fprintf( stdout, "  fill mean %.0f%% min %.0f%%, %llu stalls for %.1f ms (longest %.1f ms), "
+                     "%llu of %llu seeks within the ring\n",
+             io->reads ? 100.0 * io->fill_sum / io->reads : 0.0, 100.0 * io->fill_min,
+             ( unsigned long long )io->stalls, io->stall_ns / 1000000.0,
+             io->longest_stall_ns / 1000000.0, ( unsigned long long )io->seeks_in_ring,
+             ( unsigned long long )io->seeks );
+    pthread_mutex_unlock( &io->mutex );
+}
+
+// NOTE: Network filesystems, where reads are worth doing ahead on a thread
+bool
+readahead_io_is_network_file( const char * file_name ) {
+    struct statfs status;
+    if( statfs( file_name, &status ) != 0 ) return false;
+    switch( ( uint32_t )status.f_type ) {
+        case 0x6969:     // NFS
+        case 0x517b:     // SMB
+        case 0xff534d42: // CIFS
+        case 0xfe534d42: // SMB2
+        case 0x01021997: // 9P
+        case 0x00c36400: // Ceph
+            return true;
+        default:
+            return false;
+    }
+}
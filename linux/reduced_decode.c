@@ -0,0 +1,64 @@
+// NOTE: Decoding for a window much smaller than the video, e.g. one box
+// driving many small previews. Three things get cheaper:
+//
+// - lowres, picked once before the codec is opened because decoders can't
+//   change it mid-stream. Only some decoders (MPEG-1/2/4, MJPEG, ...) have
+//   it, and we never go below the window size
+// - deblocking and IDCT work whose artifacts disappear in the downscale,
+//   adjusted by the decoder thread whenever the window changes size
+// - frames that need swscale anyway are converted straight to about the
+//   window size instead of the full frame size
+//
+// Level 0: full quality
+// Level 1: frame at least 2x the window, skip the loop filter
+// Level 2: at least 4x, also skip the IDCT on non-reference frames
+
+#define REDUCED_DECODE_MAX_LOWRES 3
+
+// NOTE: Largest power of two reduction that still covers the viewport
+int
+reduced_decode_pick_lowres( const AVCodec * av_codec, int width, int height,
+                            int viewport_width, int viewport_height ) {
+    int lowres = 0;
+    while( lowres < av_codec->max_lowres && lowres < REDUCED_DECODE_MAX_LOWRES &&
+           ( width >> ( lowres + 1 ) ) >= viewport_width &&
+           ( height >> ( lowres + 1 ) ) >= viewport_height ) {
+        ++lowres;
+    }
+    return lowres;
+}
+
+int
+reduced_decode_level( int width, int height, int viewport_width, int viewport_height ) {
+    if( viewport_width < 1 || viewport_height < 1 ) return 0;
+
+    int ratio_x = width / viewport_width;
+    int ratio_y = height / viewport_height;
+    int ratio = ratio_x < ratio_y ? ratio_x : ratio_y;
+    return ratio >= 4 ? 2 : ratio >= 2 ? 1 : 0;
+}
+
+// NOTE: Decoder thread only, between packets. Takes the stronger of the
+// drop policy's skip level and the viewport's reduction for each setting
+void
+reduced_decode_apply( AVCodecContext * av_codec_ctx, int skip_level, int reduced_level ) {
+    drop_policy_apply_level( av_codec_ctx, skip_level );
+    if( reduced_level >= 1 ) av_codec_ctx->skip_loop_filter = AVDISCARD_ALL;
+    av_codec_ctx->skip_idct = reduced_level >= 2 ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+// NOTE: Size to convert a width x height frame to, keeping the aspect ratio
+// and never going below the viewport. Stays even for 4:2:0 chroma
+void
+reduced_decode_target_size( int width, int height, int viewport_width, int viewport_height,
+                            int * target_width, int * target_height ) {
+    *target_width = width;
+    *target_height = height;
+    if( reduced_decode_level( width, height, viewport_width, viewport_height ) < 1 ) return;
+
+    double scale_x = ( double )viewport_width / width;
+    double scale_y = ( double )viewport_height / height;
+    double scale = scale_x > scale_y ? scale_x : scale_y;
+    *target_width = ( ( int )ceil( width * scale ) + 1 ) & ~1;
+    *target_height = ( ( int )ceil( height * scale ) + 1 ) & ~1;
+}
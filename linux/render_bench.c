@@ -0,0 +1,773 @@
+// NOTE: Offscreen render benchmark. Runs the player's upload + shader +
+// draw path in an EGL context without a window, so it works on machines
+// with no display or GPU (Mesa llvmpipe). Frames are synthetic YUV420P
+// laid out like the decoder's, so no media file or libav libraries are
+// needed, only their headers for AVFrame.
+//
+// Before timing, a pattern frame is drawn 1:1 with nearest sampling and
+// pixels at the edges and on both sides of chroma block boundaries are
+// compared with the BT.601 conversion done on the CPU, which catches wrong
+// strides, swapped or misplaced chroma and texture coordinates that are a
+// pixel off. A flat frame then goes through the scaling filter to the
+// output size. The exit code makes this a regression test of the render
+// path. With --hdr the frames are BT.2020 PQ or HLG with 1000 nit
+// mastering metadata and the checks follow the tone mapping as well.
+// --output draws into a target of another size, so the scaling filters
+// can be compared, e.g. 4K frames into 960x540 tiles.
+//
+// Usage: ./render_bench [--size WxH] [--frames N] [--upload direct|pbo|persistent] [--pbo N]
+//                       [--format F] [--hdr pq|hlg] [--tone-map OP]
+//                       [--output WxH] [--scale bilinear|bicubic|lanczos]
+
+#define SOGL_MAJOR_VERSION 4
+#define SOGL_MINOR_VERSION 5
+#define SOGL_IMPLEMENTATION_X11
+#include "../opengl/simple-opengl-loader.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+#include <libavutil/mastering_display_metadata.h>
+
+typedef struct {
+    int texture_width;
+    int texture_height;
+    int texture_format;
+} FrameData;
+
+uint64_t
+get_nanoseconds( void ) {
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( uint64_t )now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// NOTE: Order is important
+#include "../opengl/opengl_render.c"
+#include "egl_offscreen.c"
+#include "latency_stats.c"
+
+#define BENCH_SOURCE_FRAMES 4
+#define BENCH_QUERY_DEPTH   4
+#define BENCH_ALIGN         32
+// NOTE: Pixels further off than this fail the checks
+#define BENCH_TOLERANCE     2
+
+typedef enum {
+    BENCH_UPLOAD_DIRECT,
+    BENCH_UPLOAD_PBO,
+    BENCH_UPLOAD_PERSISTENT
+} BenchUploadMode;
+
+const char * bench_upload_mode_names[] = { "direct", "pbo", "persistent" };
+
+typedef struct {
+    const char * name;
+    int          format;
+} BenchFormatName;
+
+// NOTE: YUV layouts the shaders sample directly
+static const BenchFormatName bench_format_names[] = {
+    { "yuv420p",     AV_PIX_FMT_YUV420P },
+    { "yuv422p",     AV_PIX_FMT_YUV422P },
+    { "yuv444p",     AV_PIX_FMT_YUV444P },
+    { "nv12",        AV_PIX_FMT_NV12 },
+    { "yuv420p10le", AV_PIX_FMT_YUV420P10LE },
+    { "yuv420p12le", AV_PIX_FMT_YUV420P12LE },
+    { "p010le",      AV_PIX_FMT_P010LE },
+};
+
+typedef struct {
+    AVFrame   frame;
+    uint8_t * buffer;
+} BenchFrame;
+
+// NOTE: What the synthetic HDR frames say about themselves. The side data
+// lives here because AVFrame only points to it
+typedef struct {
+    int                        transfer;
+    AVMasteringDisplayMetadata mastering;
+    AVFrameSideData            side_data;
+    AVFrameSideData          * side_data_list[1];
+} BenchHdr;
+
+typedef struct {
+    GLuint upload;
+    GLuint draw;
+    bool   pending;
+} BenchQueries;
+
+// NOTE: Planes back to back with lines padded to our alignment, like
+// av_image_fill_arrays. Returns the buffer size
+static size_t
+bench_frame_layout( AVFrame * frame, const OpenGLFormat * format, uint8_t * base,
+                    int width, int height ) {
+    int widths[3];
+    int heights[3];
+    opengl_plane_sizes( format, width, height, widths, heights );
+
+    frame->width = width;
+    frame->height = height;
+    frame->format = format->format;
+    size_t size = 0;
+    for( int i = 0; i < format->plane_count; ++i ) {
+        int bytes = widths[i] * format->bytes_per_pixel[i];
+        frame->linesize[i] = ( bytes + BENCH_ALIGN - 1 ) & ~( BENCH_ALIGN - 1 );
+        frame->data[i] = base ? base + size : NULL;
+        size += ( size_t )frame->linesize[i] * heights[i];
+    }
+    return size;
+}
+
+static bool
+bench_frame_init( BenchFrame * bench_frame, const OpenGLFormat * format,
+                  int width, int height, FrameData * frame_data, BenchHdr * hdr ) {
+    memset( bench_frame, 0, sizeof( *bench_frame ) );
+    size_t size = bench_frame_layout( &bench_frame->frame, format, NULL, width, height );
+    bench_frame->buffer = ( uint8_t * )malloc( size );
+    if( !bench_frame->buffer ) return false;
+
+    bench_frame_layout( &bench_frame->frame, format, bench_frame->buffer, width, height );
+    bench_frame->frame.opaque = frame_data;
+    // NOTE: The check below expects BT.601 limited range, or BT.2020 for HDR
+    bench_frame->frame.colorspace = AVCOL_SPC_BT470BG;
+    bench_frame->frame.color_range = AVCOL_RANGE_MPEG;
+    if( hdr->transfer != OPENGL_TRANSFER_SDR ) {
+        bench_frame->frame.colorspace = AVCOL_SPC_BT2020_NCL;
+        bench_frame->frame.color_primaries = AVCOL_PRI_BT2020;
+        bench_frame->frame.color_trc = hdr->transfer == OPENGL_TRANSFER_PQ ?
+                                       AVCOL_TRC_SMPTE2084 : AVCOL_TRC_ARIB_STD_B67;
+        bench_frame->frame.side_data = hdr->side_data_list;
+        bench_frame->frame.nb_side_data = 1;
+    }
+    return true;
+}
+
+static void
+bench_hdr_init( BenchHdr * hdr, int transfer ) {
+    memset( hdr, 0, sizeof( *hdr ) );
+    hdr->transfer = transfer;
+    hdr->mastering.has_luminance = 1;
+    hdr->mastering.max_luminance = ( AVRational ){ 1000, 1 };
+    hdr->mastering.min_luminance = ( AVRational ){ 1, 10000 };
+    hdr->side_data.type = AV_FRAME_DATA_MASTERING_DISPLAY_METADATA;
+    hdr->side_data.data = ( uint8_t * )&hdr->mastering;
+    hdr->side_data.size = sizeof( hdr->mastering );
+    hdr->side_data_list[0] = &hdr->side_data;
+}
+
+// NOTE: The stored sample the shader reads back as value, 0-1
+static unsigned int
+bench_sample( const OpenGLFormat * format, double value ) {
+    double max = format->type == GL_UNSIGNED_SHORT ? 65535.0 : 255.0;
+    return ( unsigned int )lround( value * max / format->scale );
+}
+
+static void
+bench_store( const OpenGLFormat * format, uint8_t * line, int index, unsigned int sample ) {
+    if( format->type == GL_UNSIGNED_SHORT ) {
+        ( ( uint16_t * )line )[index] = ( uint16_t )sample;
+    } else {
+        line[index] = ( uint8_t )sample;
+    }
+}
+
+// NOTE: The pattern: a luma gradient that steps by several codes per
+// pixel and line, and U and V that differ from each other and change by
+// many codes from one chroma block to the next. Chroma stays around the
+// middle so few pixels clip
+static double
+bench_pattern_y( int x, int row, int seed ) {
+    return ( 32 + ( x * 7 + row * 13 + seed * 8 ) % 192 ) / 255.0;
+}
+
+static double
+bench_pattern_u( int x, int row, int seed ) {
+    return ( 80 + ( x * 29 + row * 11 + seed * 4 ) % 96 ) / 255.0;
+}
+
+static double
+bench_pattern_v( int x, int row, int seed ) {
+    return ( 80 + ( x * 17 + row * 23 + seed * 4 ) % 96 ) / 255.0;
+}
+
+// NOTE: Flat frames have the given Y, U, V everywhere (0-1), others get
+// the pattern, which changes with the seed
+static void
+bench_frame_fill( BenchFrame * bench_frame, const OpenGLFormat * format, int seed, bool flat,
+                  double y, double u, double v ) {
+    AVFrame * frame = &bench_frame->frame;
+    int widths[3];
+    int heights[3];
+    opengl_plane_sizes( format, frame->width, frame->height, widths, heights );
+
+    for( int row = 0; row < heights[0]; ++row ) {
+        uint8_t * line = frame->data[0] + ( size_t )row * frame->linesize[0];
+        for( int x = 0; x < widths[0]; ++x ) {
+            double value = flat ? y : bench_pattern_y( x, row, seed );
+            bench_store( format, line, x, bench_sample( format, value ) );
+        }
+    }
+
+    for( int row = 0; row < heights[1]; ++row ) {
+        for( int x = 0; x < widths[1]; ++x ) {
+            double value_u = flat ? u : bench_pattern_u( x, row, seed );
+            double value_v = flat ? v : bench_pattern_v( x, row, seed );
+            uint8_t * line_u = frame->data[1] + ( size_t )row * frame->linesize[1];
+            if( format->plane_count == 2 ) {
+                bench_store( format, line_u, x * 2, bench_sample( format, value_u ) );
+                bench_store( format, line_u, x * 2 + 1, bench_sample( format, value_v ) );
+            } else {
+                uint8_t * line_v = frame->data[2] + ( size_t )row * frame->linesize[2];
+                bench_store( format, line_u, x, bench_sample( format, value_u ) );
+                bench_store( format, line_v, x, bench_sample( format, value_v ) );
+            }
+        }
+    }
+}
+
+// NOTE: What the shader makes of the stored sample for value, with the
+// 8-bit offset and range scaled to the format's bit depth
+static double
+bench_limited_range( const OpenGLFormat * format, double value, double offset, double range ) {
+    double max = format->type == GL_UNSIGNED_SHORT ? 65535.0 : 255.0;
+    double code = bench_sample( format, value ) / max * format->scale * ( ( 1 << format->depth ) - 1 );
+    double step = 1 << ( format->depth - 8 );
+    return ( code - offset * step ) / ( range * step );
+}
+
+static uint8_t
+bench_expected_channel( double value ) {
+    if( value < 0.0 ) value = 0.0;
+    if( value > 1.0 ) value = 1.0;
+    return ( uint8_t )lround( value * 255.0 );
+}
+
+static double
+bench_pq_to_nits( double e ) {
+    double p = pow( fmin( fmax( e, 0.0 ), 1.0 ), 1.0 / 78.84375 );
+    return 10000.0 * pow( fmax( p - 0.8359375, 0.0 ) / ( 18.8515625 - 18.6875 * p ),
+                          1.0 / 0.1593017578125 );
+}
+
+static double
+bench_nits_to_pq( double nits ) {
+    double y = pow( fmin( fmax( nits / 10000.0, 0.0 ), 1.0 ), 0.1593017578125 );
+    return pow( ( 0.8359375 + 18.8515625 * y ) / ( 1.0 + 18.6875 * y ), 78.84375 );
+}
+
+static double
+bench_hlg_to_scene( double e ) {
+    return e <= 0.5 ? e * e / 3.0 : ( exp( ( e - 0.55991073 ) / 0.17883277 ) + 0.28466892 ) / 12.0;
+}
+
+static double
+bench_hable( double x ) {
+    return ( x * ( 0.15 * x + 0.05 ) + 0.004 ) / ( x * ( 0.15 * x + 0.5 ) + 0.06 ) - 0.02 / 0.3;
+}
+
+// NOTE: The shader's tone mapping written out again on the CPU, from
+// nonlinear BT.2020 RGB to gamma 2.4 BT.709. peak is in reference whites
+static void
+bench_tone_map( int transfer, OpenGLToneMap tone_map, double peak, double * rgb ) {
+    static const double bt2020_to_bt709[3][3] = {
+        {  1.6605, -0.5876, -0.0728 },
+        { -0.1246,  1.1329, -0.0083 },
+        { -0.0182, -0.1006,  1.1187 },
+    };
+    double white = OPENGL_REFERENCE_WHITE_NITS;
+
+    double light[3];
+    for( int i = 0; i < 3; ++i ) {
+        double e = fmin( fmax( rgb[i], 0.0 ), 1.0 );
+        light[i] = transfer == OPENGL_TRANSFER_PQ ? bench_pq_to_nits( e ) / white :
+                                                    bench_hlg_to_scene( e );
+    }
+    if( transfer == OPENGL_TRANSFER_HLG ) {
+        double luminance = 0.2627 * light[0] + 0.6780 * light[1] + 0.0593 * light[2];
+        for( int i = 0; i < 3; ++i ) light[i] *= 1000.0 * pow( luminance, 0.2 ) / white;
+    }
+
+    double linear[3];
+    double brightest = 0.0;
+    for( int i = 0; i < 3; ++i ) {
+        linear[i] = 0.0;
+        for( int j = 0; j < 3; ++j ) linear[i] += bt2020_to_bt709[i][j] * light[j];
+        linear[i] = fmax( linear[i], 0.0 );
+        brightest = fmax( brightest, linear[i] );
+    }
+
+    double mapped = brightest;
+    if( tone_map == OPENGL_TONE_MAP_BT2390 ) {
+        double source = bench_nits_to_pq( peak * white );
+        double e = fmin( bench_nits_to_pq( brightest * white ) / source, 1.0 );
+        double target = bench_nits_to_pq( white ) / source;
+        double knee = 1.5 * target - 0.5;
+        if( e > knee ) {
+            double t = ( e - knee ) / ( 1.0 - knee );
+            e = ( 2 * t * t * t - 3 * t * t + 1 ) * knee + ( t * t * t - 2 * t * t + t ) * ( 1 - knee ) +
+                ( -2 * t * t * t + 3 * t * t ) * target;
+        }
+        mapped = bench_pq_to_nits( e * source ) / white;
+    } else if( tone_map == OPENGL_TONE_MAP_HABLE ) {
+        mapped = bench_hable( brightest ) / bench_hable( peak );
+    }
+
+    for( int i = 0; i < 3; ++i ) {
+        if( brightest > 0.0 ) linear[i] *= mapped / brightest;
+        rgb[i] = pow( fmin( linear[i], 1.0 ), 1.0 / 2.4 );
+    }
+}
+
+// NOTE: The shader's limited range conversion (and tone mapping) of the
+// stored Y, U, V done on the CPU
+static void
+bench_expected_pixel( const OpenGLFormat * format, BenchHdr * hdr, OpenGLToneMap tone_map,
+                      double y, double u, double v, uint8_t * expected ) {
+    bool hdr_frame = hdr->transfer != OPENGL_TRANSFER_SDR;
+    double kr = hdr_frame ? 0.2627 : 0.299;
+    double kb = hdr_frame ? 0.0593 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double luma = bench_limited_range( format, y, 16.0, 219.0 );
+    double cb = bench_limited_range( format, u, 128.0, 224.0 );
+    double cr = bench_limited_range( format, v, 128.0, 224.0 );
+    double rgb[3] = {
+        luma + 2.0 * ( 1.0 - kr ) * cr,
+        luma - 2.0 * kb * ( 1.0 - kb ) / kg * cb - 2.0 * kr * ( 1.0 - kr ) / kg * cr,
+        luma + 2.0 * ( 1.0 - kb ) * cb,
+    };
+    if( hdr_frame && tone_map != OPENGL_TONE_MAP_OFF ) {
+        double peak = hdr->transfer == OPENGL_TRANSFER_PQ ?
+                      ( double )hdr->mastering.max_luminance.num / hdr->mastering.max_luminance.den :
+                      OPENGL_DEFAULT_PEAK_NITS;
+        bench_tone_map( hdr->transfer, tone_map, peak / OPENGL_REFERENCE_WHITE_NITS, rgb );
+    }
+    for( int i = 0; i < 3; ++i ) {
+        expected[i] = bench_expected_channel( rgb[i] );
+    }
+}
+
+static bool
+bench_pixel_matches( const uint8_t * pixel, const uint8_t * expected ) {
+    for( int i = 0; i < 3; ++i ) {
+        if( abs( pixel[i] - expected[i] ) > BENCH_TOLERANCE ) return false;
+    }
+    return true;
+}
+
+// NOTE: Draws the pattern at its own size, at most the output size and
+// even so chroma blocks are whole, with the plane textures switched to
+// nearest sampling, so every output pixel is exactly one luma and one
+// chroma sample. Compares the corners, the lines and columns next to them
+// and the two sides of the chroma block boundaries around the center
+static bool
+bench_check_pattern( const OpenGLFormat * format, unsigned int * textures,
+                     OpenGLUploader * uploader, FrameData * frame_data, BenchHdr * hdr,
+                     OpenGLToneMap tone_map, int width, int height, int output_width,
+                     int output_height ) {
+    int check_width = ( width < output_width ? width : output_width ) & ~1;
+    int check_height = ( height < output_height ? height : output_height ) & ~1;
+    if( check_width < 4 || check_height < 4 ) return true;
+
+    BenchFrame bench_frame;
+    uint8_t * pixels = ( uint8_t * )malloc( ( size_t )check_width * check_height * 4 );
+    if( !pixels || !bench_frame_init( &bench_frame, format, check_width, check_height,
+                                      frame_data, hdr ) ) {
+        free( pixels );
+        fprintf( stderr, "Out of memory\n" );
+        return false;
+    }
+    bench_frame_fill( &bench_frame, format, 0, false, 0, 0, 0 );
+
+    glViewport( 0, 0, check_width, check_height );
+    glClear( GL_COLOR_BUFFER_BIT );
+    opengl_upload_frame( &bench_frame.frame, textures, uploader );
+    for( int i = 0; i < format->plane_count; ++i ) {
+        glTextureParameteri( textures[i], GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+        glTextureParameteri( textures[i], GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+    }
+    opengl_draw();
+    glReadPixels( 0, 0, check_width, check_height, GL_RGBA, GL_UNSIGNED_BYTE, pixels );
+    for( int i = 0; i < format->plane_count; ++i ) {
+        glTextureParameteri( textures[i], GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+        glTextureParameteri( textures[i], GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    }
+    glViewport( 0, 0, output_width, output_height );
+
+    int block_x = 1 << format->chroma_shift_x;
+    int block_y = 1 << format->chroma_shift_y;
+    int center_x = check_width / 2 / block_x * block_x;
+    int center_y = check_height / 2 / block_y * block_y;
+    const int xs[] = { 0, 1, center_x - 1, center_x, center_x + 1, check_width - 2, check_width - 1 };
+    const int ys[] = { 0, 1, center_y - 1, center_y, center_y + 1, check_height - 2, check_height - 1 };
+    int count = 0;
+    int failures = 0;
+    for( size_t j = 0; j < sizeof( ys ) / sizeof( ys[0] ); ++j ) {
+        for( size_t i = 0; i < sizeof( xs ) / sizeof( xs[0] ); ++i ) {
+            int x = xs[i];
+            int row = ys[j];
+            int chroma_x = x >> format->chroma_shift_x;
+            int chroma_y = row >> format->chroma_shift_y;
+            uint8_t expected[3];
+            bench_expected_pixel( format, hdr, tone_map, bench_pattern_y( x, row, 0 ),
+                                  bench_pattern_u( chroma_x, chroma_y, 0 ),
+                                  bench_pattern_v( chroma_x, chroma_y, 0 ), expected );
+
+            // NOTE: Row 0 of the frame is at the top, glReadPixels starts
+            // at the bottom
+            const uint8_t * pixel = pixels + ( ( size_t )( check_height - 1 - row ) * check_width + x ) * 4;
+            ++count;
+            if( !bench_pixel_matches( pixel, expected ) ) {
+                if( failures++ < 4 ) {
+                    fprintf( stdout, "Pattern check at %d,%d: got %d %d %d, expected %d %d %d\n",
+                             x, row, pixel[0], pixel[1], pixel[2],
+                             expected[0], expected[1], expected[2] );
+                }
+            }
+        }
+    }
+
+    GLenum error = glGetError();
+    fprintf( stdout, "Pattern check: %dx%d, %d of %d pixels match, GL error 0x%x: %s\n",
+             check_width, check_height, count - failures, count, error,
+             failures == 0 && error == GL_NO_ERROR ? "ok" : "FAILED" );
+    free( bench_frame.buffer );
+    free( pixels );
+    return failures == 0 && error == GL_NO_ERROR;
+}
+
+// NOTE: Draws a flat frame through the scaling filter to the output size
+// and compares the center pixel. Every scaling filter keeps a flat frame
+// flat
+static bool
+bench_check_output( BenchFrame * bench_frame, const OpenGLFormat * format,
+                    unsigned int * textures, OpenGLUploader * uploader, OpenGLScaler * scaler,
+                    int width, int height, BenchHdr * hdr, OpenGLToneMap tone_map ) {
+    // NOTE: For HDR a pale color around 600 nits, which every curve has to
+    // compress but doesn't clip to a primary
+    bool hdr_frame = hdr->transfer != OPENGL_TRANSFER_SDR;
+    const double y = ( hdr_frame ? 170 : 180 ) / 255.0;
+    const double u = ( hdr_frame ? 120 : 90 ) / 255.0;
+    const double v = ( hdr_frame ? 140 : 200 ) / 255.0;
+    bench_frame_fill( bench_frame, format, 0, true, y, u, v );
+    glClear( GL_COLOR_BUFFER_BIT );
+    opengl_upload_frame( &bench_frame->frame, textures, uploader );
+    opengl_scaler_draw( scaler, bench_frame->frame.width, bench_frame->frame.height,
+                        width, height );
+
+    uint8_t pixel[4];
+    glReadPixels( width / 2, height / 2, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixel );
+
+    uint8_t expected[3];
+    bench_expected_pixel( format, hdr, tone_map, y, u, v, expected );
+    bool matches = bench_pixel_matches( pixel, expected );
+
+    GLenum error = glGetError();
+    fprintf( stdout, "Scaled check: got %d %d %d, expected %d %d %d, GL error 0x%x: %s\n",
+             pixel[0], pixel[1], pixel[2], expected[0], expected[1], expected[2],
+             error, matches && error == GL_NO_ERROR ? "ok" : "FAILED" );
+    return matches && error == GL_NO_ERROR;
+}
+
+static bool
+parse_size( const char * text, int * width, int * height ) {
+    return sscanf( text, "%dx%d", width, height ) == 2 && *width > 0 && *height > 0;
+}
+
+int
+main( int argc, char const * argv[] ) {
+    int width = 1920;
+    int height = 1080;
+    int output_width = 0;
+    int output_height = 0;
+    OpenGLScaleFilter scale_filter = OPENGL_SCALE_BILINEAR;
+    int frame_count = 600;
+    BenchUploadMode upload_mode = BENCH_UPLOAD_PBO;
+    int upload_buffers = 3;
+    const BenchFormatName * format_name = &bench_format_names[0];
+    int transfer = OPENGL_TRANSFER_SDR;
+    OpenGLToneMap tone_map = OPENGL_TONE_MAP_BT2390;
+
+    for( int i = 1; i < argc; ++i ) {
+        if( strcmp( argv[i], "--size" ) == 0 && i + 1 < argc ) {
+            if( !parse_size( argv[++i], &width, &height ) ) {
+                fprintf( stderr, "Bad size %s\n", argv[i] );
+                return 1;
+            }
+        } else if( strcmp( argv[i], "--output" ) == 0 && i + 1 < argc ) {
+            if( !parse_size( argv[++i], &output_width, &output_height ) ) {
+                fprintf( stderr, "Bad output size %s\n", argv[i] );
+                return 1;
+            }
+        } else if( strcmp( argv[i], "--scale" ) == 0 && i + 1 < argc ) {
+            ++i;
+            scale_filter = OPENGL_SCALE_COUNT;
+            for( int j = 0; j < OPENGL_SCALE_COUNT; ++j ) {
+                if( strcmp( argv[i], opengl_scale_filter_names[j] ) == 0 ) {
+                    scale_filter = ( OpenGLScaleFilter )j;
+                }
+            }
+            if( scale_filter == OPENGL_SCALE_COUNT ) {
+                fprintf( stderr, "Unknown scaling filter %s\n", argv[i] );
+                return 1;
+            }
+        } else if( strcmp( argv[i], "--frames" ) == 0 && i + 1 < argc ) {
+            frame_count = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--upload" ) == 0 && i + 1 < argc ) {
+            ++i;
+            if( strcmp( argv[i], "direct" ) == 0 ) {
+                upload_mode = BENCH_UPLOAD_DIRECT;
+            } else if( strcmp( argv[i], "pbo" ) == 0 ) {
+                upload_mode = BENCH_UPLOAD_PBO;
+            } else if( strcmp( argv[i], "persistent" ) == 0 ) {
+                upload_mode = BENCH_UPLOAD_PERSISTENT;
+            } else {
+                fprintf( stderr, "Unknown upload mode %s\n", argv[i] );
+                return 1;
+            }
+        } else if( strcmp( argv[i], "--pbo" ) == 0 && i + 1 < argc ) {
+            upload_buffers = atoi( argv[++i] );
+        } else if( strcmp( argv[i], "--format" ) == 0 && i + 1 < argc ) {
+            ++i;
+            format_name = NULL;
+            for( size_t j = 0; j < sizeof( bench_format_names ) / sizeof( bench_format_names[0] ); ++j ) {
+                if( strcmp( argv[i], bench_format_names[j].name ) == 0 ) {
+                    format_name = &bench_format_names[j];
+                }
+            }
+            if( !format_name ) {
+                fprintf( stderr, "Unknown format %s\n", argv[i] );
+                return 1;
+            }
+        } else if( strcmp( argv[i], "--hdr" ) == 0 && i + 1 < argc ) {
+            ++i;
+            if( strcmp( argv[i], "pq" ) == 0 ) {
+                transfer = OPENGL_TRANSFER_PQ;
+            } else if( strcmp( argv[i], "hlg" ) == 0 ) {
+                transfer = OPENGL_TRANSFER_HLG;
+            } else {
+                fprintf( stderr, "Unknown transfer %s\n", argv[i] );
+                return 1;
+            }
+        } else if( strcmp( argv[i], "--tone-map" ) == 0 && i + 1 < argc ) {
+            ++i;
+            tone_map = OPENGL_TONE_MAP_COUNT;
+            for( int j = 0; j < OPENGL_TONE_MAP_COUNT; ++j ) {
+                if( strcmp( argv[i], opengl_tone_map_names[j] ) == 0 ) tone_map = ( OpenGLToneMap )j;
+            }
+            if( tone_map == OPENGL_TONE_MAP_COUNT ) {
+                fprintf( stderr, "Unknown tone mapping %s\n", argv[i] );
+                return 1;
+            }
+        } else {
+            fprintf( stdout, "Usage: ./render_bench [--size WxH] [--frames N] "
+                             "[--upload direct|pbo|persistent] [--pbo N] [--format F] "
+                             "[--hdr pq|hlg] [--tone-map bt2390|hable|clip|off] "
+                             "[--output WxH] [--scale bilinear|bicubic|lanczos]\n"
+                             "Formats:" );
+            for( size_t j = 0; j < sizeof( bench_format_names ) / sizeof( bench_format_names[0] ); ++j ) {
+                fprintf( stdout, " %s", bench_format_names[j].name );
+            }
+            fprintf( stdout, "\n" );
+            return 0;
+        }
+    }
+
+    if( frame_count < 1 || upload_buffers < 0 || upload_buffers > OPENGL_MAX_UPLOAD_BUFFERS ) {
+        fprintf( stderr, "Need at least one frame and 0 to %d upload buffers\n",
+                 OPENGL_MAX_UPLOAD_BUFFERS );
+        return 1;
+    }
+    if( upload_buffers == 0 ) upload_mode = BENCH_UPLOAD_DIRECT;
+    if( output_width == 0 ) {
+        output_width = width;
+        output_height = height;
+    }
+
+    EglOffscreen offscreen;
+    if( !egl_offscreen_create( &offscreen, output_width, output_height ) ) {
+        egl_offscreen_destroy( &offscreen );
+        return 1;
+    }
+
+    fprintf( stdout, "Renderer: %s, %s, %s context\n",
+             ( const char * )glGetString( GL_RENDERER ),
+             ( const char * )glGetString( GL_VERSION ),
+             offscreen.surfaceless ? "surfaceless" : "pbuffer" );
+
+    FrameData frame_data = { -1, -1, -1 };
+    unsigned int textures[3];
+    OpenGLGeometry geometry;
+    OpenGLUploader uploader;
+    OpenGLScaler scaler;
+    glClearColor( 0.0, 0.0, 0.0, 1.0 );
+    opengl_generate_texture( textures );
+    opengl_make_program();
+    opengl_set_tone_map( tone_map );
+    opengl_create_scaler( &scaler, scale_filter );
+    opengl_create_geometry( &geometry );
+
+    const OpenGLFormat * format = opengl_find_format( format_name->format );
+    AVFrame layout;
+    size_t frame_size = bench_frame_layout( &layout, format, NULL, width, height );
+    if( upload_mode == BENCH_UPLOAD_PERSISTENT ) {
+        if( !opengl_create_persistent_uploader( &uploader, frame_size, upload_buffers + 1 ) ) {
+            fprintf( stderr, "Persistent mapping not supported\n" );
+            return 1;
+        }
+    } else {
+        opengl_create_uploader( &uploader, upload_mode == BENCH_UPLOAD_DIRECT ? 0 : upload_buffers );
+    }
+
+    BenchHdr hdr;
+    bench_hdr_init( &hdr, transfer );
+    BenchFrame sources[BENCH_SOURCE_FRAMES];
+    for( int i = 0; i < BENCH_SOURCE_FRAMES; ++i ) {
+        if( !bench_frame_init( &sources[i], format, width, height, &frame_data, &hdr ) ) {
+            fprintf( stderr, "Out of memory\n" );
+            return 1;
+        }
+    }
+
+    bool check_passed = bench_check_pattern( format, textures, &uploader, &frame_data, &hdr,
+                                             tone_map, width, height, output_width, output_height );
+    check_passed = bench_check_output( &sources[0], format, textures, &uploader, &scaler,
+                                       output_width, output_height, &hdr, tone_map ) && check_passed;
+    for( int i = 0; i < BENCH_SOURCE_FRAMES; ++i ) {
+        bench_frame_fill( &sources[i], format, i, false, 0, 0, 0 );
+    }
+
+    // NOTE: Persistent mode copies each frame into a free slot first, the
+    // copy the decoder thread would do, and it counts as upload time
+    uint8_t * free_slots[OPENGL_MAX_STAGING_SLOTS];
+    int free_slot_count = 0;
+    for( int i = 0; i < uploader.staging_slot_count; ++i ) {
+        free_slots[free_slot_count++] = opengl_staging_slot_memory( &uploader, i );
+    }
+
+    BenchQueries queries[BENCH_QUERY_DEPTH];
+    for( int i = 0; i < BENCH_QUERY_DEPTH; ++i ) {
+        glGenQueries( 1, &queries[i].upload );
+        glGenQueries( 1, &queries[i].draw );
+        queries[i].pending = false;
+    }
+
+    LatencyStats upload_cpu, upload_gpu, draw_cpu, draw_gpu;
+    latency_stats_init( &upload_cpu );
+    latency_stats_init( &upload_gpu );
+    latency_stats_init( &draw_cpu );
+    latency_stats_init( &draw_gpu );
+
+    // NOTE: Bytes the shader actually samples, the padding to the line
+    // size is transferred too but isn't counted
+    int plane_widths[3];
+    int plane_heights[3];
+    opengl_plane_sizes( format, width, height, plane_widths, plane_heights );
+    uint64_t bytes_per_frame = 0;
+    for( int i = 0; i < format->plane_count; ++i ) {
+        bytes_per_frame += ( uint64_t )plane_widths[i] * plane_heights[i] *
+                           format->bytes_per_pixel[i];
+    }
+
+    uint64_t start = get_nanoseconds();
+    for( int i = 0; i < frame_count + BENCH_QUERY_DEPTH; ++i ) {
+        BenchQueries * query = &queries[i % BENCH_QUERY_DEPTH];
+        if( query->pending ) {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v( query->upload, GL_QUERY_RESULT, &elapsed );
+            latency_stats_add( &upload_gpu, elapsed );
+            glGetQueryObjectui64v( query->draw, GL_QUERY_RESULT, &elapsed );
+            latency_stats_add( &draw_gpu, elapsed );
+            query->pending = false;
+        }
+        if( i >= frame_count ) continue;
+
+        uint8_t * slot;
+        while( ( slot = opengl_reclaim_staging_slot( &uploader ) ) != NULL ) {
+            free_slots[free_slot_count++] = slot;
+        }
+
+        BenchFrame * source = &sources[i % BENCH_SOURCE_FRAMES];
+        AVFrame staged_frame;
+        AVFrame * frame = &source->frame;
+
+        uint64_t upload_start = get_nanoseconds();
+        if( upload_mode == BENCH_UPLOAD_PERSISTENT ) {
+            while( free_slot_count == 0 ) {
+                glFinish();
+                while( ( slot = opengl_reclaim_staging_slot( &uploader ) ) != NULL ) {
+                    free_slots[free_slot_count++] = slot;
+                }
+            }
+            slot = free_slots[--free_slot_count];
+            memcpy( slot, source->buffer, frame_size );
+            staged_frame = source->frame;
+            bench_frame_layout( &staged_frame, format, slot, width, height );
+            frame = &staged_frame;
+        }
+
+        glBeginQuery( GL_TIME_ELAPSED, query->upload );
+        opengl_upload_frame( frame, textures, &uploader );
+        glEndQuery( GL_TIME_ELAPSED );
+        uint64_t draw_start = get_nanoseconds();
+
+        glBeginQuery( GL_TIME_ELAPSED, query->draw );
+        glClear( GL_COLOR_BUFFER_BIT );
+        opengl_scaler_draw( &scaler, width, height, output_width, output_height );
+        glEndQuery( GL_TIME_ELAPSED );
+        glFlush();
+        uint64_t draw_end = get_nanoseconds();
+
+        query->pending = true;
+        latency_stats_add( &upload_cpu, draw_start - upload_start );
+        latency_stats_add( &draw_cpu, draw_end - draw_start );
+    }
+    glFinish();
+    double seconds = ( get_nanoseconds() - start ) / 1000000000.0;
+
+    double megabytes = ( double )bytes_per_frame * frame_count / ( 1024.0 * 1024.0 );
+    double upload_cpu_seconds = upload_cpu.sum_ns / 1000000000.0;
+    double upload_gpu_seconds = upload_gpu.sum_ns / 1000000000.0;
+    fprintf( stdout, "Render benchmark (%s%s%s, %s upload, %d buffers): %d frames of %dx%d "
+                     "to %dx%d %s in %.3f s, %.1f frames/s\n",
+             format_name->name,
+             transfer == OPENGL_TRANSFER_SDR ? "" : transfer == OPENGL_TRANSFER_PQ ? " PQ " : " HLG ",
+             transfer == OPENGL_TRANSFER_SDR ? "" : opengl_tone_map_names[tone_map],
+             bench_upload_mode_names[upload_mode],
+             upload_mode == BENCH_UPLOAD_DIRECT ? 0 : upload_buffers,
+             frame_count, width, height, output_width, output_height,
+             opengl_scale_filter_names[scale_filter], seconds, frame_count / seconds );
+    // NOTE: Software drivers defer work to the flush, so the GPU timer may
+    // charge rasterization to the upload. Compare both on the same driver
+    fprintf( stdout, "  upload bandwidth %.1f MiB/s render thread, %.1f MiB/s GPU timer, "
+                     "%.1f MiB/s end to end, %llu fence waits\n",
+             upload_cpu_seconds > 0 ? megabytes / upload_cpu_seconds : 0.0,
+             upload_gpu_seconds > 0 ? megabytes / upload_gpu_seconds : 0.0,
+             megabytes / seconds,
+             ( unsigned long long )uploader.fence_waits );
+    latency_stats_print( "upload", &upload_cpu );
+    latency_stats_print( "upload*", &upload_gpu );
+    latency_stats_print( "draw", &draw_cpu );
+    latency_stats_print( "draw*", &draw_gpu );
+    fprintf( stdout, "  * GPU time from timer queries\n" );
+
+    for( int i = 0; i < BENCH_QUERY_DEPTH; ++i ) {
+        glDeleteQueries( 1, &queries[i].upload );
+        glDeleteQueries( 1, &queries[i].draw );
+    }
+    for( int i = 0; i < BENCH_SOURCE_FRAMES; ++i ) {
+        free( sources[i].buffer );
+    }
+    opengl_destroy_uploader( &uploader );
+    opengl_destroy_scaler( &scaler );
+    opengl_destroy_geometry( &geometry );
+    glDeleteTextures( 3, textures );
+    egl_offscreen_destroy( &offscreen );
+    return check_passed ? 0 : 1;
+}
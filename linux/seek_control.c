@@ -0,0 +1,201 @@
+// NOTE: Turns key presses and commands from an IPC FIFO into seek targets
+// and follows each seek until its first frame is on screen.
+//
+// Keys: Left/Right 10 s, Down/Up 60 s, Home to the start, 0-9 to 0-90%.
+// FIFO commands, one per line: "seek 120" (absolute seconds), "seek +10"
+// or "seek -10" (relative) and "seek 50%". For example
+//   echo "seek +30" > /tmp/player.fifo
+// The FIFO also takes "speed 2", which is left for playback_speed.c
+
+#include <X11/keysym.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define SEEK_CONTROL_LINE 256
+
+typedef struct {
+    int          fifo;
+    char         line[SEEK_CONTROL_LINE];
+    int          line_length;
+    // NOTE: Last speed command not taken yet, 0 if none
+    double       speed;
+
+    // NOTE: Media time of the file, in seconds, duration 0 if unknown
+    double       start;
+    double       duration;
+
+    // NOTE: The seek we are waiting for
+    bool         pending;
+    bool         first_frame_due;
+    int          serial;
+    double       target;
+    uint64_t     request_ns;
+
+    uint64_t     requests;
+    LatencyStats latency;
+} SeekControl;
+
+// NOTE: Creates the FIFO if it doesn't exist yet. Opening it read only and
+// non-blocking means we never wait for a writer
+bool
+seek_control_init( SeekControl * control, const char * fifo_path, double start, double duration ) {
+    memset( control, 0, sizeof( *control ) );
+    control->fifo = -1;
+    control->start = start;
+    control->duration = duration;
+    latency_stats_init( &control->latency );
+    if( !fifo_path ) return true;
+
+    if( mkfifo( fifo_path, 0600 ) != 0 && errno != EEXIST ) {
+        fprintf( stderr, "Could not create FIFO %s: %s\n", fifo_path, strerror( errno ) );
+        return false;
+    }
+    control->fifo = open( fifo_path, O_RDONLY | O_NONBLOCK );
+    if( control->fifo < 0 ) {
+        fprintf( stderr, "Could not open FIFO %s: %s\n", fifo_path, strerror( errno ) );
+        return false;
+    }
+    return true;
+}
+
+void
+seek_control_destroy( SeekControl * control ) {
+    if( control->fifo >= 0 ) close( control->fifo );
+    control->fifo = -1;
+}
+
+static double
+seek_control_clamp( SeekControl * control, double target ) {
+    if( control->duration > 0 && target > control->start + control->duration ) {
+        target = control->start + control->duration;
+    }
+    if( target < control->start ) target = control->start;
+    return target;
+}
+
+// NOTE: Seek target for a key, false if the key doesn't seek
+bool
+seek_control_key( SeekControl * control, KeySym key, double position, double * target ) {
+    double delta = 0;
+    switch( key ) {
+        case XK_Left:  delta = -10; break;
+        case XK_Right: delta = 10;  break;
+        case XK_Down:  delta = -60; break;
+        case XK_Up:    delta = 60;  break;
+        case XK_Home:
+            *target = control->start;
+            return true;
+        default:
+            if( key >= XK_0 && key <= XK_9 && control->duration > 0 ) {
+                *target = control->start + control->duration * ( key - XK_0 ) / 10.0;
+                return true;
+            }
+            return false;
+    }
+    *target = seek_control_clamp( control, position + delta );
+    return true;
+}
+
+static bool
+seek_control_parse( SeekControl * control, const char * command, double position, double * target ) {
+    char argument[64];
+    double speed;
+    if( sscanf( command, " speed %lf", &speed ) == 1 && speed > 0 ) {
+        control->speed = speed;
+        return false;
+    }
+    if( sscanf( command, " seek %63s", argument ) != 1 ) {
+        fprintf( stderr, "Unknown command: %s\n", command );
+        return false;
+    }
+
+    char * end;
+    double value = strtod( argument, &end );
+    if( end == argument ) {
+        fprintf( stderr, "Bad seek target: %s\n", argument );
+        return false;
+    }
+
+    if( *end == '%' ) {
+        if( control->duration <= 0 ) return false;
+        *target = control->start + control->duration * value / 100.0;
+    } else if( argument[0] == '+' || argument[0] == '-' ) {
+        *target = position + value;
+    } else {
+        *target = control->start + value;
+    }
+    *target = seek_control_clamp( control, *target );
+    return true;
+}
+
+// NOTE: Reads whatever the FIFO has without blocking. Returns true with the
+// target of the last complete seek command
+bool
+seek_control_poll( SeekControl * control, double position, double * target ) {
+    if( control->fifo < 0 ) return false;
+
+    bool found = false;
+    char buffer[SEEK_CONTROL_LINE];
+    ssize_t count;
+    while( ( count = read( control->fifo, buffer, sizeof( buffer ) ) ) > 0 ) {
+        for( ssize_t i = 0; i < count; ++i ) {
+            if( buffer[i] != '\n' ) {
+                if( control->line_length < SEEK_CONTROL_LINE - 1 ) {
+                    control->line[control->line_length++] = buffer[i];
+                }
+                continue;
+            }
+
+            control->line[control->line_length] = '\0';
+            control->line_length = 0;
+            if( control->line[0] && seek_control_parse( control, control->line, position, target ) ) {
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+// NOTE: True with the speed of the last speed command since the last call
+bool
+seek_control_take_speed( SeekControl * control, double * speed ) {
+    if( control->speed <= 0 ) return false;
+
+    *speed = control->speed;
+    control->speed = 0;
+    return true;
+}
+
+// NOTE: Returns the serial to hand to pipeline_request_seek
+int
+seek_control_begin( SeekControl * control, double target ) {
+    control->pending = true;
+    control->first_frame_due = false;
+    control->target = target;
+    control->request_ns = get_nanoseconds();
+    ++control->requests;
+    return ++control->serial;
+}
+
+// NOTE: Call for every marker frame popped while a seek is pending. Returns
+// true once the marker of the latest request has come through
+bool
+seek_control_marker( SeekControl * control, int serial ) {
+    if( !control->pending || serial != control->serial ) return false;
+
+    control->pending = false;
+    control->first_frame_due = true;
+    return true;
+}
+
+// NOTE: Call after a frame is on screen
+void
+seek_control_frame_shown( SeekControl * control, double pts ) {
+    if( !control->first_frame_due ) return;
+
+    control->first_frame_due = false;
+    uint64_t latency = get_nanoseconds() - control->request_ns;
+    latency_stats_add( &control->latency, latency );
+    fprintf( stdout, "Seek to %.3f s: first frame at %.3f s after %.1f ms\n",
+             control->target, pts, latency / 1000000.0 );
+}
@@ -0,0 +1,99 @@
+// NOTE: Single-producer/single-consumer lock-free ring of pointers. Head is
+// only written by the consumer and tail only by the producer, each on its
+// own cache line so the two threads don't false-share. Every side keeps a
+// cached copy of the other side's index and only reloads it (an acquire
+// load that may miss in cache) when the ring looks full or empty.
+// Indices grow monotonically and the slot array is a power of two, so the
+// slot is index & mask while the capacity limit stays exact.
+
+#include <stdatomic.h>
+
+#define CACHE_LINE_SIZE 64
+
+typedef struct {
+    _Alignas( CACHE_LINE_SIZE ) atomic_size_t head;
+    size_t                                    cached_tail;
+
+    _Alignas( CACHE_LINE_SIZE ) atomic_size_t tail;
+    size_t                                    cached_head;
+
+    _Alignas( CACHE_LINE_SIZE ) void * *      slots;
+    size_t                                    mask;
+    size_t                                    capacity;
+} SpscRing;
+
+bool
+spsc_ring_init( SpscRing * ring, size_t capacity ) {
+    size_t slot_count = 1;
+    while( slot_count < capacity ) slot_count <<= 1;
+
+    ring->slots = ( void * * )calloc( slot_count, sizeof( void * ) );
+    if( !ring->slots ) return false;
+
+    ring->mask = slot_count - 1;
+    ring->capacity = capacity;
+    ring->cached_tail = 0;
+    ring->cached_head = 0;
+    atomic_init( &ring->head, 0 );
+    atomic_init( &ring->tail, 0 );
+    return true;
+}
+
+void
+spsc_ring_destroy( SpscRing * ring ) {
+    free( ring->slots );
+    ring->slots = NULL;
+}
+
+// NOTE: Producer only. Returns false when the ring is full
+bool
+spsc_ring_push( SpscRing * ring, void * item ) {
+    size_t tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+    if( tail - ring->cached_head == ring->capacity ) {
+        ring->cached_head = atomic_load_explicit( &ring->head, memory_order_acquire );
+        if( tail - ring->cached_head == ring->capacity ) return false;
+    }
+
+    ring->slots[tail & ring->mask] = item;
+    atomic_store_explicit( &ring->tail, tail + 1, memory_order_release );
+    return true;
+}
+
+// NOTE: Consumer only. Returns the oldest item without removing it or
+// NULL when the ring is empty. The item stays owned by the ring until
+// spsc_ring_pop, but the producer never touches it again after pushing,
+// so the consumer may read it freely
+void *
+spsc_ring_peek( SpscRing * ring ) {
+    size_t head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+    if( head == ring->cached_tail ) {
+        ring->cached_tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+        if( head == ring->cached_tail ) return NULL;
+    }
+
+    return ring->slots[head & ring->mask];
+}
+
+// NOTE: Consumer only. Like spsc_ring_peek but looks at the item index
+// places behind the oldest one
+void *
+spsc_ring_peek_at( SpscRing * ring, size_t index ) {
+    size_t head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+    if( ring->cached_tail - head <= index ) {
+        ring->cached_tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+        if( ring->cached_tail - head <= index ) return NULL;
+    }
+
+    return ring->slots[( head + index ) & ring->mask];
+}
+
+// NOTE: Consumer only. Returns NULL when the ring is empty
+void *
+spsc_ring_pop( SpscRing * ring ) {
+    void * item = spsc_ring_peek( ring );
+    if( item ) {
+        size_t head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+        atomic_store_explicit( &ring->head, head + 1, memory_order_release );
+    }
+    return item;
+}
@@ -0,0 +1,220 @@
+// NOTE: Micro-benchmark for the frame hand-off ring. A producer and a
+// consumer thread hammer the ring concurrently and we measure the cost of
+// each successful push/pop call and the transit latency from push to pop.
+// The same traffic is then run through a mutex+condvar queue for
+// comparison.
+//
+// Usage: ./spsc_ring_bench [items] [capacity]
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#include "spsc_ring.c"
+
+typedef struct {
+    uint64_t pushed_ns;
+} BenchItem;
+
+typedef struct {
+    BenchItem       * items;
+    uint64_t        * push_ns;
+    uint64_t        * pop_ns;
+    uint64_t        * transit_ns;
+    int               item_count;
+    SpscRing          ring;
+
+    // NOTE: Mutex+condvar baseline
+    void * *          queue;
+    int               queue_capacity;
+    int               queue_read;
+    int               queue_count;
+    pthread_mutex_t   mutex;
+    pthread_cond_t    cond;
+} Bench;
+
+static uint64_t
+now_ns( void ) {
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return ( uint64_t )t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static int
+compare_u64( const void * a, const void * b ) {
+    uint64_t x = *( const uint64_t * )a;
+    uint64_t y = *( const uint64_t * )b;
+    return ( x > y ) - ( x < y );
+}
+
+static void
+print_stats( const char * name, uint64_t * samples, int count ) {
+    qsort( samples, count, sizeof( uint64_t ), compare_u64 );
+    double sum = 0;
+    for( int i = 0; i < count; ++i ) sum += samples[i];
+    fprintf( stdout, "  %-10s mean %8.1f ns  p50 %6llu ns  p99 %8llu ns  max %10llu ns\n",
+             name, sum / count,
+             ( unsigned long long )samples[count / 2],
+             ( unsigned long long )samples[( int )( count * 0.99 )],
+             ( unsigned long long )samples[count - 1] );
+}
+
+// NOTE: Spin briefly, then yield and finally sleep so the other side gets
+// to run even when both threads share a single core
+static void
+backoff( int * spins ) {
+    ++*spins;
+    if( *spins < 64 ) return;
+    if( *spins < 128 ) {
+        sched_yield();
+        return;
+    }
+    struct timespec pause = { 0, 1000 };
+    nanosleep( &pause, NULL );
+}
+
+static void *
+ring_producer( void * arg ) {
+    Bench * bench = ( Bench * )arg;
+    for( int i = 0; i < bench->item_count; ++i ) {
+        BenchItem * item = &bench->items[i];
+        uint64_t start;
+        bool pushed;
+        int spins = 0;
+        do {
+            start = now_ns();
+            item->pushed_ns = start;
+            pushed = spsc_ring_push( &bench->ring, item );
+            if( !pushed ) backoff( &spins );
+        } while( !pushed );
+        bench->push_ns[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static void *
+ring_consumer( void * arg ) {
+    Bench * bench = ( Bench * )arg;
+    int spins = 0;
+    for( int i = 0; i < bench->item_count; ) {
+        uint64_t start = now_ns();
+        BenchItem * item = ( BenchItem * )spsc_ring_pop( &bench->ring );
+        if( !item ) {
+            backoff( &spins );
+            continue;
+        }
+        spins = 0;
+        uint64_t end = now_ns();
+        bench->pop_ns[i] = end - start;
+        bench->transit_ns[i] = end - item->pushed_ns;
+        ++i;
+    }
+    return NULL;
+}
+
+static void *
+queue_producer( void * arg ) {
+    Bench * bench = ( Bench * )arg;
+    for( int i = 0; i < bench->item_count; ++i ) {
+        BenchItem * item = &bench->items[i];
+        uint64_t start = now_ns();
+        item->pushed_ns = start;
+        pthread_mutex_lock( &bench->mutex );
+        while( bench->queue_count == bench->queue_capacity ) {
+            pthread_cond_wait( &bench->cond, &bench->mutex );
+        }
+        int write_index = ( bench->queue_read + bench->queue_count ) % bench->queue_capacity;
+        bench->queue[write_index] = item;
+        ++bench->queue_count;
+        pthread_cond_broadcast( &bench->cond );
+        pthread_mutex_unlock( &bench->mutex );
+        bench->push_ns[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static void *
+queue_consumer( void * arg ) {
+    Bench * bench = ( Bench * )arg;
+    for( int i = 0; i < bench->item_count; ++i ) {
+        uint64_t start = now_ns();
+        pthread_mutex_lock( &bench->mutex );
+        while( bench->queue_count == 0 ) {
+            pthread_cond_wait( &bench->cond, &bench->mutex );
+        }
+        BenchItem * item = ( BenchItem * )bench->queue[bench->queue_read];
+        bench->queue_read = ( bench->queue_read + 1 ) % bench->queue_capacity;
+        --bench->queue_count;
+        pthread_cond_broadcast( &bench->cond );
+        pthread_mutex_unlock( &bench->mutex );
+        uint64_t end = now_ns();
+        bench->pop_ns[i] = end - start;
+        bench->transit_ns[i] = end - item->pushed_ns;
+    }
+    return NULL;
+}
+
+static void
+run( Bench * bench, const char * name,
+     void * ( * producer )( void * ), void * ( * consumer )( void * ) ) {
+    pthread_t producer_thread, consumer_thread;
+    uint64_t start = now_ns();
+    pthread_create( &consumer_thread, NULL, consumer, bench );
+    pthread_create( &producer_thread, NULL, producer, bench );
+    pthread_join( producer_thread, NULL );
+    pthread_join( consumer_thread, NULL );
+    double seconds = ( now_ns() - start ) / 1000000000.0;
+
+    fprintf( stdout, "%s: %d items in %.3f s (%.2f M items/s)\n",
+             name, bench->item_count, seconds, bench->item_count / seconds / 1000000.0 );
+    print_stats( "push", bench->push_ns, bench->item_count );
+    print_stats( "pop", bench->pop_ns, bench->item_count );
+    print_stats( "transit", bench->transit_ns, bench->item_count );
+}
+
+int
+main( int argc, char const * argv[] ) {
+    Bench bench;
+    memset( &bench, 0, sizeof( bench ) );
+    bench.item_count = argc > 1 ? atoi( argv[1] ) : 1000000;
+    int capacity = argc > 2 ? atoi( argv[2] ) : 8;
+
+    if( bench.item_count <= 0 || capacity <= 0 ) {
+        fprintf( stdout, "Usage: ./spsc_ring_bench [items] [capacity]\n" );
+        return 0;
+    }
+
+    bench.items = ( BenchItem * )calloc( bench.item_count, sizeof( BenchItem ) );
+    bench.push_ns = ( uint64_t * )calloc( bench.item_count, sizeof( uint64_t ) );
+    bench.pop_ns = ( uint64_t * )calloc( bench.item_count, sizeof( uint64_t ) );
+    bench.transit_ns = ( uint64_t * )calloc( bench.item_count, sizeof( uint64_t ) );
+    bench.queue = ( void * * )calloc( capacity, sizeof( void * ) );
+    bench.queue_capacity = capacity;
+    pthread_mutex_init( &bench.mutex, NULL );
+    pthread_cond_init( &bench.cond, NULL );
+
+    if( !bench.items || !bench.push_ns || !bench.pop_ns || !bench.transit_ns ||
+        !bench.queue || !spsc_ring_init( &bench.ring, capacity ) ) {
+        fprintf( stderr, "Out of memory\n" );
+        return 1;
+    }
+
+    fprintf( stdout, "capacity %d\n", capacity );
+    run( &bench, "spsc ring", ring_producer, ring_consumer );
+    run( &bench, "mutex queue", queue_producer, queue_consumer );
+
+    spsc_ring_destroy( &bench.ring );
+    pthread_mutex_destroy( &bench.mutex );
+    pthread_cond_destroy( &bench.cond );
+    free( bench.queue );
+    free( bench.transit_ns );
+    free( bench.pop_ns );
+    free( bench.push_ns );
+    free( bench.items );
+    return 0;
+}
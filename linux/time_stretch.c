@@ -0,0 +1,239 @@
+// NOTE: WSOLA (waveform similarity overlap-add) time stretching. Changes
+// the speed of interleaved 16-bit PCM without changing its pitch, so
+// speech stays intelligible when we play faster or slower.
+//
+// Output is made one hop at a time as the overlap-add of Hann windows two
+// hops long, which sum to one. Between hops the input moves on by hop *
+// speed frames. Every window is then shifted by up to search frames to
+// where it best matches the input that naturally follows the previous
+// window, so the two add up in phase instead of beating. At speed 1 the
+// windows follow on exactly and the output is the input.
+//
+// Input positions are media sample positions, so the caller knows which
+// input frame each hop starts at and can keep the audio clock right.
+
+#define TIME_STRETCH_MIN_SPEED 0.25
+#define TIME_STRETCH_MAX_SPEED 4.0
+
+typedef struct {
+    int       channels;
+    int       hop;
+    int       window;
+    int       search;
+    float   * weights;
+
+    // NOTE: Input not consumed yet, with a mono mixdown for the search
+    int16_t * input;
+    float   * mono;
+    int       capacity;
+    int       count;
+    // NOTE: Media position of input[0], set by the first append
+    bool      started;
+    int64_t   input_frame;
+
+    // NOTE: Relative to input[0]. position is where the next window starts
+    // before searching, previous is where the last one started
+    double    position;
+    bool      has_previous;
+    int       previous;
+
+    // NOTE: Second half of the last window, added to the next hop
+    float   * overlap;
+    bool      has_overlap;
+} TimeStretch;
+
+// NOTE: Makes hop frames per call and shifts windows by up to search frames
+bool
+time_stretch_init( TimeStretch * stretch, int channels, int hop, int search ) {
+    memset( stretch, 0, sizeof( *stretch ) );
+    stretch->channels = channels;
+    stretch->hop = hop;
+    stretch->window = 2 * hop;
+    stretch->search = search;
+    // NOTE: Enough for a search around a window that moved on by a hop at
+    // the highest speed, see time_stretch_wanted
+    stretch->capacity = stretch->window + 2 * search + ( int )ceil( hop * TIME_STRETCH_MAX_SPEED ) + hop;
+
+    stretch->weights = ( float * )malloc( stretch->window * sizeof( float ) );
+    stretch->input = ( int16_t * )malloc( ( size_t )stretch->capacity * channels * sizeof( int16_t ) );
+    stretch->mono = ( float * )malloc( stretch->capacity * sizeof( float ) );
+    stretch->overlap = ( float * )calloc( ( size_t )hop * channels, sizeof( float ) );
+    if( !stretch->weights || !stretch->input || !stretch->mono || !stretch->overlap ) return false;
+
+    for( int k = 0; k < stretch->window; ++k ) {
+        stretch->weights[k] = ( float )( 0.5 - 0.5 * cos( 2.0 * M_PI * k / stretch->window ) );
+    }
+    return true;
+}
+
+void
+time_stretch_destroy( TimeStretch * stretch ) {
+    free( stretch->weights );
+    free( stretch->input );
+    free( stretch->mono );
+    free( stretch->overlap );
+    memset( stretch, 0, sizeof( *stretch ) );
+}
+
+// NOTE: Drops the input and the pending overlap, after a seek
+void
+time_stretch_reset( TimeStretch * stretch ) {
+    stretch->count = 0;
+    stretch->started = false;
+    stretch->position = 0;
+    stretch->has_previous = false;
+    stretch->has_overlap = false;
+}
+
+// NOTE: Input frames still missing for the next hop. Never more than fits
+// behind time_stretch_tail
+int
+time_stretch_wanted( TimeStretch * stretch ) {
+    int needed = ( int )lround( stretch->position ) + stretch->search + stretch->window;
+    return needed > stretch->count ? needed - stretch->count : 0;
+}
+
+// NOTE: Where the caller writes up to time_stretch_wanted frames of input
+int16_t *
+time_stretch_tail( TimeStretch * stretch ) {
+    return stretch->input + ( size_t )stretch->count * stretch->channels;
+}
+
+// NOTE: Takes frames written at the tail, the first of them at media
+// position first_frame. Input that doesn't follow on from what is there
+// starts over; the pending overlap then crossfades into it
+void
+time_stretch_append( TimeStretch * stretch, int frames, int64_t first_frame ) {
+    if( frames <= 0 ) return;
+
+    int channels = stretch->channels;
+    if( stretch->started && first_frame != stretch->input_frame + stretch->count ) {
+        memmove( stretch->input, time_stretch_tail( stretch ),
+                 ( size_t )frames * channels * sizeof( int16_t ) );
+        stretch->count = 0;
+        stretch->started = false;
+        stretch->position = 0;
+        stretch->has_previous = false;
+    }
+    if( !stretch->started ) {
+        stretch->input_frame = first_frame;
+        stretch->started = true;
+    }
+
+    const int16_t * samples = time_stretch_tail( stretch );
+    for( int i = 0; i < frames; ++i ) {
+        float sum = 0;
+        for( int c = 0; c < channels; ++c ) sum += samples[i * channels + c];
+        stretch->mono[stretch->count + i] = sum;
+    }
+    stretch->count += frames;
+}
+
+// NOTE: The window start within search of start whose first hop is most
+// like the hop after the previous window, by normalized cross-correlation
+static int
+time_stretch_best_start( TimeStretch * stretch, int start ) {
+    int hop = stretch->hop;
+    const float * target = stretch->mono + stretch->previous + hop;
+    int first = start - stretch->search < 0 ? 0 : start - stretch->search;
+    int last = start + stretch->search;
+
+    double energy = 0;
+    for( int k = 0; k < hop; ++k ) energy += ( double )stretch->mono[first + k] * stretch->mono[first + k];
+
+    int best = start;
+    double best_score = 0;
+    bool found = false;
+    for( int candidate = first; candidate <= last; ++candidate ) {
+        const float * x = stretch->mono + candidate;
+        float dot = 0;
+        for( int k = 0; k < hop; ++k ) dot += x[k] * target[k];
+
+        double score = energy > 0 ? dot / sqrt( energy ) : 0;
+        if( !found || score > best_score ) {
+            best = candidate;
+            best_score = score;
+            found = true;
+        }
+        energy += ( double )x[hop] * x[hop] - ( double )x[0] * x[0];
+    }
+    return best;
+}
+
+static int16_t
+time_stretch_clip( float value ) {
+    long sample = lrintf( value );
+    return ( int16_t )( sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample );
+}
+
+// NOTE: Makes hop frames of output at speed. Returns false, and leaves
+// everything as it was, if there isn't enough input yet. media_frame is
+// the input position the hop starts at, without the search shift, so
+// consecutive hops are exactly hop * speed apart
+bool
+time_stretch_process( TimeStretch * stretch, double speed, int16_t * output, int64_t * media_frame ) {
+    if( time_stretch_wanted( stretch ) > 0 ) return false;
+
+    int hop = stretch->hop;
+    int channels = stretch->channels;
+    int nominal = ( int )lround( stretch->position );
+    int start = nominal;
+    if( stretch->has_previous ) {
+        // NOTE: At speed 1 we join the previous window again after a
+        // stretch, from then on the output is the input
+        int natural = stretch->previous + hop;
+        if( speed == 1.0 && abs( natural - nominal ) <= stretch->search ) {
+            start = nominal = natural;
+            stretch->position = natural;
+        } else if( speed != 1.0 ) {
+            start = time_stretch_best_start( stretch, nominal );
+        }
+    }
+
+    const int16_t * in = stretch->input + ( size_t )start * channels;
+    const float * weights = stretch->weights;
+    float * overlap = stretch->overlap;
+    for( int k = 0; k < hop; ++k ) {
+        for( int c = 0; c < channels; ++c ) {
+            int i = k * channels + c;
+            float value = weights[k] * in[i];
+            if( stretch->has_overlap ) value += overlap[i];
+            output[i] = time_stretch_clip( value );
+            overlap[i] = weights[hop + k] * in[hop * channels + i];
+        }
+    }
+    stretch->has_overlap = true;
+    *media_frame = stretch->input_frame + nominal;
+
+    stretch->has_previous = true;
+    stretch->previous = start;
+    stretch->position += hop * speed;
+
+    // NOTE: Keep what the next search and the natural continuation need
+    int keep = stretch->previous + hop;
+    int search_from = ( int )lround( stretch->position ) - stretch->search;
+    if( search_from < keep ) keep = search_from;
+    if( keep > 0 ) {
+        stretch->count -= keep;
+        memmove( stretch->input, stretch->input + ( size_t )keep * channels,
+                 ( size_t )stretch->count * channels * sizeof( int16_t ) );
+        memmove( stretch->mono, stretch->mono + keep, stretch->count * sizeof( float ) );
+        stretch->input_frame += keep;
+        stretch->previous -= keep;
+        stretch->position -= keep;
+    }
+    return true;
+}
+
+// NOTE: For a hop without enough input, an underrun or the end of the
+// stream. Plays out the second half of the last window, which fades to
+// silence, and the next hop fades back in where the input left off
+void
+time_stretch_fade_out( TimeStretch * stretch, int16_t * output ) {
+    int samples = stretch->hop * stretch->channels;
+    for( int i = 0; i < samples; ++i ) {
+        output[i] = stretch->has_overlap ? time_stretch_clip( stretch->overlap[i] ) : 0;
+    }
+    stretch->has_overlap = false;
+    stretch->has_previous = false;
+}
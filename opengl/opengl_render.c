@@ -8,36 +8,490 @@ const char * vs_source =
 "    TexCoord = vec2( aTexCoord.x, aTexCoord.y );\n"
 "}\n";
 
-const char * fs_source =
+// NOTE: Fragment shaders are put together from a common header, a
+// sample_yuv() that knows the plane layout, the HDR tone mapping and the
+// conversion to RGB. Packed RGB formats skip the conversion. Textures are
+// always on units 0-2, whatever the variant calls them
+const char * fs_header =
 "#version 330 core\n"
 "out vec4 FragColor;\n"
 "in vec2 TexCoord;\n"
 "uniform sampler2D textureY;\n"
 "uniform sampler2D textureU;\n"
 "uniform sampler2D textureV;\n"
+"uniform mat3 colorMatrix;\n"
+"uniform vec3 colorOffset;\n";
+
+const char * fs_sample_planar =
+"vec3 sample_yuv() {\n"
+"    return vec3( texture( textureY, TexCoord ).r,\n"
+"                 texture( textureU, TexCoord ).r,\n"
+"                 texture( textureV, TexCoord ).r );\n"
+"}\n";
+
+// NOTE: NV12 keeps U and V interleaved in one RG texture
+const char * fs_sample_semiplanar =
+"vec3 sample_yuv() {\n"
+"    return vec3( texture( textureY, TexCoord ).r,\n"
+"                 texture( textureU, TexCoord ).rg );\n"
+"}\n";
+
+// NOTE: HDR to SDR after the YUV->RGB conversion. transfer is 0 for SDR,
+// 1 for PQ and 2 for HLG. Light is linearized in units of the BT.2408
+// reference white (203 nits), moved into the BT.709 gamut by gamutMatrix
+// and the brightest channel is compressed from sourcePeak down to 1.0 with
+// the chosen curve, so hue is kept. The result is encoded for a gamma 2.4
+// display. HLG is shown the way a 1000 nit display would (system gamma 1.2)
+const char * fs_tone_map =
+"uniform int transfer;\n"
+"uniform int toneMapOperator;\n"
+"uniform float sourcePeak;\n"
+"uniform mat3 gamutMatrix;\n"
+"const float referenceWhite = 203.0;\n"
+"float pq_to_nits( float e ) {\n"
+"    float p = pow( clamp( e, 0.0, 1.0 ), 1.0 / 78.84375 );\n"
+"    return 10000.0 * pow( max( p - 0.8359375, 0.0 ) / ( 18.8515625 - 18.6875 * p ),\n"
+"                          1.0 / 0.1593017578125 );\n"
+"}\n"
+"float nits_to_pq( float nits ) {\n"
+"    float y = pow( clamp( nits / 10000.0, 0.0, 1.0 ), 0.1593017578125 );\n"
+"    return pow( ( 0.8359375 + 18.8515625 * y ) / ( 1.0 + 18.6875 * y ), 78.84375 );\n"
+"}\n"
+"float hlg_to_scene( float e ) {\n"
+"    return e <= 0.5 ? e * e / 3.0 :\n"
+"                      ( exp( ( e - 0.55991073 ) / 0.17883277 ) + 0.28466892 ) / 12.0;\n"
+"}\n"
+"vec3 hdr_to_linear( vec3 e ) {\n"
+"    if( transfer == 1 ) {\n"
+"        return vec3( pq_to_nits( e.r ), pq_to_nits( e.g ), pq_to_nits( e.b ) ) / referenceWhite;\n"
+"    }\n"
+"    vec3 scene = vec3( hlg_to_scene( e.r ), hlg_to_scene( e.g ), hlg_to_scene( e.b ) );\n"
+"    float luminance = dot( scene, vec3( 0.2627, 0.6780, 0.0593 ) );\n"
+"    return 1000.0 * pow( luminance, 0.2 ) * scene / referenceWhite;\n"
+"}\n"
+"float hable( float x ) {\n"
+"    return ( x * ( 0.15 * x + 0.05 ) + 0.004 ) / ( x * ( 0.15 * x + 0.5 ) + 0.06 ) - 0.02 / 0.3;\n"
+"}\n"
+"float bt2390( float x ) {\n"
+"    float source = nits_to_pq( sourcePeak * referenceWhite );\n"
+"    float e = min( nits_to_pq( x * referenceWhite ) / source, 1.0 );\n"
+"    float target = nits_to_pq( referenceWhite ) / source;\n"
+"    float knee = 1.5 * target - 0.5;\n"
+"    if( e > knee ) {\n"
+"        float t = ( e - knee ) / ( 1.0 - knee );\n"
+"        float t2 = t * t;\n"
+"        float t3 = t2 * t;\n"
+"        e = ( 2.0 * t3 - 3.0 * t2 + 1.0 ) * knee + ( t3 - 2.0 * t2 + t ) * ( 1.0 - knee ) +\n"
+"            ( -2.0 * t3 + 3.0 * t2 ) * target;\n"
+"    }\n"
+"    return pq_to_nits( e * source ) / referenceWhite;\n"
+"}\n"
+"float tone_curve( float x ) {\n"
+"    if( toneMapOperator == 1 ) return bt2390( x );\n"
+"    if( toneMapOperator == 2 ) return hable( x ) / hable( sourcePeak );\n"
+"    return x;\n"
+"}\n"
+"vec3 tone_map( vec3 rgb ) {\n"
+"    vec3 linear = max( gamutMatrix * hdr_to_linear( clamp( rgb, 0.0, 1.0 ) ), 0.0 );\n"
+"    float peak = max( max( linear.r, linear.g ), linear.b );\n"
+"    if( peak > 0.0 ) linear *= tone_curve( peak ) / peak;\n"
+"    return pow( min( linear, 1.0 ), vec3( 1.0 / 2.4 ) );\n"
+"}\n";
+
+// NOTE: colorMatrix and colorOffset fold together the sample scale, the
+// range expansion and the YUV->RGB matrix, see opengl_update_color_matrix
+const char * fs_yuv_main =
 "void main() {\n"
-"    vec3 yuv, rgb;\n"
-"    vec3 yuv2r = vec3( 1.164, 0.0, 1.596 );\n"
-"    vec3 yuv2g = vec3( 1.164, -0.391, -0.813 );\n"
-"    vec3 yuv2b = vec3( 1.164, 2.018, 0.0 );\n"
-"    yuv.x = texture( textureY, TexCoord).r - 0.0625;\n"
-"    yuv.y = texture( textureU, TexCoord).r - 0.5;\n"
-"    yuv.z = texture( textureV, TexCoord).r - 0.5;\n"
-"    rgb.x = dot( yuv, yuv2r );\n"
-"    rgb.y = dot( yuv, yuv2g );\n"
-"    rgb.z = dot( yuv, yuv2b );\n"
+"    vec3 rgb = colorMatrix * sample_yuv() + colorOffset;\n"
+"    if( transfer != 0 ) rgb = tone_map( rgb );\n"
 "    FragColor = vec4( rgb, 1.0 );\n"
 "}\n";
 
+const char * fs_rgb_main =
+"void main() {\n"
+"    FragColor = vec4( texture( textureY, TexCoord ).rgb, 1.0 );\n"
+"}\n";
+
+typedef enum {
+    OPENGL_SHADER_PLANAR,
+    OPENGL_SHADER_SEMIPLANAR,
+    OPENGL_SHADER_RGB,
+    OPENGL_SHADER_COUNT
+} OpenGLShader;
+
+// NOTE: How a pixel format maps onto plane textures. Chroma planes are
+// the luma size shifted right by the chroma shifts, rounded up.
+// High bit depth planes go into 16-bit normalized textures and samples
+// are multiplied by scale, e.g. 10 bits in the low end of a 16-bit word
+// read as x / 65535 and need 65535 / 1023 to span 0-1 again. depth is
+// the bits per sample, full_range marks the JPEG (yuvj) formats
+typedef struct {
+    int          format;
+    OpenGLShader shader;
+    int          plane_count;
+    int          chroma_shift_x;
+    int          chroma_shift_y;
+    GLenum       internal_formats[3];
+    GLenum       pixel_formats[3];
+    int          bytes_per_pixel[3];
+    GLenum       type;
+    int          depth;
+    float        scale;
+    bool         full_range;
+} OpenGLFormat;
+
+static const OpenGLFormat opengl_formats[] = {
+    { AV_PIX_FMT_YUV420P, OPENGL_SHADER_PLANAR, 3, 1, 1,
+      { GL_R8, GL_R8, GL_R8 }, { GL_RED, GL_RED, GL_RED }, { 1, 1, 1 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_YUV422P, OPENGL_SHADER_PLANAR, 3, 1, 0,
+      { GL_R8, GL_R8, GL_R8 }, { GL_RED, GL_RED, GL_RED }, { 1, 1, 1 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_YUV444P, OPENGL_SHADER_PLANAR, 3, 0, 0,
+      { GL_R8, GL_R8, GL_R8 }, { GL_RED, GL_RED, GL_RED }, { 1, 1, 1 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_YUVJ420P, OPENGL_SHADER_PLANAR, 3, 1, 1,
+      { GL_R8, GL_R8, GL_R8 }, { GL_RED, GL_RED, GL_RED }, { 1, 1, 1 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, true },
+    { AV_PIX_FMT_YUVJ422P, OPENGL_SHADER_PLANAR, 3, 1, 0,
+      { GL_R8, GL_R8, GL_R8 }, { GL_RED, GL_RED, GL_RED }, { 1, 1, 1 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, true },
+    { AV_PIX_FMT_YUVJ444P, OPENGL_SHADER_PLANAR, 3, 0, 0,
+      { GL_R8, GL_R8, GL_R8 }, { GL_RED, GL_RED, GL_RED }, { 1, 1, 1 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, true },
+    { AV_PIX_FMT_NV12, OPENGL_SHADER_SEMIPLANAR, 2, 1, 1,
+      { GL_R8, GL_RG8 }, { GL_RED, GL_RG }, { 1, 2 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_RGB24, OPENGL_SHADER_RGB, 1, 0, 0,
+      { GL_RGB8 }, { GL_RGB }, { 3 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_BGR24, OPENGL_SHADER_RGB, 1, 0, 0,
+      { GL_RGB8 }, { GL_BGR }, { 3 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_RGBA, OPENGL_SHADER_RGB, 1, 0, 0,
+      { GL_RGBA8 }, { GL_RGBA }, { 4 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_BGRA, OPENGL_SHADER_RGB, 1, 0, 0,
+      { GL_RGBA8 }, { GL_BGRA }, { 4 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_RGB0, OPENGL_SHADER_RGB, 1, 0, 0,
+      { GL_RGBA8 }, { GL_RGBA }, { 4 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_BGR0, OPENGL_SHADER_RGB, 1, 0, 0,
+      { GL_RGBA8 }, { GL_BGRA }, { 4 },
+      GL_UNSIGNED_BYTE, 8, 1.0f, false },
+    { AV_PIX_FMT_YUV420P10LE, OPENGL_SHADER_PLANAR, 3, 1, 1,
+      { GL_R16, GL_R16, GL_R16 }, { GL_RED, GL_RED, GL_RED }, { 2, 2, 2 },
+      GL_UNSIGNED_SHORT, 10, 65535.0f / 1023.0f, false },
+    { AV_PIX_FMT_YUV422P10LE, OPENGL_SHADER_PLANAR, 3, 1, 0,
+      { GL_R16, GL_R16, GL_R16 }, { GL_RED, GL_RED, GL_RED }, { 2, 2, 2 },
+      GL_UNSIGNED_SHORT, 10, 65535.0f / 1023.0f, false },
+    { AV_PIX_FMT_YUV444P10LE, OPENGL_SHADER_PLANAR, 3, 0, 0,
+      { GL_R16, GL_R16, GL_R16 }, { GL_RED, GL_RED, GL_RED }, { 2, 2, 2 },
+      GL_UNSIGNED_SHORT, 10, 65535.0f / 1023.0f, false },
+    { AV_PIX_FMT_YUV420P12LE, OPENGL_SHADER_PLANAR, 3, 1, 1,
+      { GL_R16, GL_R16, GL_R16 }, { GL_RED, GL_RED, GL_RED }, { 2, 2, 2 },
+      GL_UNSIGNED_SHORT, 12, 65535.0f / 4095.0f, false },
+    // NOTE: P010 keeps its 10 bits in the high end of each word
+    { AV_PIX_FMT_P010LE, OPENGL_SHADER_SEMIPLANAR, 2, 1, 1,
+      { GL_R16, GL_RG16 }, { GL_RED, GL_RG }, { 2, 4 },
+      GL_UNSIGNED_SHORT, 10, 65535.0f / 65472.0f, false },
+    { AV_PIX_FMT_P016LE, OPENGL_SHADER_SEMIPLANAR, 2, 1, 1,
+      { GL_R16, GL_RG16 }, { GL_RED, GL_RG }, { 2, 4 },
+      GL_UNSIGNED_SHORT, 16, 1.0f, false },
+};
+
+// NOTE: Linked once per variant by opengl_make_program
+static GLuint opengl_programs[OPENGL_SHADER_COUNT];
+
+// NOTE: What each program's color uniforms were last set up for, so they
+// are only recomputed when the stream's color description changes.
+// source_peak is in units of reference white
+typedef struct {
+    int   format;
+    int   colorspace;
+    int   range;
+    int   transfer;
+    int   primaries;
+    float source_peak;
+} OpenGLColorKey;
+
+static OpenGLColorKey opengl_program_colors[OPENGL_SHADER_COUNT];
+
+// NOTE: The order matches toneMapOperator in the shader. Off shows HDR
+// frames without conversion, like before tone mapping existed
+typedef enum {
+    OPENGL_TONE_MAP_OFF,
+    OPENGL_TONE_MAP_BT2390,
+    OPENGL_TONE_MAP_HABLE,
+    OPENGL_TONE_MAP_CLIP,
+    OPENGL_TONE_MAP_COUNT
+} OpenGLToneMap;
+
+const char * opengl_tone_map_names[] = { "off", "bt2390", "hable", "clip" };
+
+static OpenGLToneMap opengl_tone_map = OPENGL_TONE_MAP_BT2390;
+
+#define OPENGL_TRANSFER_SDR 0
+#define OPENGL_TRANSFER_PQ  1
+#define OPENGL_TRANSFER_HLG 2
+
+#define OPENGL_REFERENCE_WHITE_NITS 203.0
+#define OPENGL_DEFAULT_PEAK_NITS    1000.0
+
+const OpenGLFormat *
+opengl_find_format( int format ) {
+    for( size_t i = 0; i < sizeof( opengl_formats ) / sizeof( opengl_formats[0] ); ++i ) {
+        if( opengl_formats[i].format == format ) return &opengl_formats[i];
+    }
+    return NULL;
+}
+
+// NOTE: Pixel formats the fragment shaders sample directly. Anything else
+// has to be converted with swscale before upload
+bool
+opengl_can_render_format( int format ) {
+    return opengl_find_format( format ) != NULL;
+}
+
+static void
+opengl_plane_sizes( const OpenGLFormat * format, int width, int height,
+                    int * widths, int * heights ) {
+    widths[0] = width;
+    heights[0] = height;
+    for( int i = 1; i < format->plane_count; ++i ) {
+        widths[i] = ( width + ( 1 << format->chroma_shift_x ) - 1 ) >> format->chroma_shift_x;
+        heights[i] = ( height + ( 1 << format->chroma_shift_y ) - 1 ) >> format->chroma_shift_y;
+    }
+}
+
+// NOTE: Streams often leave the matrix unspecified. The primaries are the
+// next best hint, then the resolution like most players do
+static int
+opengl_resolve_colorspace( const AVFrame * Frame ) {
+    switch( Frame->colorspace ) {
+        case AVCOL_SPC_BT709:
+        case AVCOL_SPC_BT470BG:
+        case AVCOL_SPC_SMPTE170M:
+        case AVCOL_SPC_SMPTE240M:
+        case AVCOL_SPC_FCC:
+        case AVCOL_SPC_BT2020_NCL:
+        case AVCOL_SPC_BT2020_CL:
+            return Frame->colorspace;
+        default:
+            break;
+    }
+
+    if( Frame->color_primaries == AVCOL_PRI_BT2020 ) return AVCOL_SPC_BT2020_NCL;
+    if( Frame->color_primaries == AVCOL_PRI_BT709 ) return AVCOL_SPC_BT709;
+    if( Frame->color_primaries == AVCOL_PRI_BT470BG ||
+        Frame->color_primaries == AVCOL_PRI_SMPTE170M ) return AVCOL_SPC_BT470BG;
+    return Frame->height >= 720 ? AVCOL_SPC_BT709 : AVCOL_SPC_BT470BG;
+}
+
+// NOTE: Builds the uniforms for rgb = matrix * sample + offset, where sample
+// is what the textures return. Three steps are folded together: the format's
+// sample scale to integer codes, removing the range offsets (16-235/240
+// scaled to the bit depth for limited range), and the YUV->RGB matrix from
+// the colorspace's Kr and Kb. BT.2020 constant luminance has no linear
+// matrix, so it uses the non-constant one
+static void
+opengl_update_color_matrix( GLuint program, const OpenGLFormat * format,
+                            int colorspace, int range ) {
+    double kr = 0.299, kb = 0.114;
+    switch( colorspace ) {
+        case AVCOL_SPC_BT709:      kr = 0.2126; kb = 0.0722; break;
+        case AVCOL_SPC_SMPTE240M:  kr = 0.212;  kb = 0.087;  break;
+        case AVCOL_SPC_FCC:        kr = 0.30;   kb = 0.11;   break;
+        case AVCOL_SPC_BT2020_NCL:
+        case AVCOL_SPC_BT2020_CL:  kr = 0.2627; kb = 0.0593; break;
+        default: break;
+    }
+    double kg = 1.0 - kr - kb;
+
+    double max_code = ( double )( ( 1 << format->depth ) - 1 );
+    double step = ( double )( 1 << ( format->depth - 8 ) );
+    double luma_black, luma_range, chroma_range;
+    double chroma_mid = 128.0 * step;
+    if( range == AVCOL_RANGE_JPEG ) {
+        luma_black = 0.0;
+        luma_range = max_code;
+        chroma_range = max_code;
+    } else {
+        luma_black = 16.0 * step;
+        luma_range = 219.0 * step;
+        chroma_range = 224.0 * step;
+    }
+
+    // NOTE: Normalized Y' and Cb/Cr from a texture sample s
+    double code = format->scale * max_code;
+    double scales[3] = { code / luma_range, code / chroma_range, code / chroma_range };
+    double offsets[3] = { luma_black / luma_range, chroma_mid / chroma_range,
+                          chroma_mid / chroma_range };
+
+    double yuv_to_rgb[3][3] = {
+        { 1.0, 0.0,                              2.0 * ( 1.0 - kr ) },
+        { 1.0, -2.0 * kb * ( 1.0 - kb ) / kg,    -2.0 * kr * ( 1.0 - kr ) / kg },
+        { 1.0, 2.0 * ( 1.0 - kb ),               0.0 },
+    };
+
+    // NOTE: GL matrices are column major
+    float matrix[9];
+    float offset[3];
+    for( int row = 0; row < 3; ++row ) {
+        double sum = 0.0;
+        for( int column = 0; column < 3; ++column ) {
+            matrix[column * 3 + row] = ( float )( yuv_to_rgb[row][column] * scales[column] );
+            sum += yuv_to_rgb[row][column] * offsets[column];
+        }
+        offset[row] = ( float )-sum;
+    }
+
+    glUniformMatrix3fv( glGetUniformLocation( program, "colorMatrix" ), 1, GL_FALSE, matrix );
+    glUniform3fv( glGetUniformLocation( program, "colorOffset" ), 1, offset );
+}
+
+// NOTE: Same as av_frame_get_side_data, render_bench doesn't link libavutil
+static const AVFrameSideData *
+opengl_find_side_data( const AVFrame * Frame, enum AVFrameSideDataType type ) {
+    for( int i = 0; i < Frame->nb_side_data; ++i ) {
+        if( Frame->side_data[i]->type == type ) return Frame->side_data[i];
+    }
+    return NULL;
+}
+
+// NOTE: Brightest the content gets in nits, 0 if the frame doesn't say.
+// MaxCLL describes the content itself, the mastering display only bounds it
+static double
+opengl_frame_peak_nits( const AVFrame * Frame ) {
+    const AVFrameSideData * light = opengl_find_side_data( Frame, AV_FRAME_DATA_CONTENT_LIGHT_LEVEL );
+    if( light && ( ( const AVContentLightMetadata * )light->data )->MaxCLL > 0 ) {
+        return ( ( const AVContentLightMetadata * )light->data )->MaxCLL;
+    }
+
+    const AVFrameSideData * mastering = opengl_find_side_data( Frame, AV_FRAME_DATA_MASTERING_DISPLAY_METADATA );
+    if( mastering ) {
+        const AVMasteringDisplayMetadata * metadata = ( const AVMasteringDisplayMetadata * )mastering->data;
+        if( metadata->has_luminance && metadata->max_luminance.den > 0 ) {
+            return ( double )metadata->max_luminance.num / metadata->max_luminance.den;
+        }
+    }
+    return 0.0;
+}
+
+void
+opengl_set_tone_map( OpenGLToneMap tone_map ) {
+    opengl_tone_map = tone_map;
+    for( int i = 0; i < OPENGL_SHADER_COUNT; ++i ) {
+        opengl_program_colors[i].format = -1;
+    }
+}
+
+// NOTE: BT.2020 primaries are mapped into BT.709 in linear light, the rest
+// are assumed to be close enough to BT.709 already
+static void
+opengl_update_tone_map( GLuint program, const OpenGLColorKey * key ) {
+    static const float bt2020_to_bt709[9] = {
+         1.6605f, -0.1246f, -0.0182f,
+        -0.5876f,  1.1329f, -0.1006f,
+        -0.0728f, -0.0083f,  1.1187f,
+    };
+    static const float identity[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+
+    glUniform1i( glGetUniformLocation( program, "transfer" ), key->transfer );
+    glUniform1i( glGetUniformLocation( program, "toneMapOperator" ), opengl_tone_map );
+    glUniform1f( glGetUniformLocation( program, "sourcePeak" ), key->source_peak );
+    glUniformMatrix3fv( glGetUniformLocation( program, "gamutMatrix" ), 1, GL_FALSE,
+                        key->primaries == AVCOL_PRI_BT2020 ? bt2020_to_bt709 : identity );
+}
+
+// NOTE: Call with the frame's program in use
+static void
+opengl_update_colors( const OpenGLFormat * format, const AVFrame * Frame ) {
+    if( format->shader == OPENGL_SHADER_RGB ) return;
+
+    OpenGLColorKey * current = &opengl_program_colors[format->shader];
+    OpenGLColorKey key;
+    key.format = format->format;
+    key.colorspace = opengl_resolve_colorspace( Frame );
+    key.range = format->full_range || Frame->color_range == AVCOL_RANGE_JPEG ?
+                AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+    key.transfer = OPENGL_TRANSFER_SDR;
+    if( opengl_tone_map != OPENGL_TONE_MAP_OFF ) {
+        if( Frame->color_trc == AVCOL_TRC_SMPTE2084 ) key.transfer = OPENGL_TRANSFER_PQ;
+        if( Frame->color_trc == AVCOL_TRC_ARIB_STD_B67 ) key.transfer = OPENGL_TRANSFER_HLG;
+    }
+    // NOTE: HDR streams without primaries are BT.2020 in practice
+    key.primaries = Frame->color_primaries;
+    if( key.transfer != OPENGL_TRANSFER_SDR && key.primaries == AVCOL_PRI_UNSPECIFIED ) {
+        key.primaries = AVCOL_PRI_BT2020;
+    }
+
+    // NOTE: Decoders only attach the metadata to some frames, in between
+    // we keep the peak we had for the same transfer. HLG is relative to
+    // the display, so it always uses the nominal 1000 nits
+    double peak_nits = OPENGL_DEFAULT_PEAK_NITS;
+    if( key.transfer == OPENGL_TRANSFER_PQ ) {
+        double frame_peak = opengl_frame_peak_nits( Frame );
+        if( frame_peak > 0.0 ) {
+            peak_nits = frame_peak;
+        } else if( current->format != -1 && current->transfer == key.transfer ) {
+            peak_nits = current->source_peak * OPENGL_REFERENCE_WHITE_NITS;
+        }
+    }
+    key.source_peak = ( float )( peak_nits / OPENGL_REFERENCE_WHITE_NITS );
+    if( key.source_peak < 1.0f ) key.source_peak = 1.0f;
+
+    if( current->format == key.format && current->colorspace == key.colorspace &&
+        current->range == key.range && current->transfer == key.transfer &&
+        current->primaries == key.primaries && current->source_peak == key.source_peak ) {
+        return;
+    }
+
+    *current = key;
+    GLuint program = opengl_programs[format->shader];
+    opengl_update_color_matrix( program, format, key.colorspace, key.range );
+    opengl_update_tone_map( program, &key );
+}
+
+static GLuint
+opengl_create_plane_texture( int unit ) {
+    GLuint texture = 0;
+    glCreateTextures( GL_TEXTURE_2D, 1, &texture );
+    glTextureParameteri( texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+    glTextureParameteri( texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+    glTextureParameteri( texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+    glTextureParameteri( texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    glBindTextureUnit( unit, texture );
+    return texture;
+}
+
+// NOTE: Textures are created with direct state access and stay bound to
+// units 0-2, the storage is allocated by opengl_allocate_textures once
+// the first frame tells us the size
 void
 opengl_generate_texture( unsigned int * textures ) {
-    glGenTextures( 3, textures );
     for( int i = 0; i < 3; ++i ) {
-        glBindTexture( GL_TEXTURE_2D, textures[i] );
-        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-        glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+        textures[i] = opengl_create_plane_texture( i );
+    }
+}
+
+// NOTE: Immutable storage can't be resized, so on a real resolution or
+// format change the plane textures are recreated. Every other frame only
+// updates texels. Planes the format doesn't use keep a 1x1 texture so
+// every sampler stays complete
+void
+opengl_allocate_textures( unsigned int * textures, const OpenGLFormat * format,
+                          const int * widths, const int * heights ) {
+    glDeleteTextures( 3, textures );
+    for( int i = 0; i < 3; ++i ) {
+        textures[i] = opengl_create_plane_texture( i );
+        if( i < format->plane_count ) {
+            glTextureStorage2D( textures[i], 1, format->internal_formats[i],
+                                widths[i], heights[i] );
+        } else {
+            glTextureStorage2D( textures[i], 1, GL_R8, 1, 1 );
+        }
     }
 }
 
@@ -57,24 +511,23 @@ opengl_create_compile_vertext_shader( const char * vs_source ) {
 }
 
 GLuint
-opengl_create_compile_fragment_shader( const char * fs_source ) {
+opengl_create_compile_fragment_shader( const char * * fs_sources, int count ) {
     GLuint result = glCreateShader( GL_FRAGMENT_SHADER );
-    glShaderSource( result, 1, &fs_source, NULL );
+    glShaderSource( result, count, fs_sources, NULL );
     glCompileShader( result );
     int success = 0;
     glGetShaderiv( result, GL_COMPILE_STATUS, &success );
     if( !success ){
         GLchar info_log[1024];
         glGetShaderInfoLog( result, 1024, NULL, info_log );
-        fprintf( stderr, "Failed to compile vertex shader: %s\n", info_log );
+        fprintf( stderr, "Failed to compile fragment shader: %s\n", info_log );
     }
     return result;
 }
 
-void
-opengl_make_program( void ) {
-    GLuint vertex_shader = opengl_create_compile_vertext_shader( vs_source );
-    GLuint fragment_shader = opengl_create_compile_fragment_shader( fs_source );
+static GLuint
+opengl_link_program( GLuint vertex_shader, const char * * fs_sources, int count ) {
+    GLuint fragment_shader = opengl_create_compile_fragment_shader( fs_sources, count );
 
     GLuint program = glCreateProgram();
     glAttachShader( program, vertex_shader );
@@ -88,7 +541,6 @@ opengl_make_program( void ) {
         fprintf( stderr, "Program did not link!\n" );
     }
 
-    glDeleteShader( vertex_shader );
     glDeleteShader( fragment_shader );
 
     glUseProgram( program );
@@ -96,13 +548,44 @@ opengl_make_program( void ) {
     glUniform1i( glGetUniformLocation( program, "textureY" ), 0 );
     glUniform1i( glGetUniformLocation( program, "textureU" ), 1 );
     glUniform1i( glGetUniformLocation( program, "textureV" ), 2 );
+    return program;
 }
 
+// NOTE: Links every shader variant up front, so a format change only
+// switches programs. The planar YUV one is left in use
 void
-opengl_render( void ) {
-    GLuint dummy_vertex_array_object = 0;
-    glGenVertexArrays( 1, &dummy_vertex_array_object );
-    glBindVertexArray( dummy_vertex_array_object );
+opengl_make_program( void ) {
+    GLuint vertex_shader = opengl_create_compile_vertext_shader( vs_source );
+
+    const char * planar[] = { fs_header, fs_sample_planar, fs_tone_map, fs_yuv_main };
+    const char * semiplanar[] = { fs_header, fs_sample_semiplanar, fs_tone_map, fs_yuv_main };
+    const char * rgb[] = { fs_header, fs_rgb_main };
+    opengl_programs[OPENGL_SHADER_SEMIPLANAR] = opengl_link_program( vertex_shader, semiplanar, 4 );
+    opengl_programs[OPENGL_SHADER_RGB] = opengl_link_program( vertex_shader, rgb, 2 );
+    opengl_programs[OPENGL_SHADER_PLANAR] = opengl_link_program( vertex_shader, planar, 4 );
+    for( int i = 0; i < OPENGL_SHADER_COUNT; ++i ) {
+        opengl_program_colors[i].format = -1;
+    }
+
+    glDeleteShader( vertex_shader );
+
+    // NOTE: Rows are addressed through GL_UNPACK_ROW_LENGTH, which must not
+    // be rounded up again
+    glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+}
+
+typedef struct {
+    GLuint vertex_array_object;
+    GLuint vertex_buffer_object;
+    GLuint element_array_buffer_object;
+} OpenGLGeometry;
+
+// NOTE: The quad covers the whole viewport. It is created once and stays
+// bound for the lifetime of the context
+void
+opengl_create_geometry( OpenGLGeometry * geometry ) {
+    glGenVertexArrays( 1, &geometry->vertex_array_object );
+    glBindVertexArray( geometry->vertex_array_object );
 
     GLfloat vertices[] = {
         1.0,  1.0, 0.0,    1.0, 0.0,
@@ -116,33 +599,250 @@ opengl_render( void ) {
         1, 2, 3
     };
 
-    GLuint dummy_vertex_buffer_object = 0;
-    GLuint element_array_buffer_object = 0;
+    glGenBuffers( 1, &geometry->vertex_buffer_object );
+    glGenBuffers( 1, &geometry->element_array_buffer_object );
 
-    glGenBuffers( 1, &dummy_vertex_buffer_object );
-    glGenBuffers( 1, &element_array_buffer_object );
-
-    glBindBuffer( GL_ARRAY_BUFFER, dummy_vertex_buffer_object );
+    glBindBuffer( GL_ARRAY_BUFFER, geometry->vertex_buffer_object );
     glBufferData( GL_ARRAY_BUFFER, 4 * 5 * sizeof( GLfloat ),
-                 vertices, GL_DYNAMIC_DRAW );
+                 vertices, GL_STATIC_DRAW );
 
-    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, element_array_buffer_object );
+    glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, geometry->element_array_buffer_object );
     glBufferData( GL_ELEMENT_ARRAY_BUFFER, 2 * 3 * sizeof( unsigned int ),
                  indices, GL_STATIC_DRAW );
 
     glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof( float ), NULL );
     glEnableVertexAttribArray( 0 );
 
-    glVertexAttribPointer( 1, 3, GL_FLOAT, GL_FALSE, 5 * sizeof( float ),
+    glVertexAttribPointer( 1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof( float ),
                           ( void * )( 3 * sizeof( float ) ) );
     glEnableVertexAttribArray( 1 );
 }
 
 void
-copy_frame_to_texture( AVFrame * Frame, unsigned int * textures ) {
+opengl_destroy_geometry( OpenGLGeometry * geometry ) {
+    glBindVertexArray( 0 );
+    glDeleteBuffers( 1, &geometry->element_array_buffer_object );
+    glDeleteBuffers( 1, &geometry->vertex_buffer_object );
+    glDeleteVertexArrays( 1, &geometry->vertex_array_object );
+}
+
+#define OPENGL_MAX_UPLOAD_BUFFERS 8
+#define OPENGL_MAX_STAGING_SLOTS  64
+
+// NOTE: Ring of pixel unpack buffers. The CPU copies frame N+1 into one
+// buffer while the driver is still transferring frame N out of another,
+// so glTexSubImage2D returns without waiting for the copy. Each buffer has
+// a fence so we never overwrite one the GPU is still reading from.
+// A count of 0 uploads synchronously from client memory.
+//
+// The persistent mode instead keeps one GL_MAP_PERSISTENT_BIT buffer mapped
+// for the lifetime of the context and splits it into slots. Another thread
+// (the decoder) writes frames straight into a slot, so the only copy between
+// decoder and GPU is the one into mapped memory. Uploaded slots wait in a
+// pending queue until their fence signals and are then handed back with
+// opengl_reclaim_staging_slot
+typedef struct {
+    GLuint     buffers[OPENGL_MAX_UPLOAD_BUFFERS];
+    GLsync     fences[OPENGL_MAX_UPLOAD_BUFFERS];
+    GLsizeiptr sizes[OPENGL_MAX_UPLOAD_BUFFERS];
+    int        count;
+    int        index;
+    uint64_t   fence_waits;
+
+    GLuint     staging_buffer;
+    uint8_t  * staging_memory;
+    GLsizeiptr staging_slot_size;
+    int        staging_slot_count;
+    int        pending_slots[OPENGL_MAX_STAGING_SLOTS];
+    GLsync     pending_fences[OPENGL_MAX_STAGING_SLOTS];
+    int        pending_head;
+    int        pending_count;
+} OpenGLUploader;
+
+void
+opengl_create_uploader( OpenGLUploader * uploader, int count ) {
+    memset( uploader, 0, sizeof( *uploader ) );
+    if( count > OPENGL_MAX_UPLOAD_BUFFERS ) count = OPENGL_MAX_UPLOAD_BUFFERS;
+    if( count < 0 ) count = 0;
+
+    uploader->count = count;
+    if( count > 0 ) {
+        glGenBuffers( count, uploader->buffers );
+    }
+}
+
+// NOTE: Needs GL 4.4 buffer storage. Returns false if the driver can't give
+// us a persistent coherent mapping, the uploader is then left empty
+bool
+opengl_create_persistent_uploader( OpenGLUploader * uploader,
+                                   GLsizeiptr slot_size, int slot_count ) {
+    memset( uploader, 0, sizeof( *uploader ) );
+    if( !glBufferStorage || slot_count < 1 || slot_count > OPENGL_MAX_STAGING_SLOTS ) {
+        return false;
+    }
+
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    GLsizeiptr size = slot_size * slot_count;
+
+    glGenBuffers( 1, &uploader->staging_buffer );
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, uploader->staging_buffer );
+    glBufferStorage( GL_PIXEL_UNPACK_BUFFER, size, NULL, flags );
+    uploader->staging_memory = ( uint8_t * )glMapBufferRange( GL_PIXEL_UNPACK_BUFFER,
+                                                              0, size, flags );
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+
+    if( !uploader->staging_memory ) {
+        glDeleteBuffers( 1, &uploader->staging_buffer );
+        uploader->staging_buffer = 0;
+        return false;
+    }
+
+    uploader->staging_slot_size = slot_size;
+    uploader->staging_slot_count = slot_count;
+    return true;
+}
+
+uint8_t *
+opengl_staging_slot_memory( OpenGLUploader * uploader, int slot ) {
+    return uploader->staging_memory + slot * uploader->staging_slot_size;
+}
+
+// NOTE: Slot the frame's planes live in or -1 if it isn't staged
+int
+opengl_staging_slot( OpenGLUploader * uploader, const AVFrame * Frame ) {
+    if( !uploader->staging_memory ) return -1;
+
+    uintptr_t base = ( uintptr_t )uploader->staging_memory;
+    uintptr_t pointer = ( uintptr_t )Frame->data[0];
+    uintptr_t size = ( uintptr_t )( uploader->staging_slot_size * uploader->staging_slot_count );
+    if( pointer < base || pointer >= base + size ) {
+        return -1;
+    }
+    return ( int )( ( pointer - base ) / uploader->staging_slot_size );
+}
+
+static void
+opengl_push_pending_slot( OpenGLUploader * uploader, int slot, GLsync fence ) {
+    int index = ( uploader->pending_head + uploader->pending_count ) % OPENGL_MAX_STAGING_SLOTS;
+    uploader->pending_slots[index] = slot;
+    uploader->pending_fences[index] = fence;
+    ++uploader->pending_count;
+}
+
+// NOTE: For staged frames that are dropped without being uploaded. The
+// slot goes through the pending queue so slots come back in order
+void
+opengl_release_staged_frame( OpenGLUploader * uploader, const AVFrame * Frame ) {
+    int slot = opengl_staging_slot( uploader, Frame );
+    if( slot >= 0 ) {
+        opengl_push_pending_slot( uploader, slot, 0 );
+    }
+}
+
+// NOTE: Returns the memory of a slot the GPU has finished reading, or NULL.
+// Never blocks, call it until it returns NULL
+uint8_t *
+opengl_reclaim_staging_slot( OpenGLUploader * uploader ) {
+    if( uploader->pending_count == 0 ) return NULL;
+
+    int head = uploader->pending_head;
+    GLsync fence = uploader->pending_fences[head];
+    if( fence ) {
+        if( glClientWaitSync( fence, 0, 0 ) == GL_TIMEOUT_EXPIRED ) return NULL;
+        glDeleteSync( fence );
+    }
+
+    uploader->pending_head = ( head + 1 ) % OPENGL_MAX_STAGING_SLOTS;
+    --uploader->pending_count;
+    return opengl_staging_slot_memory( uploader, uploader->pending_slots[head] );
+}
+
+void
+opengl_destroy_uploader( OpenGLUploader * uploader ) {
+    for( int i = 0; i < uploader->count; ++i ) {
+        if( uploader->fences[i] ) glDeleteSync( uploader->fences[i] );
+    }
+    if( uploader->count > 0 ) {
+        glDeleteBuffers( uploader->count, uploader->buffers );
+    }
+    uploader->count = 0;
+
+    while( uploader->pending_count > 0 ) {
+        int head = uploader->pending_head;
+        if( uploader->pending_fences[head] ) glDeleteSync( uploader->pending_fences[head] );
+        uploader->pending_head = ( head + 1 ) % OPENGL_MAX_STAGING_SLOTS;
+        --uploader->pending_count;
+    }
+
+    if( uploader->staging_buffer ) {
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, uploader->staging_buffer );
+        glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+        glDeleteBuffers( 1, &uploader->staging_buffer );
+        uploader->staging_buffer = 0;
+        uploader->staging_memory = NULL;
+    }
+}
+
+// NOTE: Blocks until the GPU is done with the buffer in the given slot
+static void
+opengl_wait_upload_slot( OpenGLUploader * uploader, int slot ) {
+    GLsync fence = uploader->fences[slot];
+    if( !fence ) return;
+
+    GLenum status = glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0 );
+    if( status == GL_TIMEOUT_EXPIRED ) {
+        ++uploader->fence_waits;
+        do {
+            status = glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000 );
+        } while( status == GL_TIMEOUT_EXPIRED );
+    }
+
+    glDeleteSync( fence );
+    uploader->fences[slot] = 0;
+}
+
+// NOTE: GL_UNPACK_ROW_LENGTH counts pixels, so a packed plane whose line
+// size isn't a whole number of pixels goes up one row at a time
+static void
+opengl_upload_plane( unsigned int texture, const OpenGLFormat * format, int plane,
+                     int width, int height, int linesize, const uint8_t * pixels ) {
+    int bytes_per_pixel = format->bytes_per_pixel[plane];
+    GLenum pixel_format = format->pixel_formats[plane];
+    if( linesize % bytes_per_pixel != 0 ) {
+        glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+        for( int row = 0; row < height; ++row ) {
+            glTextureSubImage2D( texture, 0, 0, row, width, 1, pixel_format,
+                                 format->type, pixels + ( size_t )row * linesize );
+        }
+        return;
+    }
+
+    glPixelStorei( GL_UNPACK_ROW_LENGTH, linesize / bytes_per_pixel );
+    glTextureSubImage2D( texture,
+                         0,
+                         0,
+                         0,
+                         width,
+                         height,
+                         pixel_format,
+                         format->type,
+                         pixels );
+}
+
+void
+opengl_upload_frame( AVFrame * Frame, unsigned int * textures,
+                     OpenGLUploader * uploader ) {
     FrameData * frame_data = ( FrameData * )Frame->opaque;
+    const OpenGLFormat * format = opengl_find_format( Frame->format );
+    if( !format ) return;
 
     bool changed = false;
+    if( frame_data->texture_format != Frame->format ) {
+        frame_data->texture_format = Frame->format;
+        changed = true;
+    }
+
     if( frame_data->texture_width != Frame->width ) {
         frame_data->texture_width = Frame->width;
         changed = true;
@@ -153,121 +853,275 @@ copy_frame_to_texture( AVFrame * Frame, unsigned int * textures ) {
         changed = true;
     }
 
-    float tr = ( float )frame_data->texture_width / frame_data->texture_height;
-    float vr = ( float )Frame->width / Frame->height;
-    float r = tr / vr;
-    float vertices[] = {
-        1.0, 0.0, 0.0, 1.0, 0.0,
-        1.0, 0.0, 0.0, 1.0, 1.0,
-        -1.0, 0.0, 0.0, 0.0, 1.0,
-        -1.0, 0.0, 0.0, 0.0, 0.0,
-    };
+    int widths[3];
+    int heights[3];
+    opengl_plane_sizes( format, Frame->width, Frame->height, widths, heights );
+    const uint8_t * pixels[3] = { Frame->data[0], Frame->data[1], Frame->data[2] };
 
-    if( r != frame_data->ratio ) {
-        frame_data->ratio = r;
-        if( tr > vr ) {
-            float p = vr / tr;
-            vertices[1] = p;
-            vertices[6] = -p;
-            vertices[11] = -p;
-            vertices[16] = p;
-        } else if ( tr < vr ) {
-            vertices[0] = r;
-            vertices[1] = 1.0;
-            vertices[5] = r;
-            vertices[6] = -1.0;
-            vertices[10] = r;
-            vertices[11] = -1.0;
-            vertices[15] = r;
-            vertices[16] = 1.0;
-        } else {
-            vertices[1] = 1.0;
-            vertices[6] = -1.0;
-            vertices[11] = -1.0;
-            vertices[16] = 1.0;
-        }
+    if( changed ) {
+        opengl_allocate_textures( textures, format, widths, heights );
+        glUseProgram( opengl_programs[format->shader] );
+    }
+    opengl_update_colors( format, Frame );
 
-        glBufferSubData( GL_ARRAY_BUFFER, 0, 20 * sizeof( float ), vertices );
+    int staging_slot = opengl_staging_slot( uploader, Frame );
+    if( staging_slot >= 0 ) {
+        // NOTE: The planes are already in GPU visible memory, the texture
+        // upload just sources them by offset
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, uploader->staging_buffer );
+        for( int i = 0; i < format->plane_count; ++i ) {
+            opengl_upload_plane( textures[i], format, i, widths[i], heights[i], Frame->linesize[i],
+                                 ( const uint8_t * )( Frame->data[i] - uploader->staging_memory ) );
+        }
+        glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+        opengl_push_pending_slot( uploader, staging_slot,
+                                  glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 ) );
+        return;
     }
 
-    glActiveTexture( GL_TEXTURE0 );
-    glBindTexture( GL_TEXTURE_2D, textures[0] );
-    glPixelStorei( GL_UNPACK_ROW_LENGTH, Frame->linesize[0] );
+    int slot = uploader->index;
+    bool use_buffer = uploader->count > 0;
+    if( use_buffer ) {
+        GLsizeiptr offsets[3];
+        GLsizeiptr size = 0;
+        for( int i = 0; i < format->plane_count; ++i ) {
+            offsets[i] = size;
+            size += ( GLsizeiptr )Frame->linesize[i] * heights[i];
+        }
 
-    if ( changed ) {
-        glTexImage2D( GL_TEXTURE_2D,
-                      0,
-                      GL_RED,
-                      Frame->width,
-                      Frame->height,
-                      0,
-                      GL_RED,
-                      GL_UNSIGNED_BYTE,
-                      Frame->data[0] );
-    } else {
-        glTexSubImage2D( GL_TEXTURE_2D,
-                         0,
-                         0,
-                         0,
-                         Frame->width,
-                         Frame->height,
-                         GL_RED,
-                         GL_UNSIGNED_BYTE,
-                         Frame->data[0] );
-    }
-
-    glActiveTexture( GL_TEXTURE1 );
-    glBindTexture( GL_TEXTURE_2D, textures[1] );
-    glPixelStorei( GL_UNPACK_ROW_LENGTH, Frame->linesize[1] );
-
-    if ( changed ) {
-        glTexImage2D( GL_TEXTURE_2D,
-                      0,
-                      GL_RED,
-                      Frame->width / 2,
-                      Frame->height / 2,
-                      0,
-                      GL_RED,
-                      GL_UNSIGNED_BYTE,
-                      Frame->data[1] );
-    } else {
-        glTexSubImage2D( GL_TEXTURE_2D,
-                         0,
-                         0,
-                         0,
-                         Frame->width / 2,
-                         Frame->height / 2,
-                         GL_RED,
-                         GL_UNSIGNED_BYTE,
-                         Frame->data[1] );
-    }
-
-    glActiveTexture( GL_TEXTURE2 );
-    glBindTexture( GL_TEXTURE_2D, textures[2] );
-    glPixelStorei( GL_UNPACK_ROW_LENGTH, Frame->linesize[2] );
-    if ( changed ) {
-        glTexImage2D( GL_TEXTURE_2D,
-                      0,
-                      GL_RED,
-                      Frame->width / 2,
-                      Frame->height / 2,
-                      0,
-                      GL_RED,
-                      GL_UNSIGNED_BYTE,
-                      Frame->data[2] );
-    } else {
-        glTexSubImage2D( GL_TEXTURE_2D,
-                         0,
-                         0,
-                         0,
-                         Frame->width / 2,
-                         Frame->height / 2,
-                         GL_RED,
-                         GL_UNSIGNED_BYTE,
-                         Frame->data[2] );
+        opengl_wait_upload_slot( uploader, slot );
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, uploader->buffers[slot] );
+        if( uploader->sizes[slot] < size ) {
+            glBufferData( GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW );
+            uploader->sizes[slot] = size;
+        }
+
+        // NOTE: The fence already told us the GPU is done with this buffer,
+        // so mapping doesn't need to synchronize again
+        uint8_t * mapped = ( uint8_t * )glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                                          GL_MAP_WRITE_BIT |
+                                                          GL_MAP_INVALIDATE_BUFFER_BIT |
+                                                          GL_MAP_UNSYNCHRONIZED_BIT );
+        if( mapped ) {
+            for( int i = 0; i < format->plane_count; ++i ) {
+                memcpy( mapped + offsets[i], Frame->data[i],
+                        ( size_t )Frame->linesize[i] * heights[i] );
+                pixels[i] = ( const uint8_t * )offsets[i];
+            }
+            glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+        } else {
+            // NOTE: Fall back to client memory for this frame
+            glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+            use_buffer = false;
+        }
+    }
+
+    for( int i = 0; i < format->plane_count; ++i ) {
+        opengl_upload_plane( textures[i], format, i, widths[i], heights[i],
+                             Frame->linesize[i], pixels[i] );
     }
 
     glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
 
+    if( use_buffer ) {
+        uploader->fences[slot] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+        uploader->index = ( slot + 1 ) % uploader->count;
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+    }
+}
+
+void
+opengl_draw( void ) {
     glDrawElements( GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0 );
-}
\ No newline at end of file
+}
+
+void
+copy_frame_to_texture( AVFrame * Frame, unsigned int * textures,
+                       OpenGLUploader * uploader ) {
+    opengl_upload_frame( Frame, textures, uploader );
+    opengl_draw();
+}
+
+// NOTE: Scaling to the viewport. Bilinear is what the plane textures'
+// GL_LINEAR filter does for free while converting, so it needs no extra
+// pass. Bicubic and Lanczos are separable: the frame is first converted
+// to RGB at its own size, then filtered horizontally into a texture that
+// is viewport wide and frame high, then vertically into the viewport. When
+// shrinking, the kernel is stretched by the scale factor so every source
+// pixel contributes and fine detail doesn't alias.
+//
+// The passes draw a triangle that covers the viewport without any vertex
+// data and sample texture unit 3, the planes keep units 0-2
+typedef enum {
+    OPENGL_SCALE_BILINEAR,
+    OPENGL_SCALE_BICUBIC,
+    OPENGL_SCALE_LANCZOS,
+    OPENGL_SCALE_COUNT
+} OpenGLScaleFilter;
+
+const char * opengl_scale_filter_names[] = { "bilinear", "bicubic", "lanczos" };
+
+const char * vs_fullscreen_source =
+"#version 330 core\n"
+"out vec2 TexCoord;\n"
+"void main() {\n"
+"    vec2 position = vec2( ( gl_VertexID << 1 ) & 2, gl_VertexID & 2 );\n"
+"    TexCoord = position;\n"
+"    gl_Position = vec4( position * 2.0 - 1.0, 0.0, 1.0 );\n"
+"}\n";
+
+// NOTE: Catmull-Rom for bicubic and 3-lobe Lanczos. direction picks the
+// axis, scale is how many source pixels one output pixel covers (at least 1)
+const char * fs_scale_source =
+"#version 330 core\n"
+"out vec4 FragColor;\n"
+"in vec2 TexCoord;\n"
+"uniform sampler2D source;\n"
+"uniform vec2 direction;\n"
+"uniform float scale;\n"
+"uniform int filterType;\n"
+"const float pi = 3.14159265;\n"
+"float kernel( float x ) {\n"
+"    x = abs( x );\n"
+"    if( filterType == 2 ) {\n"
+"        if( x < 0.00001 ) return 1.0;\n"
+"        if( x >= 3.0 ) return 0.0;\n"
+"        return 3.0 * sin( pi * x ) * sin( pi * x / 3.0 ) / ( pi * pi * x * x );\n"
+"    }\n"
+"    if( x < 1.0 ) return ( 1.5 * x - 2.5 ) * x * x + 1.0;\n"
+"    if( x < 2.0 ) return ( ( -0.5 * x + 2.5 ) * x - 4.0 ) * x + 2.0;\n"
+"    return 0.0;\n"
+"}\n"
+"void main() {\n"
+"    float size = dot( vec2( textureSize( source, 0 ) ), direction );\n"
+"    float position = dot( TexCoord, direction ) * size - 0.5;\n"
+"    float support = ( filterType == 2 ? 3.0 : 2.0 ) * scale;\n"
+"    int first = int( ceil( position - support ) );\n"
+"    int last = int( floor( position + support ) );\n"
+"    vec2 across = TexCoord * ( vec2( 1.0 ) - direction );\n"
+"    vec3 sum = vec3( 0.0 );\n"
+"    float weights = 0.0;\n"
+"    for( int i = first; i <= last; ++i ) {\n"
+"        float weight = kernel( ( float( i ) - position ) / scale );\n"
+"        sum += weight * texture( source, across + direction * ( ( float( i ) + 0.5 ) / size ) ).rgb;\n"
+"        weights += weight;\n"
+"    }\n"
+"    FragColor = vec4( clamp( sum / weights, 0.0, 1.0 ), 1.0 );\n"
+"}\n";
+
+typedef struct {
+    OpenGLScaleFilter filter;
+    GLuint            program;
+    GLuint            framebuffers[2];
+    GLuint            textures[2];
+    int               source_width;
+    int               source_height;
+    int               output_width;
+    int               output_height;
+} OpenGLScaler;
+
+void
+opengl_create_scaler( OpenGLScaler * scaler, OpenGLScaleFilter filter ) {
+    memset( scaler, 0, sizeof( *scaler ) );
+    scaler->filter = filter;
+    if( filter == OPENGL_SCALE_BILINEAR ) return;
+
+    GLint current_program = 0;
+    glGetIntegerv( GL_CURRENT_PROGRAM, &current_program );
+
+    GLuint vertex_shader = opengl_create_compile_vertext_shader( vs_fullscreen_source );
+    scaler->program = opengl_link_program( vertex_shader, &fs_scale_source, 1 );
+    glUniform1i( glGetUniformLocation( scaler->program, "source" ), 3 );
+    glUniform1i( glGetUniformLocation( scaler->program, "filterType" ), filter );
+    glDeleteShader( vertex_shader );
+
+    glUseProgram( current_program );
+}
+
+static void
+opengl_scaler_delete_targets( OpenGLScaler * scaler ) {
+    glDeleteFramebuffers( 2, scaler->framebuffers );
+    glDeleteTextures( 2, scaler->textures );
+    memset( scaler->framebuffers, 0, sizeof( scaler->framebuffers ) );
+    memset( scaler->textures, 0, sizeof( scaler->textures ) );
+}
+
+// NOTE: Target 0 is the converted frame, target 1 the horizontal pass.
+// Half floats keep 10-bit and tone mapped output from banding
+static void
+opengl_scaler_allocate_targets( OpenGLScaler * scaler, int source_width, int source_height,
+                                int output_width, int output_height ) {
+    opengl_scaler_delete_targets( scaler );
+    int widths[2] = { source_width, output_width };
+    for( int i = 0; i < 2; ++i ) {
+        glCreateTextures( GL_TEXTURE_2D, 1, &scaler->textures[i] );
+        glTextureParameteri( scaler->textures[i], GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+        glTextureParameteri( scaler->textures[i], GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+        glTextureParameteri( scaler->textures[i], GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+        glTextureParameteri( scaler->textures[i], GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+        glTextureStorage2D( scaler->textures[i], 1, GL_RGBA16F, widths[i], source_height );
+        glCreateFramebuffers( 1, &scaler->framebuffers[i] );
+        glNamedFramebufferTexture( scaler->framebuffers[i], GL_COLOR_ATTACHMENT0,
+                                   scaler->textures[i], 0 );
+    }
+    scaler->source_width = source_width;
+    scaler->source_height = source_height;
+    scaler->output_width = output_width;
+    scaler->output_height = output_height;
+}
+
+static void
+opengl_scaler_pass( OpenGLScaler * scaler, int pass, float scale ) {
+    glBindTextureUnit( 3, scaler->textures[pass] );
+    glUniform2f( glGetUniformLocation( scaler->program, "direction" ),
+                 pass == 0 ? 1.0f : 0.0f, pass == 0 ? 0.0f : 1.0f );
+    glUniform1f( glGetUniformLocation( scaler->program, "scale" ), scale > 1.0f ? scale : 1.0f );
+    glDrawArrays( GL_TRIANGLES, 0, 3 );
+}
+
+// NOTE: Draws the uploaded frame into the current framebuffer, scaled to a
+// viewport of output_width x output_height at the origin. Call instead of
+// opengl_draw with the frame's program in use, which is left in use
+void
+opengl_scaler_draw( OpenGLScaler * scaler, int source_width, int source_height,
+                    int output_width, int output_height ) {
+    if( scaler->filter == OPENGL_SCALE_BILINEAR ||
+        ( source_width == output_width && source_height == output_height ) ) {
+        opengl_draw();
+        return;
+    }
+
+    if( scaler->source_width != source_width || scaler->source_height != source_height ||
+        scaler->output_width != output_width || scaler->output_height != output_height ) {
+        opengl_scaler_allocate_targets( scaler, source_width, source_height,
+                                        output_width, output_height );
+    }
+
+    GLint target = 0;
+    GLint frame_program = 0;
+    glGetIntegerv( GL_DRAW_FRAMEBUFFER_BINDING, &target );
+    glGetIntegerv( GL_CURRENT_PROGRAM, &frame_program );
+
+    glBindFramebuffer( GL_DRAW_FRAMEBUFFER, scaler->framebuffers[0] );
+    glViewport( 0, 0, source_width, source_height );
+    opengl_draw();
+
+    glUseProgram( scaler->program );
+    glBindFramebuffer( GL_DRAW_FRAMEBUFFER, scaler->framebuffers[1] );
+    glViewport( 0, 0, output_width, source_height );
+    opengl_scaler_pass( scaler, 0, ( float )source_width / output_width );
+
+    glBindFramebuffer( GL_DRAW_FRAMEBUFFER, target );
+    glViewport( 0, 0, output_width, output_height );
+    opengl_scaler_pass( scaler, 1, ( float )source_height / output_height );
+
+    glUseProgram( frame_program );
+}
+
+void
+opengl_destroy_scaler( OpenGLScaler * scaler ) {
+    opengl_scaler_delete_targets( scaler );
+    if( scaler->program ) glDeleteProgram( scaler->program );
+    memset( scaler, 0, sizeof( *scaler ) );
+}
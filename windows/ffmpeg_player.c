@@ -9,18 +9,20 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/time.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/mastering_display_metadata.h>
 
 
 typedef struct {
-    float ratio;
     int   texture_width;
     int   texture_height;
+    int   texture_format;
 } FrameData;
 
 // NOTE: Order is important
@@ -107,7 +109,6 @@ wWinMain( HINSTANCE instance, HINSTANCE prevInstance,
     AVFrame           * frame_copy;
     AVPacket          * packet;
     struct SwsContext * img_convert_ctx;
-    unsigned char     * buffer;
     int                 video_index;
     FrameData           frame_data;
 
@@ -192,15 +193,21 @@ wWinMain( HINSTANCE instance, HINSTANCE prevInstance,
     }
 
     frame = av_frame_alloc();
+    frame_data.texture_width = -1;
+    frame_data.texture_height = -1;
+    frame_data.texture_format = -1;
+
     frame_copy = av_frame_alloc();
 
-    buffer = ( unsigned char * )av_malloc( av_image_get_buffer_size( AV_PIX_FMT_YUV420P,
-                                                                     av_codec_ctx->width,
-                                                                     av_codec_ctx->height,
-                                                                     1 ) );
-    av_image_fill_arrays( frame_copy->data, frame_copy->linesize, buffer,
-                          AV_PIX_FMT_YUV420P, av_codec_ctx->width,
-                          av_codec_ctx->height, 1 );
+    // NOTE: The conversion target is allocated once and reused for every
+    // frame that needs swscale
+    frame_copy->width = av_codec_ctx->width;
+    frame_copy->height = av_codec_ctx->height;
+    frame_copy->format = AV_PIX_FMT_YUV420P;
+    if( av_frame_get_buffer( frame_copy, 0 ) < 0 ) {
+        // TODO: Error
+        return -1;
+    }
 
     img_convert_ctx = sws_getContext( av_codec_ctx->width,
                                       av_codec_ctx->height,
@@ -349,8 +356,12 @@ wWinMain( HINSTANCE instance, HINSTANCE prevInstance,
     glClearColor( 0.0, 0.0, 0.0, 1.0 );
 
     unsigned int textures[3];
+    OpenGLGeometry geometry;
+    OpenGLUploader uploader;
     opengl_generate_texture( textures );
     opengl_make_program();
+    opengl_create_geometry( &geometry );
+    opengl_create_uploader( &uploader, 3 );
 
     ShowWindow( window, showWindow );
 
@@ -366,8 +377,6 @@ wWinMain( HINSTANCE instance, HINSTANCE prevInstance,
                 continue;
             }
 
-            opengl_render();
-
             bool okay = false;
             while( !okay ) {
                 int ret = avcodec_send_packet( av_codec_ctx, packet );
@@ -377,19 +386,21 @@ wWinMain( HINSTANCE instance, HINSTANCE prevInstance,
                 }
 
                 while( ( ret = avcodec_receive_frame( av_codec_ctx, frame ) ) >= 0 ) {
-                    frame_copy->width = frame->width;
-                    frame_copy->height = frame->height;
-                    frame_copy->format = AV_PIX_FMT_YUV420P;
+                    // NOTE: Frames the shader can sample are uploaded
+                    // straight from the decoder's buffers
+                    AVFrame * upload_frame = frame;
+                    if( !opengl_can_render_format( frame->format ) ) {
+                        sws_scale( img_convert_ctx,
+                                   ( const unsigned char * const * )frame->data,
+                                   frame->linesize, 0, av_codec_ctx->height,
+                                   frame_copy->data, frame_copy->linesize);
+                        upload_frame = frame_copy;
+                    }
                     // NOTE: According to ffmpeg documentation we can set our
                     // private data, so we use it to get later our texture
-                    // width/height and ratio and avoiding global variables
-                    frame_copy->opaque = &frame_data;
-                    av_frame_get_buffer( frame_copy, 0 );
-                    sws_scale( img_convert_ctx,
-                               ( const unsigned char * const * )frame->data,
-                               frame->linesize, 0, av_codec_ctx->height,
-                               frame_copy->data, frame_copy->linesize);
-                    copy_frame_to_texture( frame_copy, textures );
+                    // width/height and format and avoiding global variables
+                    upload_frame->opaque = &frame_data;
+                    copy_frame_to_texture( upload_frame, textures, &uploader );
 
                     while( PeekMessageA( &message, 0, 0, 0, PM_REMOVE ) ) {
                         TranslateMessage( &message );
@@ -403,7 +414,6 @@ wWinMain( HINSTANCE instance, HINSTANCE prevInstance,
                     uint64_t frame_pts = 1000000 * timebase * frame->pts / 1000;
 
                     av_frame_unref( frame );
-                    av_frame_unref( frame_copy );
                     // NOTE: It assumes our CPU fast enough to decode, so frame
                     // presentation timestamp should be always greater
                     // than real elapsed time
@@ -422,6 +432,8 @@ wWinMain( HINSTANCE instance, HINSTANCE prevInstance,
     }
 
 END:
+    opengl_destroy_uploader( &uploader );
+    opengl_destroy_geometry( &geometry );
     FreeConsole();
     sws_freeContext( img_convert_ctx );
     avcodec_free_context( &av_codec_ctx );